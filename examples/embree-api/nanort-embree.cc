@@ -525,7 +525,9 @@ RTCORE_API void rtcIntersect(RTCScene scene, RTCRay &rtc_ray) {
   ray.dir[1] = rtc_ray.dir[1];
   ray.dir[2] = rtc_ray.dir[2];
 
-  // TODO(LTE): .time, .mask
+  ray.time = rtc_ray.time;
+
+  // TODO(LTE): .mask
 
   ray.min_t = rtc_ray.tnear;
   ray.max_t = rtc_ray.tfar;
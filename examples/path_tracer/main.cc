@@ -687,12 +687,7 @@ bool CheckForOccluder(float3 p1, float3 p2, const Mesh &mesh,
 
   nanort::TriangleIntersector<> triangle_intersector(mesh.vertices, mesh.faces,
                                                      sizeof(float) * 3);
-  nanort::TriangleIntersection<> isect;
-  if (!accel.Traverse(shadow_ray, triangle_intersector, &isect)) {
-    return false;
-  }
-
-  return true;
+  return accel.Occluded(shadow_ray, triangle_intersector);
 }
 
 int main(int argc, char **argv) {
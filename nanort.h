@@ -38,21 +38,35 @@ THE SOFTWARE.
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <functional>
 #include <limits>
 #include <memory>
+#include <new>
 #include <queue>
 #include <string>
+#include <utility>
 #include <vector>
 
+#if defined(__linux__)
+#include <sys/mman.h>  // HugePageAllocator
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 // compiler macros
 //
 // NANORT_USE_CPP11_FEATURE : Enable C++11 feature
 // NANORT_ENABLE_PARALLEL_BUILD : Enable parallel BVH build.
 // NANORT_ENABLE_SERIALIZATION : Enable serialization feature for built BVH.
+// NANORT_ENABLE_SIMD : Enable SIMD(AVX/SSE) leaf triangle test. The ISA is
+//   selected by the compiler flags(e.g. `-mavx`), so compile all translation
+//   units which include nanort.h with the same flags.
 //
 // Parallelized BVH build is supported on C++11 thread version.
 // OpenMP version is not fully tested.
@@ -61,8 +75,40 @@ THE SOFTWARE.
 
 // Some constants
 #define kNANORT_MAX_STACK_DEPTH (512)
+// BVH build limits tree depth to this value so that traversal stack never
+// overflows(stack usage is at most `depth + 1` entries).
+#define kNANORT_MAX_TREE_DEPTH (kNANORT_MAX_STACK_DEPTH - 1)
 #define kNANORT_MIN_PRIMITIVES_FOR_PARALLEL_BUILD (1024 * 8)
 #define kNANORT_SHALLOW_DEPTH (4)  // will create 2**N subtrees
+#define kNANORT_MAX_MULTI_HITS (128)  // max hits of multi-hit traversal
+#define kNANORT_RAYS_IN_FLIGHT (8)  // rays per thread of interleaved traversal
+#define kNANORT_MAX_TILE_ENTRY_NODES (64)  // entry subtrees of tile traversal
+#define kNANORT_BUNDLE_SIZE (64)  // rays per bundle of ray bundle traversal
+#define kNANORT_BUNDLE_LEAF_SIZE (8)  // primitives per leaf chunk of ray bundle
+
+// SIMD leaf triangle test(float). AVX tests 8 triangles at once, SSE 4.
+#if defined(NANORT_ENABLE_SIMD)
+#if defined(__AVX__)
+#include <immintrin.h>
+#define NANORT_SIMD_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define NANORT_SIMD_SSE
+#endif
+#endif
+#define kNANORT_LEAF_SIMD_WIDTH (8)  // triangles per leaf test
+
+// Software prefetch(hint only)
+#if defined(__GNUC__) || defined(__clang__)
+#define NANORT_PREFETCH(addr) __builtin_prefetch(addr)
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#define NANORT_PREFETCH(addr) \
+  _mm_prefetch(reinterpret_cast<const char *>(addr), _MM_HINT_T0)
+#else
+#define NANORT_PREFETCH(addr)
+#endif
 
 #ifdef NANORT_USE_CPP11_FEATURE
 // Assume C++11 compiler has thread support.
@@ -93,6 +139,18 @@ typedef enum {
   RAY_TYPE_REFRACTION = 0x10
 } RayType;
 
+// Optional primitive checks of triangle intersectors(`Features` template
+// parameter of `TriangleIntersector` etc).
+// Checks which are not enabled are removed at compile time, e.g.
+// `TRIANGLE_FEATURE_NONE` compiles to plain watertight ray-triangle test.
+typedef enum {
+  TRIANGLE_FEATURE_NONE = 0x0,
+  TRIANGLE_FEATURE_PRIM_IDS_RANGE = 0x1,  // BVHTraceOptions::prim_ids_range
+  TRIANGLE_FEATURE_SKIP_PRIM_ID = 0x2,    // BVHTraceOptions::skip_prim_id
+  TRIANGLE_FEATURE_CULL_BACK_FACE = 0x4,  // BVHTraceOptions::cull_back_face
+  TRIANGLE_FEATURE_ALL = 0x7
+} TriangleIntersectorFeature;
+
 #ifdef __clang__
 #pragma clang diagnostic push
 #if __has_warning("-Wzero-as-null-pointer-constant")
@@ -310,6 +368,154 @@ class StackVector
 
 // ----------------------------------------------------------------------------
 
+// Rebind allocator `Alloc` to value type `U`.
+// `Alloc::rebind` is deprecated in C++17(removed in C++20), so use
+// std::allocator_traits when available.
+template <class Alloc, class U>
+struct RebindAllocator {
+#if (__cplusplus >= 201103L) || (defined(_MSC_VER) && (_MSC_VER >= 1900))
+  typedef typename std::allocator_traits<Alloc>::template rebind_alloc<U> type;
+#else
+  typedef typename Alloc::template rebind<U>::other type;
+#endif
+};
+
+#define kNANORT_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// STL allocator which places large allocations in 2MB huge pages.
+// Useful for BVH storage of multi-GB trees to reduce TLB misses.
+//
+//   nanort::BVHAccel<float, nanort::HugePageAllocator<float> > accel;
+//
+// On Linux, allocations larger than kNANORT_HUGE_PAGE_SIZE are mmap'ed with
+// MAP_HUGETLB(requires preallocated huge pages in hugetlbfs pool, e.g.
+// `/proc/sys/vm/nr_hugepages`). When it fails, falls back to 2MB aligned
+// anonymous mapping with madvise(MADV_HUGEPAGE)(transparent huge pages).
+// Smaller allocations and other platforms use global operator new.
+//
+// For NUMA aware placement(e.g. numa_alloc_onnode()) or shared memory
+// segment(e.g. mmap on memfd_create() fd), supply your own allocator to
+// `BVHAccel` in the same manner.
+template <typename T>
+class HugePageAllocator {
+ public:
+  typedef T value_type;
+  typedef T *pointer;
+  typedef const T *const_pointer;
+  typedef T &reference;
+  typedef const T &const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <typename U>
+  struct rebind {
+    typedef HugePageAllocator<U> other;
+  };
+
+  HugePageAllocator() {}
+  HugePageAllocator(const HugePageAllocator &) {}
+  template <typename U>
+  HugePageAllocator(const HugePageAllocator<U> &) {}
+
+  pointer address(reference x) const { return &x; }
+  const_pointer address(const_reference x) const { return &x; }
+
+  pointer allocate(size_type n, const void *hint = 0) {
+    (void)hint;
+    if (n > max_size()) {
+      throw std::bad_alloc();
+    }
+    size_t bytes = n * sizeof(T);
+#if defined(__linux__)
+    if (bytes >= kNANORT_HUGE_PAGE_SIZE) {
+      return reinterpret_cast<pointer>(MapHugePages(RoundUp(bytes)));
+    }
+#endif
+    return reinterpret_cast<pointer>(::operator new(bytes));
+  }
+
+  void deallocate(pointer p, size_type n) {
+    size_t bytes = n * sizeof(T);
+#if defined(__linux__)
+    if (bytes >= kNANORT_HUGE_PAGE_SIZE) {
+      munmap(reinterpret_cast<void *>(p), RoundUp(bytes));
+      return;
+    }
+#endif
+    (void)bytes;
+    ::operator delete(reinterpret_cast<void *>(p));
+  }
+
+  size_type max_size() const {
+    return (std::numeric_limits<size_type>::max)() / sizeof(T);
+  }
+
+  void construct(pointer p, const T &val) { new (p) T(val); }
+  void destroy(pointer p) {
+    (void)p;
+    p->~T();
+  }
+
+ private:
+  static size_t RoundUp(size_t bytes) {
+    return ((bytes + kNANORT_HUGE_PAGE_SIZE - 1) / kNANORT_HUGE_PAGE_SIZE) *
+           kNANORT_HUGE_PAGE_SIZE;
+  }
+
+#if defined(__linux__)
+  static void *MapHugePages(size_t size) {
+    void *p = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+    p = mmap(0, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+      return p;
+    }
+#endif
+
+    // Over-allocate and trim so that the mapping is aligned to huge page
+    // boundary, then ask the kernel for transparent huge pages.
+    const size_t align = kNANORT_HUGE_PAGE_SIZE;
+    p = mmap(0, size + align, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+
+    size_t addr = reinterpret_cast<size_t>(p);
+    size_t aligned = (addr + align - 1) & ~(align - 1);
+    size_t head = aligned - addr;
+    size_t tail = align - head;
+    if (head > 0) {
+      munmap(p, head);
+    }
+    if (tail > 0) {
+      munmap(reinterpret_cast<void *>(aligned + size), tail);
+    }
+
+#if defined(MADV_HUGEPAGE)
+    madvise(reinterpret_cast<void *>(aligned), size, MADV_HUGEPAGE);
+#endif
+
+    return reinterpret_cast<void *>(aligned);
+  }
+#endif
+};
+
+template <typename T, typename U>
+inline bool operator==(const HugePageAllocator<T> &,
+                       const HugePageAllocator<U> &) {
+  return true;
+}
+
+template <typename T, typename U>
+inline bool operator!=(const HugePageAllocator<T> &,
+                       const HugePageAllocator<U> &) {
+  return false;
+}
+
+// ----------------------------------------------------------------------------
+
 template <typename T = float>
 class real3 {
  public:
@@ -469,7 +675,8 @@ class Ray {
   Ray()
       : min_t(static_cast<T>(0.0)),
         max_t(std::numeric_limits<T>::max()),
-        type(RAY_TYPE_NONE) {
+        type(RAY_TYPE_NONE),
+        time(static_cast<T>(0.0)) {
     org[0] = static_cast<T>(0.0);
     org[1] = static_cast<T>(0.0);
     org[2] = static_cast<T>(0.0);
@@ -483,10 +690,114 @@ class Ray {
   T min_t;            // minimum ray hit distance.
   T max_t;            // maximum ray hit distance.
   unsigned int type;  // ray type
+  T time;             // ray time in [0, 1] for motion blur(0 = key 0).
 
   // TODO(LTE): Align sizeof(Ray)
 };
 
+///
+/// @brief SoA packet of `N` rays.
+///
+/// Only lanes whose bit is set in `active_mask` are traced.
+/// `N` must be 32 or less(4, 8 or 16 is recommended).
+///
+template <typename T = float, int N = 8>
+class RayPacket {
+ public:
+  RayPacket() : active_mask(0) {
+    for (int i = 0; i < N; i++) {
+      org[0][i] = static_cast<T>(0.0);
+      org[1][i] = static_cast<T>(0.0);
+      org[2][i] = static_cast<T>(0.0);
+      dir[0][i] = static_cast<T>(0.0);
+      dir[1][i] = static_cast<T>(0.0);
+      dir[2][i] = static_cast<T>(-1.0);
+      min_t[i] = static_cast<T>(0.0);
+      max_t[i] = std::numeric_limits<T>::max();
+      type[i] = RAY_TYPE_NONE;
+      time[i] = static_cast<T>(0.0);
+    }
+  }
+
+  /// Set `lane`th ray and mark it active.
+  void SetRay(int lane, const Ray<T> &ray) {
+    for (int k = 0; k < 3; k++) {
+      org[k][lane] = ray.org[k];
+      dir[k][lane] = ray.dir[k];
+    }
+    min_t[lane] = ray.min_t;
+    max_t[lane] = ray.max_t;
+    type[lane] = ray.type;
+    time[lane] = ray.time;
+    active_mask |= (1u << lane);
+  }
+
+  /// Get `lane`th ray.
+  Ray<T> GetRay(int lane) const {
+    Ray<T> ray;
+    for (int k = 0; k < 3; k++) {
+      ray.org[k] = org[k][lane];
+      ray.dir[k] = dir[k][lane];
+    }
+    ray.min_t = min_t[lane];
+    ray.max_t = max_t[lane];
+    ray.type = type[lane];
+    ray.time = time[lane];
+    return ray;
+  }
+
+  static int Size() { return N; }
+
+  T org[3][N];  // must set
+  T dir[3][N];  // must set
+  T min_t[N];   // minimum ray hit distance.
+  T max_t[N];   // maximum ray hit distance.
+  unsigned int type[N];      // ray type
+  T time[N];                 // time in [0, 1](motion blur)
+  unsigned int active_mask;  // bit `i` = `i`th lane is active.
+};
+
+/// Returns the number of set bits.
+inline int CountBits(unsigned int x) {
+  int n = 0;
+  while (x) {
+    x &= x - 1;
+    n++;
+  }
+  return n;
+}
+
+/// Returns the index of the lowest set bit. `x` must not be zero.
+inline int LowestBit(unsigned int x) {
+  int n = 0;
+  while (!(x & 1u)) {
+    x >>= 1;
+    n++;
+  }
+  return n;
+}
+
+/// Returns the mask of all lanes of `N` lanes packet.
+inline unsigned int PacketLaneMask(int N) {
+  return (N >= 32) ? 0xffffffffu : ((1u << N) - 1u);
+}
+
+/// Spread lower 10 bits of `x` so that there are 2 zero bits between each bit.
+inline unsigned int ExpandBits3(unsigned int x) {
+  x &= 0x3ffu;
+  x = (x | (x << 16)) & 0x030000ffu;
+  x = (x | (x << 8)) & 0x0300f00fu;
+  x = (x | (x << 4)) & 0x030c30c3u;
+  x = (x | (x << 2)) & 0x09249249u;
+  return x;
+}
+
+/// 30bit Morton code of 10bit integer coordinates.
+inline unsigned int MortonCode3(unsigned int x, unsigned int y,
+                                unsigned int z) {
+  return (ExpandBits3(x) << 2) | (ExpandBits3(y) << 1) | ExpandBits3(z);
+}
+
 template <typename T = float>
 class BVHNode {
  public:
@@ -560,7 +871,17 @@ struct BVHBuildOptions {
   // Cache bounding box computation.
   // Requires more memory, but BVHbuild can be faster.
   bool cache_bbox;
-  unsigned char pad[3];
+
+  // Build parent node links for `BVHAccel::TraverseStackless`.
+  // Requires 4 bytes per node.
+  bool build_parent_links;
+
+  // Build min/max primitive ID of each node so that
+  // `BVHTraceOptions::prim_ids_range` culls whole subtrees in traversal.
+  // Requires 8 bytes per node.
+  bool build_prim_id_ranges;
+
+  unsigned char pad[1];
 
   // Set default value: Taabb = 0.2
   BVHBuildOptions()
@@ -571,7 +892,9 @@ struct BVHBuildOptions {
         shallow_depth(kNANORT_SHALLOW_DEPTH),
         min_primitives_for_parallel_build(
             kNANORT_MIN_PRIMITIVES_FOR_PARALLEL_BUILD),
-        cache_bbox(false) {}
+        cache_bbox(false),
+        build_parent_links(false),
+        build_prim_id_ranges(false) {}
 };
 
 /// BVH build statistics.
@@ -590,6 +913,31 @@ class BVHBuildStatistics {
         build_secs(0.0f) {}
 };
 
+///
+/// @brief BVH memory usage in bytes.
+///
+class BVHMemoryUsage {
+ public:
+  size_t nodes_bytes;    ///< BVH nodes
+  size_t indices_bytes;  ///< Primitive indices
+  size_t bboxes_bytes;   ///< Cached primitive bounding boxes(`cache_bbox`)
+  size_t aux_bytes;      ///< Auxiliary per-node/per-primitive data(caches)
+
+  ///< Peak temporary memory used during BVH build(not included in
+  ///< `total_bytes`)
+  size_t build_scratch_bytes;
+
+  size_t total_bytes;  ///< Memory held by built BVH.
+
+  BVHMemoryUsage()
+      : nodes_bytes(0),
+        indices_bytes(0),
+        bboxes_bytes(0),
+        aux_bytes(0),
+        build_scratch_bytes(0),
+        total_bytes(0) {}
+};
+
 ///
 /// @brief BVH trace option.
 ///
@@ -597,6 +945,8 @@ class BVHTraceOptions {
  public:
   // Hit only for face IDs in indexRange.
   // This feature is good to mimic something like glDrawArrays()
+  // Subtrees outside of the range are skipped if the BVH has primitive ID
+  // ranges(`BVHBuildOptions::build_prim_id_ranges`).
   unsigned int prim_ids_range[2];
 
   // Prim ID to skip for avoiding self-intersection
@@ -604,7 +954,14 @@ class BVHTraceOptions {
   unsigned int skip_prim_id;
 
   bool cull_back_face;
-  unsigned char pad[3];  ///< Padding (not used)
+
+  // Visit children in the order of actual ray entry distance instead of ray
+  // direction sign(`Traverse` only).
+  // Both child boxes are tested at the parent, and stacked nodes whose entry
+  // distance is beyond the current closest hit are skipped without testing.
+  bool distance_ordered_traversal;
+
+  unsigned char pad[2];  ///< Padding (not used)
 
   BVHTraceOptions() {
     prim_ids_range[0] = 0;
@@ -612,6 +969,113 @@ class BVHTraceOptions {
 
     skip_prim_id = static_cast<unsigned int>(-1);
     cull_back_face = false;
+    distance_ordered_traversal = false;
+  }
+};
+
+///
+/// @brief Default intersection filter of `BVHAccel::Traverse` and `Occluded`
+///
+/// An intersection filter is called for each candidate hit found by the
+/// intersector(before it is accepted) and returns false to reject the hit, so
+/// traversal continues(e.g. alpha tested geometry).
+/// A successful `Intersect` of an intersector is therefore only a candidate:
+/// intersectors must commit hit attributes(e.g. barycentric coordinate) in
+/// `Update`, not in `Intersect`, or a rejected candidate overwrites them.
+/// This filter accepts all hits and compiles to nothing.
+///
+class NoIntersectionFilter {
+ public:
+  /// @param[in] ray Input ray
+  /// @param[in] intersector Intersector which found the candidate hit
+  /// @param[in] t Hit distance of the candidate
+  /// @param[in] prim_id Primitive ID of the candidate
+  ///
+  /// @return true to accept the hit.
+  template <typename T, class I>
+  bool operator()(const Ray<T> &ray, const I &intersector, T t,
+                  unsigned int prim_id) const {
+    (void)ray;
+    (void)intersector;
+    (void)t;
+    (void)prim_id;
+    return true;
+  }
+};
+
+/// Returns true if `filter` is `NoIntersectionFilter`(accepts all hits).
+template <class F>
+inline bool IsNoIntersectionFilter(const F &filter) {
+  (void)filter;
+  return false;
+}
+
+inline bool IsNoIntersectionFilter(const NoIntersectionFilter &filter) {
+  (void)filter;
+  return true;
+}
+
+///
+/// @brief Conversion of bounding box coordinate from geometry precision `T` to
+/// node precision `N`.
+///
+/// `Lower` rounds toward -inf and `Upper` rounds toward +inf, so converted
+/// bounds are always conservative.
+///
+template <typename N, typename T>
+struct NodeCoordRounding;
+
+template <typename T>
+struct NodeCoordRounding<T, T> {
+  static T Lower(T x) { return x; }
+  static T Upper(T x) { return x; }
+};
+
+template <>
+struct NodeCoordRounding<float, double> {
+  static float Lower(double x) {
+    if (x < -static_cast<double>(std::numeric_limits<float>::max())) {
+      return -std::numeric_limits<float>::infinity();
+    } else if (x > static_cast<double>(std::numeric_limits<float>::max())) {
+      return std::numeric_limits<float>::max();
+    }
+    float f = static_cast<float>(x);
+    if (static_cast<double>(f) > x) {
+      f = NextFloat(f, /* up */ false);
+    }
+    return f;
+  }
+
+  static float Upper(double x) {
+    if (x > static_cast<double>(std::numeric_limits<float>::max())) {
+      return std::numeric_limits<float>::infinity();
+    } else if (x < -static_cast<double>(std::numeric_limits<float>::max())) {
+      return -std::numeric_limits<float>::max();
+    }
+    float f = static_cast<float>(x);
+    if (static_cast<double>(f) < x) {
+      f = NextFloat(f, /* up */ true);
+    }
+    return f;
+  }
+
+  // Adjacent float value toward +inf(up = true) or -inf(up = false).
+  // Assume `f` is finite.
+  static float NextFloat(float f, bool up) {
+    if (f == 0.0f) {
+      // Smallest denormal.
+      return up ? std::numeric_limits<float>::denorm_min()
+                : -std::numeric_limits<float>::denorm_min();
+    }
+    unsigned int bits;
+    memcpy(&bits, &f, sizeof(float));
+    if ((f > 0.0f) == up) {
+      bits++;
+    } else {
+      bits--;
+    }
+    memcpy(&f, &bits, sizeof(float));
+    return f;
   }
 };
 
@@ -673,11 +1137,108 @@ class NodeHit {
 template <typename T>
 class NodeHitComparator {
  public:
-  inline bool operator()(const NodeHit<T> &a, const NodeHit<T> &b) {
+  inline bool operator()(const NodeHit<T> &a, const NodeHit<T> &b) const {
     return a.t_min < b.t_min;
   }
 };
 
+///
+/// @brief Comparator object for hit class which has hit distance `t`.
+///
+template <class H>
+class HitDistanceComparator {
+ public:
+  inline bool operator()(const H &a, const H &b) const { return a.t < b.t; }
+};
+
+///
+/// @brief Fixed capacity max heap which keeps the `max_size` smallest
+/// elements(w.r.t. `Comp`).
+///
+/// The largest element is at the top. Elements are stored in the object, so
+/// no heap allocation happens(place it on the stack).
+///
+template <typename V, size_t capacity, class Comp>
+class BoundedMaxHeap {
+ public:
+  explicit BoundedMaxHeap(size_t max_size)
+      : size_(0), max_size_(std::min(max_size, capacity)) {}
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  bool full() const { return size_ >= max_size_; }
+
+  /// Largest element. Heap must not be empty.
+  const V &top() const { return data_[0]; }
+
+  /// Insert `v`. When the heap is full, `v` replaces the largest element only
+  /// if `v` is smaller. Returns true if `v` was inserted.
+  bool push(const V &v) {
+    if (size_ < max_size_) {
+      data_[size_++] = v;
+      std::push_heap(data_, data_ + size_, comp_);
+      return true;
+    }
+
+    if ((max_size_ > 0) && comp_(v, data_[0])) {
+      std::pop_heap(data_, data_ + size_, comp_);
+      data_[size_ - 1] = v;
+      std::push_heap(data_, data_ + size_, comp_);
+      return true;
+    }
+
+    return false;
+  }
+
+  /// Sort elements in ascending order and return them. The heap property is
+  /// lost, so call this only once after all insertions.
+  const V *sort() {
+    std::sort_heap(data_, data_ + size_, comp_);
+    return data_;
+  }
+
+ private:
+  V data_[capacity];
+  size_t size_;
+  size_t max_size_;
+  Comp comp_;
+};
+
+///
+/// @brief Ray data for ray-node(AABB) intersection in node precision `N`.
+///
+template <typename N, typename T>
+class NodeTraversalRay;
+
+///
+/// Tags of `LeafIntersectorTraits`.
+///
+class PrimitiveLeafTest {};  // `Intersect` for each primitive
+class SIMDLeafTest {};       // `IntersectLeaf` for a chunk of primitives
+
+///
+/// Selects how BVH traversal tests the primitives of a leaf with
+/// intersector `I`. Intersectors which implement `IntersectLeaf`
+/// specialize this with `SIMDLeafTest`.
+///
+template <class I>
+class LeafIntersectorTraits {
+ public:
+  typedef PrimitiveLeafTest Test;
+};
+
+///
+/// Trace options(`TriangleIntersectorFeature`) honored by intersector `I`.
+/// BVH traversal culls subtrees by `BVHTraceOptions::prim_ids_range` only if
+/// `I` checks it. Intersectors with a `Features` parameter specialize this;
+/// other intersectors are assumed to honor all options.
+///
+template <class I>
+class IntersectorFeatureTraits {
+ public:
+  enum { kFeatures = TRIANGLE_FEATURE_ALL };
+};
+
 ///
 /// @brief Bounding Volume Hierarchy acceleration.
 ///
@@ -686,11 +1247,48 @@ class NodeHitComparator {
 /// for efficient ray tracing(`O(log2 N)` in theory, where N is the number of primitive in the scene).
 ///
 /// @tparam T real value type(float or double).
+/// @tparam A Allocator used for BVH storage(`nodes_`, `indices_`, `bboxes_`).
+///           It is rebound to each element type, so any allocator
+///           type(e.g. `std::allocator<T>`, `HugePageAllocator<T>`) can be
+///           used.
+/// @tparam NodeT real value type of BVH node bounds. Usually same as `T`.
+///           `BVHAccel<double, std::allocator<double>, float>` builds float
+///           nodes over double precision geometry: Node bounds are rounded
+///           outward and traversed in float, while primitives are still
+///           tested in double precision by the intersector.
 ///
-template <typename T>
+template <typename T, class A = std::allocator<T>, typename NodeT = T>
 class BVHAccel {
  public:
-  BVHAccel() : pad0_(0) { (void)pad0_; }
+  typedef A allocator_type;
+  typedef BVHNode<NodeT> Node;
+  typedef std::vector<Node, typename RebindAllocator<A, Node>::type> NodeArray;
+  typedef std::vector<unsigned int,
+                      typename RebindAllocator<A, unsigned int>::type>
+      IndexArray;
+  typedef std::vector<BBox<T>, typename RebindAllocator<A, BBox<T> >::type>
+      BBoxArray;
+
+  BVHAccel() : build_scratch_bytes_(0), pad0_(0) { (void)pad0_; }
+
+  ///
+  /// Construct with allocator instance. Useful for stateful allocator(e.g.
+  /// allocate BVH storage from NUMA local memory or shared memory segment)
+  ///
+  explicit BVHAccel(const A &allocator)
+      : nodes_(typename NodeArray::allocator_type(allocator)),
+        indices_(typename IndexArray::allocator_type(allocator)),
+        bboxes_(typename BBoxArray::allocator_type(allocator)),
+        parents_(typename IndexArray::allocator_type(allocator)),
+        prim_id_ranges_(typename IndexArray::allocator_type(allocator)),
+        node_masks_(typename IndexArray::allocator_type(allocator)),
+        prim_masks_(typename IndexArray::allocator_type(allocator)),
+        motion_nodes_(typename NodeArray::allocator_type(allocator)),
+        build_scratch_bytes_(0),
+        pad0_(0) {
+    (void)pad0_;
+  }
+
   ~BVHAccel() {}
 
   ///
@@ -716,6 +1314,43 @@ class BVHAccel {
   ///
   BVHBuildStatistics GetStatistics() const { return stats_; }
 
+  ///
+  /// Get memory usage of BVH storage(counts allocated capacity).
+  /// `build_scratch_bytes` is the approximated peak temporary memory of the
+  /// last `Build()`.
+  ///
+  BVHMemoryUsage MemoryUsage() const {
+    BVHMemoryUsage usage;
+    usage.nodes_bytes = nodes_.capacity() * sizeof(Node);
+    usage.indices_bytes = indices_.capacity() * sizeof(unsigned int);
+    usage.bboxes_bytes = bboxes_.capacity() * sizeof(BBox<T>);
+    usage.aux_bytes = (parents_.capacity() + prim_id_ranges_.capacity() +
+                       node_masks_.capacity() + prim_masks_.capacity()) *
+                          sizeof(unsigned int) +
+                      motion_nodes_.capacity() * sizeof(Node);
+    usage.build_scratch_bytes = build_scratch_bytes_;
+    usage.total_bytes = usage.nodes_bytes + usage.indices_bytes +
+                        usage.bboxes_bytes + usage.aux_bytes;
+    return usage;
+  }
+
+  ///
+  /// Estimate memory usage of `Build()` before building BVH.
+  /// Returns upper bound(worst case: leaf with single primitive and 2x
+  /// capacity growth of node array), so the actual usage is usually smaller.
+  /// `aux_bytes` counts parent links and primitive ID ranges requested in
+  /// `options` only: visibility masks(`SetPrimitiveMasks`) and motion bounds
+  /// (`BuildMotionBlur`) are not included.
+  ///
+  /// @param[in] num_primitives The number of primitives.
+  /// @param[in] options BVH build options.
+  /// @param[in] num_threads The number of threads used for parallel build.
+  ///
+  static BVHMemoryUsage EstimateMemoryUsage(
+      unsigned int num_primitives,
+      const BVHBuildOptions<T> &options = BVHBuildOptions<T>(),
+      unsigned int num_threads = 1);
+
 #if defined(NANORT_ENABLE_SERIALIZATION)
   ///
   /// Dump built BVH to the file.
@@ -750,52 +1385,580 @@ class BVHAccel {
   bool Traverse(const Ray<T> &ray, const I &intersector, H *isect,
                 const BVHTraceOptions &options = BVHTraceOptions()) const;
 
-#if 0
-  /// Multi-hit ray traversal
-  /// Returns `max_intersections` frontmost intersections
-  template<class I, class H, class Comp>
-  bool MultiHitTraverse(const Ray<T> &ray,
-                        int max_intersections,
-                        const I &intersector,
-                        StackVector<H, 128> *isects,
-                        const BVHTraceOptions &options = BVHTraceOptions()) const;
-#endif
-
   ///
-  /// List up nodes which intersects along the ray.
-  /// This function is useful for two-level BVH traversal.
-  /// See `examples/nanosg` for example.
+  /// @brief `Traverse` with intersection filter
   ///
-  /// @tparam I Intersection class
+  /// `filter(ray, intersector, t, prim_id)` is called for each candidate hit
+  /// and returns false to reject it(e.g. alpha test). See
+  /// `NoIntersectionFilter`.
   ///
+  /// @tparam F Intersection filter class
   ///
+  template <class I, class H, class F>
+  bool Traverse(const Ray<T> &ray, const I &intersector, H *isect,
+                const BVHTraceOptions &options, const F &filter) const;
+
   ///
-  template <class I>
-  bool ListNodeIntersections(const Ray<T> &ray, int max_intersections,
-                             const I &intersector,
-                             StackVector<NodeHit<T>, 128> *hits) const;
+  /// @brief `Traverse` with explicit per-ray trace context
+  ///
+  /// Per-ray state is kept in `ctx`(e.g. `TriangleTraceContext` allocated on
+  /// the stack) instead of the intersector, so one intersector object can be
+  /// shared by all threads.
+  ///
+  /// @tparam I Intersector class which defines `TraceContext`(e.g. `TriangleIntersector`)
+  /// @tparam H Hit class
+  ///
+  template <class I, class H>
+  bool Traverse(const Ray<T> &ray, const I &intersector,
+                typename I::TraceContext *ctx, H *isect,
+                const BVHTraceOptions &options = BVHTraceOptions()) const;
 
-  const std::vector<BVHNode<T> > &GetNodes() const { return nodes_; }
-  const std::vector<unsigned int> &GetIndices() const { return indices_; }
+  ///
+  /// @brief Traverse into BVH with a packet of coherent rays and find closest
+  /// hit point & primitive for each ray
+  ///
+  /// A node is tested against all active rays of the packet at once.
+  /// Subtrees reached by only a few rays are traversed ray by ray.
+  ///
+  /// @tparam N The number of rays in a packet
+  /// @tparam I Packet intersector class(e.g. `TrianglePacketIntersector`)
+  /// @tparam H Hit class
+  ///
+  /// @param[in] packet Input ray packet
+  /// @param[in] intersector Packet intersector object.
+  /// @param[out] isects Array of `N` intersection point information(filled for lanes which hit)
+  /// @param[in] options Traversal options.
+  ///
+  /// @return Bit mask of the lanes which found the closest hit point.
+  ///
+  template <int N, class I, class H>
+  unsigned int TraversePacket(
+      const RayPacket<T, N> &packet, const I &intersector, H *isects,
+      const BVHTraceOptions &options = BVHTraceOptions()) const;
 
   ///
-  /// Returns bounding box of built BVH.
+  /// @brief Test whether the ray hits any primitive in [`ray.min_t`, `ray.max_t`]
   ///
-  void BoundingBox(T bmin[3], T bmax[3]) const {
-    if (nodes_.empty()) {
-      bmin[0] = bmin[1] = bmin[2] = std::numeric_limits<T>::max();
-      bmax[0] = bmax[1] = bmax[2] = -std::numeric_limits<T>::max();
-    } else {
-      bmin[0] = nodes_[0].bmin[0];
-      bmin[1] = nodes_[0].bmin[1];
-      bmin[2] = nodes_[0].bmin[2];
-      bmax[0] = nodes_[0].bmax[0];
-      bmax[1] = nodes_[0].bmax[1];
-      bmax[2] = nodes_[0].bmax[2];
-    }
-  }
+  /// Traversal stops at the first intersection found and the intersection
+  /// point information is not computed(`intersector.PostTraversal` is not
+  /// called). Use this for shadow rays.
+  ///
+  /// @tparam I Intersector class
+  ///
+  /// @param[in] ray Input ray
+  /// @param[in] intersector Intersector object.
+  /// @param[in] options Traversal options.
+  ///
+  /// @return true if the ray is occluded.
+  ///
+  template <class I>
+  bool Occluded(const Ray<T> &ray, const I &intersector,
+                const BVHTraceOptions &options = BVHTraceOptions()) const;
 
-  bool IsValid() const { return nodes_.size() > 0; }
+  ///
+  /// @brief `Occluded` with intersection filter(see `Traverse`)
+  ///
+  template <class I, class F>
+  bool Occluded(const Ray<T> &ray, const I &intersector,
+                const BVHTraceOptions &options, const F &filter) const;
+
+  ///
+  /// @brief `Occluded` with explicit per-ray trace context
+  ///
+  template <class I>
+  bool Occluded(const Ray<T> &ray, const I &intersector,
+                typename I::TraceContext *ctx,
+                const BVHTraceOptions &options = BVHTraceOptions()) const;
+
+  ///
+  /// @brief Stackless version of `Traverse`
+  ///
+  /// Walks the tree using parent node links instead of traversal stack, so
+  /// per-ray state is a few words. Useful for small call stacks(fibers,
+  /// coroutines) or many rays in flight.
+  /// Needs parent links(`BVHBuildOptions::build_parent_links` or
+  /// `BuildParentLinks()`). Falls back to `Traverse` if they are not built.
+  ///
+  template <class I, class H>
+  bool TraverseStackless(
+      const Ray<T> &ray, const I &intersector, H *isect,
+      const BVHTraceOptions &options = BVHTraceOptions()) const;
+
+  ///
+  /// @brief Packet version of `Occluded`
+  ///
+  /// @return Bit mask of the lanes which are occluded.
+  ///
+  template <int N, class I>
+  unsigned int OccludedPacket(
+      const RayPacket<T, N> &packet, const I &intersector,
+      const BVHTraceOptions &options = BVHTraceOptions()) const;
+
+  ///
+  /// @brief Traverse into BVH with a stream of(possibly incoherent) rays and
+  /// find closest hit point & primitive for each ray
+  ///
+  /// Rays are sorted by direction octant and Morton code of the ray origin,
+  /// grouped into packets of `I::kPacketSize` rays and traced with
+  /// `TraversePacket`. Results are written in the original ray order.
+  ///
+  /// @tparam I Packet intersector class(e.g. `TrianglePacketIntersector`)
+  /// @tparam H Hit class
+  ///
+  /// @param[in] rays Input rays
+  /// @param[in] num_rays The number of rays
+  /// @param[in] intersector Packet intersector object. Copied for each thread.
+  /// @param[out] isects Array of `num_rays` intersection point information(filled for rays which hit)
+  /// @param[out] hit_flags Array of `num_rays` flags(1 = hit, 0 = no hit). Can be NULL.
+  /// @param[in] options Traversal options.
+  /// @param[in] num_threads The number of threads(0 = all hardware threads). Needs C++11 thread or OpenMP.
+  ///
+  /// @return The number of rays which found the closest hit point.
+  ///
+  template <class I, class H>
+  size_t TraverseStream(const Ray<T> *rays, size_t num_rays,
+                        const I &intersector, H *isects,
+                        unsigned char *hit_flags = NULL,
+                        const BVHTraceOptions &options = BVHTraceOptions(),
+                        unsigned int num_threads = 1) const;
+
+  ///
+  /// @brief Stream version of `Occluded`
+  ///
+  /// @param[out] occluded Array of `num_rays` flags(1 = occluded, 0 = not occluded).
+  ///
+  /// @return The number of rays which are occluded.
+  ///
+  template <class I>
+  size_t OccludedStream(const Ray<T> *rays, size_t num_rays,
+                        const I &intersector, unsigned char *occluded,
+                        const BVHTraceOptions &options = BVHTraceOptions(),
+                        unsigned int num_threads = 1) const;
+
+  ///
+  /// @brief Traverse into BVH with many independent rays, interleaving
+  /// `kNANORT_RAYS_IN_FLIGHT` rays per thread
+  ///
+  /// Each ray in flight advances one node at a time in round-robin and
+  /// prefetches the node(or leaf primitive indices) it visits next, so the
+  /// cache miss of one ray is hidden behind the work of the others.
+  /// Useful for incoherent rays on large scenes where packets do not help.
+  /// Results are same as `Traverse` for each ray.
+  ///
+  /// @tparam I Intersector class which defines `TraceContext`(e.g. `TriangleIntersector`). Shared by all rays and threads.
+  /// @tparam H Hit class
+  ///
+  /// @param[in] rays Input rays
+  /// @param[in] num_rays The number of rays
+  /// @param[in] intersector Intersector object.
+  /// @param[out] isects Array of `num_rays` intersection point information(filled for rays which hit)
+  /// @param[out] hit_flags Array of `num_rays` flags(1 = hit, 0 = no hit). Can be NULL.
+  /// @param[in] options Traversal options(`distance_ordered_traversal` is ignored).
+  /// @param[in] num_threads The number of threads(0 = all hardware threads). Needs C++11 thread or OpenMP.
+  ///
+  /// @return The number of rays which found the closest hit point.
+  ///
+  template <class I, class H>
+  size_t TraverseInterleaved(const Ray<T> *rays, size_t num_rays,
+                             const I &intersector, H *isects,
+                             unsigned char *hit_flags = NULL,
+                             const BVHTraceOptions &options = BVHTraceOptions(),
+                             unsigned int num_threads = 1) const;
+
+  ///
+  /// @brief Traverse into BVH with a tile of rays which share the origin(e.g.
+  /// primary rays of a pinhole camera) and find closest hit point & primitive
+  /// for each ray
+  ///
+  /// The BVH is first culled against the frustum of the tile(interval
+  /// arithmetic over the ray directions) to find up to
+  /// `kNANORT_MAX_TILE_ENTRY_NODES` entry subtrees. Then each ray is traced
+  /// from these subtrees only, so nodes outside of the tile frustum are never
+  /// visited per ray.
+  /// Falls back to `Traverse` for each ray when the rays do not share the
+  /// origin or `options.distance_ordered_traversal` is set.
+  ///
+  /// @tparam I Intersector class(e.g. `TriangleIntersector`)
+  /// @tparam H Hit class
+  ///
+  /// @param[in] rays Input rays(e.g. 8x8 or 16x16 pixels)
+  /// @param[in] num_rays The number of rays
+  /// @param[in] intersector Intersector object.
+  /// @param[out] isects Array of `num_rays` intersection point information(filled for rays which hit)
+  /// @param[out] hit_flags Array of `num_rays` flags(1 = hit, 0 = no hit). Can be NULL.
+  /// @param[in] options Traversal options.
+  ///
+  /// @return The number of rays which found the closest hit point.
+  ///
+  template <class I, class H>
+  size_t TraverseTile(const Ray<T> *rays, size_t num_rays,
+                      const I &intersector, H *isects,
+                      unsigned char *hit_flags = NULL,
+                      const BVHTraceOptions &options = BVHTraceOptions()) const;
+
+  ///
+  /// @brief Multi-hit traversal of rays which share the origin(e.g. LiDAR or
+  /// other sensor simulation)
+  ///
+  /// Rays are split into bundles of `kNANORT_BUNDLE_SIZE` consecutive rays
+  /// (so pass rays in scan order). Each bundle traverses the BVH once with
+  /// frustum culling, and primitives of each visited leaf are prepared once
+  /// (e.g. translated to the bundle origin) and tested against all rays of
+  /// the bundle which hit the leaf.
+  /// Up to `max_hits`(multi-return) frontmost hits are found for each ray.
+  /// A bundle whose rays do not share the origin is traced ray by ray.
+  ///
+  /// @tparam I Bundle intersector class(e.g. `TriangleBundleIntersector`)
+  /// @tparam H Hit class(must have hit distance `t`)
+  ///
+  /// @param[in] rays Input rays
+  /// @param[in] num_rays The number of rays
+  /// @param[in] max_hits The maximum number of hits per ray
+  /// @param[in] intersector Bundle intersector object. Shared by all threads.
+  /// @param[out] isects Array of `num_rays * max_hits` hit points(`max_hits` per ray, sorted front to back)
+  /// @param[out] num_hits Array of `num_rays` hit counts
+  /// @param[in] options Traversal options.
+  /// @param[in] num_threads The number of threads(0 = all hardware threads). Needs C++11 thread or OpenMP.
+  ///
+  /// @return Total number of hits.
+  ///
+  template <class I, class H>
+  size_t TraverseBundle(const Ray<T> *rays, size_t num_rays,
+                        unsigned int max_hits, const I &intersector, H *isects,
+                        unsigned int *num_hits,
+                        const BVHTraceOptions &options = BVHTraceOptions(),
+                        unsigned int num_threads = 1) const;
+
+  ///
+  /// @brief Find the closest point on primitives to point `p`
+  ///
+  /// Nodes are visited nearest first and pruned by the distance to their
+  /// bounding box, so only primitives around `p` are tested.
+  ///
+  /// @tparam Q Closest point query class(e.g. `TriangleClosestPointQuery`)
+  /// @tparam H Closest point information class(e.g. `TriangleClosestPoint`)
+  ///
+  /// @param[in] p Query point
+  /// @param[in] max_dist Search radius. Primitives further than this are ignored.
+  /// @param[in] prim_query Query object which computes the closest point on a primitive.
+  /// @param[out] result Closest point information(filled when found)
+  ///
+  /// @return true if the closest point is found within `max_dist`.
+  ///
+  template <class Q, class H>
+  bool ClosestPoint(const T p[3], T max_dist, const Q &prim_query,
+                    H *result) const;
+
+  ///
+  /// @brief Batched version of `ClosestPoint`
+  ///
+  /// @param[in] points Array of `num_points` query points(xyz)
+  /// @param[in] num_points The number of query points
+  /// @param[in] max_dist Search radius.
+  /// @param[in] prim_query Query object. Shared by all threads.
+  /// @param[out] results Array of `num_points` closest point information(filled for points which found one)
+  /// @param[out] found_flags Array of `num_points` flags(1 = found, 0 = not found). Can be NULL.
+  /// @param[in] num_threads The number of threads(0 = all hardware threads). Needs C++11 thread or OpenMP.
+  ///
+  /// @return The number of points which found the closest point.
+  ///
+  template <class Q, class H>
+  size_t ClosestPoints(const T *points, size_t num_points, T max_dist,
+                       const Q &prim_query, H *results,
+                       unsigned char *found_flags = NULL,
+                       unsigned int num_threads = 1) const;
+
+  ///
+  /// @brief Find `k` nearest primitives to point `p`
+  ///
+  /// Candidates are kept in a bounded max-heap of `k` entries(in the output
+  /// arrays, so no allocation happens). Once `k` candidates are found, the
+  /// search radius shrinks to the distance of the farthest candidate.
+  ///
+  /// @tparam Q Neighbor query class(e.g. `PointNeighborQuery`). `T DistanceSquared(const real3<T> &p, unsigned int prim_id)` returns squared distance to a primitive.
+  ///
+  /// @param[in] p Query point
+  /// @param[in] k The maximum number of neighbors
+  /// @param[in] max_dist Search radius. Primitives further than this are ignored.
+  /// @param[in] prim_query Neighbor query object.
+  /// @param[out] prim_ids Array of `k` primitive IDs of neighbors(nearest first)
+  /// @param[out] dist2s Array of `k` squared distances of neighbors
+  ///
+  /// @return The number of neighbors found(<= `k`).
+  ///
+  template <class Q>
+  unsigned int KNearestNeighbors(const T p[3], unsigned int k, T max_dist,
+                                 const Q &prim_query, unsigned int *prim_ids,
+                                 T *dist2s) const;
+
+  ///
+  /// @brief Batched version of `KNearestNeighbors`
+  ///
+  /// Queries are processed in Morton order of the query points, so that
+  /// consecutive queries on a thread visit the same nodes.
+  ///
+  /// @param[in] points Array of `num_points` query points(xyz)
+  /// @param[in] num_points The number of query points
+  /// @param[in] k The maximum number of neighbors per query
+  /// @param[in] max_dist Search radius.
+  /// @param[in] prim_query Neighbor query object. Shared by all threads.
+  /// @param[out] prim_ids Array of `num_points * k` primitive IDs(`k` per query, nearest first)
+  /// @param[out] dist2s Array of `num_points * k` squared distances
+  /// @param[out] counts Array of `num_points` neighbor counts
+  /// @param[in] num_threads The number of threads(0 = all hardware threads). Needs C++11 thread or OpenMP.
+  ///
+  /// @return Total number of neighbors found.
+  ///
+  template <class Q>
+  size_t KNearestNeighborsBatch(const T *points, size_t num_points,
+                                unsigned int k, T max_dist,
+                                const Q &prim_query, unsigned int *prim_ids,
+                                T *dist2s, unsigned int *counts,
+                                unsigned int num_threads = 1) const;
+
+  ///
+  /// @brief Find primitives whose bounding box overlaps box [`bmin`, `bmax`]
+  ///
+  /// @tparam P Primitive accessor class(e.g. `TriangleMesh`. Same as `Build`)
+  /// @tparam F Callback class. `bool (*callback)(unsigned int prim_id)` is
+  /// called for each overlapping primitive and returns false to stop the query.
+  ///
+  /// @param[in] bmin Minimum corner of the query box
+  /// @param[in] bmax Maximum corner of the query box
+  /// @param[in] prims Primitive accessor object.
+  /// @param[in] callback Callback object.
+  ///
+  /// @return The number of overlapping primitives reported.
+  ///
+  template <class P, class F>
+  size_t OverlapBox(const T bmin[3], const T bmax[3], const P &prims,
+                    F *callback) const;
+
+  ///
+  /// @brief `OverlapBox` which writes primitive IDs to a fixed size buffer
+  ///
+  /// @param[out] prim_ids Array of `max_prim_ids` primitive IDs.
+  /// @param[in] max_prim_ids Capacity of `prim_ids`.
+  ///
+  /// @return The number of overlapping primitives. Only the first
+  /// `max_prim_ids` of them are stored if this is larger than `max_prim_ids`.
+  ///
+  template <class P>
+  size_t OverlapBox(const T bmin[3], const T bmax[3], const P &prims,
+                    unsigned int *prim_ids, size_t max_prim_ids) const;
+
+  ///
+  /// @brief Find primitives whose bounding box overlaps sphere(`center`,
+  /// `radius`). See `OverlapBox`.
+  ///
+  template <class P, class F>
+  size_t OverlapSphere(const T center[3], T radius, const P &prims,
+                       F *callback) const;
+
+  template <class P>
+  size_t OverlapSphere(const T center[3], T radius, const P &prims,
+                       unsigned int *prim_ids, size_t max_prim_ids) const;
+
+  ///
+  /// @brief Batched version of `OverlapBox`
+  ///
+  /// @param[in] boxes Array of `num_boxes` query boxes(bmin xyz, bmax xyz)
+  /// @param[in] num_boxes The number of query boxes
+  /// @param[in] prims Primitive accessor object. Shared by all threads.
+  /// @param[out] prim_ids Array of `num_boxes * max_prim_ids` primitive IDs. `i`th query writes to [`i * max_prim_ids`, `(i + 1) * max_prim_ids`).
+  /// @param[in] max_prim_ids Capacity of `prim_ids` for each query.
+  /// @param[out] counts Array of `num_boxes` overlap counts(can be larger than `max_prim_ids`).
+  /// @param[in] num_threads The number of threads(0 = all hardware threads). Needs C++11 thread or OpenMP.
+  ///
+  /// @return Total number of overlaps.
+  ///
+  template <class P>
+  size_t OverlapBoxes(const T *boxes, size_t num_boxes, const P &prims,
+                      unsigned int *prim_ids, size_t max_prim_ids,
+                      size_t *counts, unsigned int num_threads = 1) const;
+
+  ///
+  /// @brief Batched version of `OverlapSphere`
+  ///
+  /// @param[in] spheres Array of `num_spheres` query spheres(center xyz, radius)
+  ///
+  template <class P>
+  size_t OverlapSpheres(const T *spheres, size_t num_spheres, const P &prims,
+                        unsigned int *prim_ids, size_t max_prim_ids,
+                        size_t *counts, unsigned int num_threads = 1) const;
+
+  ///
+  /// @brief Find overlapping primitive pairs of this BVH and `other` BVH
+  ///
+  /// Both trees are traversed simultaneously. For each pair of overlapping
+  /// leaf nodes, `pair_test(prim_id, other_prim_id, transform)` is called for
+  /// each primitive pair and `callback(prim_id, other_prim_id)` is called if
+  /// it returns true.
+  ///
+  /// @tparam Q Primitive pair test class(`NoPrimitivePairTest` or `TriangleTriangleOverlapTest`)
+  /// @tparam F Callback class. `bool (*callback)(unsigned int prim_id, unsigned int other_prim_id)` returns false to stop the query.
+  ///
+  /// @param[in] other The other BVH
+  /// @param[in] transform Rigid transform from `other` to this BVH(3x4 row major matrix, NULL = identity)
+  /// @param[in] pair_test Primitive pair test object.
+  /// @param[in] callback Callback object.
+  ///
+  /// @return The number of primitive pairs reported.
+  ///
+  template <class Q, class F>
+  size_t OverlapBVH(const BVHAccel &other, const T *transform,
+                    const Q &pair_test, F *callback) const;
+
+  ///
+  /// @brief Multi-threaded version of `OverlapBVH` which collects the
+  /// overlapping primitive pairs(prim_id, other_prim_id)
+  ///
+  /// The trees are split into subtree pairs which are processed in parallel.
+  /// `pair_test` is shared by all threads.
+  ///
+  /// @param[out] pairs Overlapping primitive pairs.
+  /// @param[in] num_threads The number of threads(0 = all hardware threads). Needs C++11 thread or OpenMP.
+  ///
+  /// @return The number of overlapping primitive pairs.
+  ///
+  template <class Q>
+  size_t OverlapBVHPairs(
+      const BVHAccel &other, const T *transform, const Q &pair_test,
+      std::vector<std::pair<unsigned int, unsigned int> > *pairs,
+      unsigned int num_threads = 1) const;
+
+  ///
+  /// @brief Multi-hit ray traversal
+  ///
+  /// Finds `max_intersections`(up to kNANORT_MAX_MULTI_HITS) frontmost hit
+  /// points. Once `max_intersections` hits are found, the furthest one limits
+  /// the traversal distance.
+  ///
+  /// @tparam I Intersector class
+  /// @tparam H Hit class(must have hit distance `t`)
+  ///
+  /// @param[in] ray Input ray
+  /// @param[in] max_intersections The number of hits to find
+  /// @param[in] intersector Intersector object. `PostTraversal` is called for each hit to fill `H`.
+  /// @param[out] isects Hit points sorted front to back
+  /// @param[in] options Traversal options.
+  ///
+  /// @return true if any hit point found.
+  ///
+  template <class I, class H>
+  bool MultiHitTraverse(const Ray<T> &ray, int max_intersections,
+                        const I &intersector,
+                        StackVector<H, kNANORT_MAX_MULTI_HITS> *isects,
+                        const BVHTraceOptions &options = BVHTraceOptions()) const;
+
+  ///
+  /// List up nodes which intersects along the ray.
+  /// Up to `max_intersections`(at most kNANORT_MAX_MULTI_HITS) nearest nodes are listed.
+  /// This function is useful for two-level BVH traversal.
+  /// See `examples/nanosg` for example.
+  ///
+  /// @tparam I Intersection class
+  ///
+  ///
+  ///
+  template <class I>
+  bool ListNodeIntersections(const Ray<T> &ray, int max_intersections,
+                             const I &intersector,
+                             StackVector<NodeHit<T>, 128> *hits) const;
+
+  const NodeArray &GetNodes() const { return nodes_; }
+  const IndexArray &GetIndices() const { return indices_; }
+
+  ///
+  /// Build parent node links used by `TraverseStackless`.
+  /// `Build()` calls this when `BVHBuildOptions::build_parent_links` is set.
+  /// Call this manually after `Load()`.
+  ///
+  void BuildParentLinks();
+
+  /// Parent node index of each node(root's parent is itself).
+  /// Empty unless parent links are built.
+  const IndexArray &GetParentLinks() const { return parents_; }
+
+  ///
+  /// Build min/max primitive ID of each node used to cull subtrees outside of
+  /// `BVHTraceOptions::prim_ids_range`. Subtrees are culled only for
+  /// intersectors which check the range(`TRIANGLE_FEATURE_PRIM_IDS_RANGE`,
+  /// see `IntersectorFeatureTraits`), so results do not depend on it.
+  /// `Build()` calls this when `BVHBuildOptions::build_prim_id_ranges` is set.
+  /// Call this manually after `Load()`.
+  ///
+  void BuildPrimIdRanges();
+
+  /// [min, max] primitive ID of each node(`2 * i` and `2 * i + 1` for `i`th
+  /// node). Empty unless primitive ID ranges are built.
+  const IndexArray &GetPrimIdRanges() const { return prim_id_ranges_; }
+
+  ///
+  /// Set visibility mask of each primitive(e.g. OR of `RayType` bits).
+  /// A primitive is hit only by rays whose `Ray::type` intersects its mask,
+  /// and subtrees with no such primitive are skipped.
+  /// Rays with `RAY_TYPE_NONE` see all primitives.
+  /// Call this after `Build()` or `Load()`.
+  ///
+  /// @param[in] masks Visibility mask indexed by primitive ID. NULL clears
+  /// masks.
+  ///
+  void SetPrimitiveMasks(const unsigned int *masks);
+
+  /// OR of the visibility masks of the primitives under each node.
+  /// Empty unless masks are set.
+  const IndexArray &GetNodeMasks() const { return node_masks_; }
+
+  ///
+  /// Build BVH for linearly moving primitives(e.g. `MotionTriangleMesh`).
+  ///
+  /// The tree is built over the bounds of the whole time range, then bounds
+  /// at key 0 and key 1 are stored per node(`BuildMotionBounds`).
+  /// `Traverse`(including `distance_ordered_traversal`), `Occluded` and
+  /// `MultiHitTraverse` interpolate node bounds by `Ray::time`(clamped to
+  /// [0, 1]); other queries use the bounds of the whole time range.
+  ///
+  /// @tparam Prim Primitive accessor class. `BoundingBox` returns the bounds of the whole time range and `MotionBoundingBox(bmin, bmax, prim_index, key)` the bounds at `key`(0 or 1).
+  /// @tparam Pred Predicator(e.g. `MotionTriangleSAHPred`)
+  ///
+  /// @return true upon success.
+  ///
+  template <class Prim, class Pred>
+  bool BuildMotionBlur(const unsigned int num_primitives, const Prim &p,
+                       const Pred &pred,
+                       const BVHBuildOptions<T> &options = BVHBuildOptions<T>());
+
+  ///
+  /// (Re)compute key 0 and key 1 bounds of each node from `p`(e.g. after
+  /// `Load()`, or for new keyframes of the same primitives). Primitives must
+  /// stay inside the node bounds of the whole time range.
+  ///
+  template <class Prim>
+  void BuildMotionBounds(const Prim &p);
+
+  /// Key 0 and key 1 bounds of each node(`2 * i` and `2 * i + 1` for `i`th
+  /// node). Empty unless the BVH is built for motion blur.
+  const NodeArray &GetMotionNodes() const { return motion_nodes_; }
+
+  ///
+  /// Returns bounding box of built BVH.
+  ///
+  void BoundingBox(T bmin[3], T bmax[3]) const {
+    if (nodes_.empty()) {
+      bmin[0] = bmin[1] = bmin[2] = std::numeric_limits<T>::max();
+      bmax[0] = bmax[1] = bmax[2] = -std::numeric_limits<T>::max();
+    } else {
+      bmin[0] = nodes_[0].bmin[0];
+      bmin[1] = nodes_[0].bmin[1];
+      bmin[2] = nodes_[0].bmin[2];
+      bmax[0] = nodes_[0].bmax[0];
+      bmax[1] = nodes_[0].bmax[1];
+      bmax[2] = nodes_[0].bmax[2];
+    }
+  }
+
+  bool IsValid() const { return nodes_.size() > 0; }
 
  private:
 #if defined(NANORT_ENABLE_PARALLEL_BUILD)
@@ -810,92 +1973,1025 @@ class BVHAccel {
 
   /// Builds shallow BVH tree recursively.
   template <class P, class Pred>
-  unsigned int BuildShallowTree(std::vector<BVHNode<T> > *out_nodes,
+  unsigned int BuildShallowTree(NodeArray *out_nodes,
                                 unsigned int left_idx, unsigned int right_idx,
                                 unsigned int depth,
                                 unsigned int max_shallow_depth, const P &p,
                                 const Pred &pred);
 #endif
 
+  static size_t BinBufferBytes(unsigned int bin_size) {
+    return 2 * 3 * size_t(bin_size) * sizeof(size_t);  // See BinBuffer
+  }
+
+  static size_t LocalNodesBytes(const std::vector<NodeArray> &local_nodes) {
+    size_t bytes = local_nodes.capacity() * sizeof(NodeArray);
+    for (size_t i = 0; i < local_nodes.size(); i++) {
+      bytes += local_nodes[i].capacity() * sizeof(Node);
+    }
+    return bytes;
+  }
+
+  /// Store bounds to node. Bounds are rounded outward when node precision is
+  /// lower than `T`.
+  static void SetNodeBounds(Node *node, const real3<T> &bmin,
+                            const real3<T> &bmax) {
+    for (int k = 0; k < 3; k++) {
+      node->bmin[k] = NodeCoordRounding<NodeT, T>::Lower(bmin[k]);
+      node->bmax[k] = NodeCoordRounding<NodeT, T>::Upper(bmax[k]);
+    }
+  }
+
   /// Builds BVH tree recursively.
   template <class P, class Pred>
-  unsigned int BuildTree(BVHBuildStatistics *out_stat,
-                         std::vector<BVHNode<T> > *out_nodes,
+  unsigned int BuildTree(BVHBuildStatistics *out_stat, NodeArray *out_nodes,
                          unsigned int left_idx, unsigned int right_idx,
                          unsigned int depth, const P &p, const Pred &pred);
 
-  template <class I>
-  bool TestLeafNode(const BVHNode<T> &node, const Ray<T> &ray,
-                    const I &intersector) const;
-
-  template <class I>
-  bool TestLeafNodeIntersections(
-      const BVHNode<T> &node, const Ray<T> &ray, const int max_intersections,
-      const I &intersector,
-      std::priority_queue<NodeHit<T>, std::vector<NodeHit<T> >,
-                          NodeHitComparator<T> > *isect_pq) const;
-
-#if 0
-  template<class I, class H, class Comp>
-  bool MultiHitTestLeafNode(std::priority_queue<H, std::vector<H>, Comp> *isect_pq,
-                            int max_intersections,
-                            const BVHNode<T> &node, const Ray<T> &ray,
-                            const I &intersector) const;
-#endif
-
-  std::vector<BVHNode<T> > nodes_;
-  std::vector<unsigned int> indices_;  // max 4G triangles.
-  std::vector<BBox<T> > bboxes_;
-  BVHBuildOptions<T> options_;
-  BVHBuildStatistics stats_;
-  unsigned int pad0_;
-};
-
-// Predefined SAH predicator for triangle.
-template <typename T = float>
-class TriangleSAHPred {
- public:
-  TriangleSAHPred(
-      const T *vertices, const unsigned int *faces,
-      size_t vertex_stride_bytes)  // e.g. 12 for sizeof(float) * XYZ
-      : axis_(0),
-        pos_(static_cast<T>(0.0)),
-        vertices_(vertices),
-        faces_(faces),
-        vertex_stride_bytes_(vertex_stride_bytes) {}
+  template <class I, class F>
+  bool TestLeafNode(const Node &node, const Ray<T> &ray, const I &intersector,
+                    const F &filter) const {
+    return TestLeafNode(node, ray, intersector, filter,
+                        typename LeafIntersectorTraits<I>::Test());
+  }
 
-  TriangleSAHPred(const TriangleSAHPred<T> &rhs)
-      : axis_(rhs.axis_),
-        pos_(rhs.pos_),
-        vertices_(rhs.vertices_),
-        faces_(rhs.faces_),
-        vertex_stride_bytes_(rhs.vertex_stride_bytes_) {}
+  template <class I, class F>
+  bool TestLeafNode(const Node &node, const Ray<T> &ray, const I &intersector,
+                    const F &filter, PrimitiveLeafTest) const;
+
+  /// Leaf test with `I::IntersectLeaf`. Falls back to `PrimitiveLeafTest`
+  /// with an intersection filter or primitive masks.
+  template <class I, class F>
+  bool TestLeafNode(const Node &node, const Ray<T> &ray, const I &intersector,
+                    const F &filter, SIMDLeafTest) const;
+
+  /// Returns the depth of the tree(root = 0).
+  unsigned int ComputeTreeDepth() const;
+
+  /// `Traverse` loop for `BVHTraceOptions::distance_ordered_traversal`.
+  template <class I, class F>
+  void TraverseDistanceOrdered(const Ray<T> &ray, const I &intersector,
+                               const BVHTraceOptions &options,
+                               const F &filter) const;
+
+  /// Bounds of `index`th node at `time`(linear interpolation of key 0 and
+  /// key 1 bounds). `time` is clamped to [0, 1] as in
+  /// `MotionTriangleIntersector`. Needs motion bounds.
+  void InterpolateNodeBounds(unsigned int index, T time, Node *out) const {
+    // Widen to cover rounding errors of interpolation.
+    const NodeT kEps =
+        static_cast<NodeT>(2) * std::numeric_limits<NodeT>::epsilon();
+    const NodeT s = static_cast<NodeT>(
+        std::min(std::max(time, static_cast<T>(0.0)), static_cast<T>(1.0)));
+
+    const Node &key0 = motion_nodes_[2 * index + 0];
+    const Node &key1 = motion_nodes_[2 * index + 1];
 
-  TriangleSAHPred<T> &operator=(const TriangleSAHPred<T> &rhs) {
-    axis_ = rhs.axis_;
-    pos_ = rhs.pos_;
-    vertices_ = rhs.vertices_;
-    faces_ = rhs.faces_;
-    vertex_stride_bytes_ = rhs.vertex_stride_bytes_;
+    for (int k = 0; k < 3; k++) {
+      const NodeT bmin = key0.bmin[k] + s * (key1.bmin[k] - key0.bmin[k]);
+      const NodeT bmax = key0.bmax[k] + s * (key1.bmax[k] - key0.bmax[k]);
+      out->bmin[k] =
+          bmin - kEps * (std::fabs(key0.bmin[k]) + std::fabs(key1.bmin[k]));
+      out->bmax[k] =
+          bmax + kEps * (std::fabs(key0.bmax[k]) + std::fabs(key1.bmax[k]));
+    }
+  }
 
-    return (*this);
+  /// Returns true if subtrees outside of `BVHTraceOptions::prim_ids_range`
+  /// are culled for `intersector`: primitive ID ranges are built and the
+  /// intersector checks the range(`IntersectorFeatureTraits`).
+  template <class I>
+  bool IsPrimIdRangeCulled(const I &intersector) const {
+    (void)intersector;
+    return !prim_id_ranges_.empty() &&
+           (static_cast<unsigned int>(IntersectorFeatureTraits<I>::kFeatures) &
+            TRIANGLE_FEATURE_PRIM_IDS_RANGE);
   }
 
-  void Set(int axis, T pos) const {
-    axis_ = axis;
-    pos_ = pos;
+  /// Returns false if `index`th node has no primitive in
+  /// `options.prim_ids_range`. Needs primitive ID ranges.
+  bool IsNodeInPrimIdRange(unsigned int index,
+                           const BVHTraceOptions &options) const {
+    return (prim_id_ranges_[2 * index + 0] < options.prim_ids_range[1]) &&
+           (prim_id_ranges_[2 * index + 1] >= options.prim_ids_range[0]);
   }
 
-  bool operator()(unsigned int i) const {
-    int axis = axis_;
-    T pos = pos_;
+  /// Returns the mask of the lanes in `lane_mask` which hit `index`th node
+  /// (and whose ray type intersects the node mask when masks are set).
+  template <int N>
+  unsigned int TestPacketNode(unsigned int index,
+                              const RayPacket<T, N> &packet,
+                              const T inv_dir[3][N], const int dir_sign[3][N],
+                              const T hit_t[N], unsigned int lane_mask) const;
+
+  /// Returns the lanes in `lane_mask` whose `RayPacket::type` intersects
+  /// visibility `mask`(`RAY_TYPE_NONE` rays see everything).
+  template <int N>
+  static unsigned int PacketVisibleLanes(const RayPacket<T, N> &packet,
+                                         unsigned int mask,
+                                         unsigned int lane_mask) {
+    unsigned int visible = 0;
+    for (int i = 0; i < N; i++) {
+      if ((packet.type[i] == RAY_TYPE_NONE) || (packet.type[i] & mask)) {
+        visible |= (1u << i);
+      }
+    }
+    return visible & lane_mask;
+  }
 
-    unsigned int i0 = faces_[3 * i + 0];
-    unsigned int i1 = faces_[3 * i + 1];
-    unsigned int i2 = faces_[3 * i + 2];
+  /// Traverse the subtree at `root` with `lane`th ray of the packet.
+  /// Returns true if a hit was found. Returns at the first hit when `any_hit`.
+  template <int N, class I>
+  bool TraversePacketLane(unsigned int root, const RayPacket<T, N> &packet,
+                          int lane, const I &intersector, T *hit_t,
+                          bool any_hit) const;
+
+  /// Packet traversal shared by `TraversePacket` and `OccludedPacket`.
+  /// Returns the mask of the lanes which found a hit.
+  template <int N, class I>
+  unsigned int TraversePacketImpl(const RayPacket<T, N> &packet,
+                                  unsigned int active_mask,
+                                  const I &intersector, T hit_t[N],
+                                  bool any_hit) const;
+
+  /// (sort key, ray index)
+  typedef std::pair<unsigned int, size_t> StreamRayKey;
+
+  /// Sort rays by direction octant and Morton code of the ray origin.
+  void SortStreamRays(const Ray<T> *rays, size_t num_rays,
+                      std::vector<StreamRayKey> *order) const;
+
+  /// Run `task` for packets [0, `num_packets`) of the sorted stream.
+  /// `task` is copied for each thread. Returns the sum of `task` results.
+  template <class Task>
+  size_t RunStreamTasks(size_t num_packets, const Task &task,
+                        unsigned int num_threads) const;
+
+  /// Traces packets of the sorted ray stream and scatters closest hits.
+  template <class I, class H>
+  class StreamTraverseTask {
+   public:
+    StreamTraverseTask(const BVHAccel *accel, const Ray<T> *rays,
+                       const std::vector<StreamRayKey> *order,
+                       const I &intersector, H *isects,
+                       unsigned char *hit_flags,
+                       const BVHTraceOptions &options)
+        : accel_(accel),
+          rays_(rays),
+          order_(order),
+          intersector_(intersector),
+          isects_(isects),
+          hit_flags_(hit_flags),
+          options_(options) {}
+
+    size_t operator()(size_t packet_begin, size_t packet_end) const {
+      const size_t N = size_t(I::kPacketSize);
+      size_t num_hits = 0;
+
+      for (size_t p = packet_begin; p < packet_end; p++) {
+        const size_t offset = p * N;
+        const int num_lanes =
+            static_cast<int>(std::min(N, order_->size() - offset));
+
+        RayPacket<T, I::kPacketSize> packet;
+        for (int i = 0; i < num_lanes; i++) {
+          packet.SetRay(i, rays_[(*order_)[offset + size_t(i)].second]);
+        }
 
-    real3<T> p0(get_vertex_addr<T>(vertices_, i0, vertex_stride_bytes_));
-    real3<T> p1(get_vertex_addr<T>(vertices_, i1, vertex_stride_bytes_));
+        H packet_isects[I::kPacketSize];
+        unsigned int hit_mask = accel_->TraversePacket(
+            packet, intersector_, packet_isects, options_);
+
+        // Scatter results to the original ray order.
+        for (int i = 0; i < num_lanes; i++) {
+          const size_t ray_idx = (*order_)[offset + size_t(i)].second;
+          const bool hit = (hit_mask & (1u << i)) != 0;
+          if (hit) {
+            isects_[ray_idx] = packet_isects[i];
+            num_hits++;
+          }
+          if (hit_flags_) {
+            hit_flags_[ray_idx] = hit ? 1 : 0;
+          }
+        }
+      }
+
+      return num_hits;
+    }
+
+   private:
+    const BVHAccel *accel_;
+    const Ray<T> *rays_;
+    const std::vector<StreamRayKey> *order_;
+    const I intersector_;
+    H *isects_;
+    unsigned char *hit_flags_;
+    const BVHTraceOptions options_;
+  };
+
+  /// Squared distance between `p` and the bounding box of `node`.
+  static T PointNodeDistanceSquared(const real3<T> &p, const Node &node) {
+    T dist2 = static_cast<T>(0.0);
+    for (int k = 0; k < 3; k++) {
+      const T bmin = static_cast<T>(node.bmin[k]);
+      const T bmax = static_cast<T>(node.bmax[k]);
+      const T d = (p[k] < bmin) ? (bmin - p[k])
+                                : ((p[k] > bmax) ? (p[k] - bmax)
+                                                 : static_cast<T>(0.0));
+      dist2 += d * d;
+    }
+    return dist2;
+  }
+
+  /// Axis aligned box query volume of overlap queries.
+  class OverlapBoxVolume {
+   public:
+    enum { kStride = 6 };  // Packed(bmin xyz, bmax xyz)
+
+    explicit OverlapBoxVolume(const T *box)
+        : bmin_(box), bmax_(box + 3) {}
+    OverlapBoxVolume(const T bmin[3], const T bmax[3])
+        : bmin_(bmin), bmax_(bmax) {}
+
+    bool Overlap(const real3<T> &bmin, const real3<T> &bmax) const {
+      for (int k = 0; k < 3; k++) {
+        if ((bmax[k] < bmin_[k]) || (bmin[k] > bmax_[k])) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+   private:
+    real3<T> bmin_;
+    real3<T> bmax_;
+  };
+
+  /// Sphere query volume of overlap queries.
+  class OverlapSphereVolume {
+   public:
+    enum { kStride = 4 };  // Packed(center xyz, radius)
+
+    explicit OverlapSphereVolume(const T *sphere)
+        : center_(sphere), radius2_(sphere[3] * sphere[3]) {}
+    OverlapSphereVolume(const T center[3], T radius)
+        : center_(center), radius2_(radius * radius) {}
+
+    bool Overlap(const real3<T> &bmin, const real3<T> &bmax) const {
+      T dist2 = static_cast<T>(0.0);
+      for (int k = 0; k < 3; k++) {
+        const T d = (center_[k] < bmin[k])
+                        ? (bmin[k] - center_[k])
+                        : ((center_[k] > bmax[k]) ? (center_[k] - bmax[k])
+                                                  : static_cast<T>(0.0));
+        dist2 += d * d;
+      }
+      return dist2 <= radius2_;
+    }
+
+   private:
+    real3<T> center_;
+    T radius2_;
+  };
+
+  /// Overlap query callback which writes primitive IDs to a fixed size
+  /// buffer.
+  class OverlapCollector {
+   public:
+    OverlapCollector(unsigned int *prim_ids, size_t max_prim_ids)
+        : prim_ids_(prim_ids), max_prim_ids_(max_prim_ids), count_(0) {}
+
+    bool operator()(unsigned int prim_id) {
+      if (count_ < max_prim_ids_) {
+        prim_ids_[count_] = prim_id;
+      }
+      count_++;
+      return true;
+    }
+
+   private:
+    unsigned int *prim_ids_;
+    size_t max_prim_ids_;
+    size_t count_;
+  };
+
+  /// Reports primitives whose bounding box overlaps `volume` to `callback`.
+  template <class V, class P, class F>
+  size_t OverlapTraverse(const V &volume, const P &prims, F *callback) const;
+
+  /// Runs overlap queries for a range of packed query volumes.
+  template <class V, class P>
+  class OverlapTask {
+   public:
+    OverlapTask(const BVHAccel *accel, const T *volumes, const P &prims,
+                unsigned int *prim_ids, size_t max_prim_ids, size_t *counts)
+        : accel_(accel),
+          volumes_(volumes),
+          prims_(&prims),
+          prim_ids_(prim_ids),
+          max_prim_ids_(max_prim_ids),
+          counts_(counts) {}
+
+    size_t operator()(size_t begin, size_t end) const {
+      size_t num_overlaps = 0;
+      for (size_t i = begin; i < end; i++) {
+        const V volume(&volumes_[size_t(V::kStride) * i]);
+        OverlapCollector collector(&prim_ids_[i * max_prim_ids_],
+                                   max_prim_ids_);
+        const size_t count =
+            accel_->OverlapTraverse(volume, *prims_, &collector);
+        if (counts_) {
+          counts_[i] = count;
+        }
+        num_overlaps += count;
+      }
+      return num_overlaps;
+    }
+
+   private:
+    const BVHAccel *accel_;
+    const T *volumes_;
+    const P *prims_;
+    unsigned int *prim_ids_;
+    size_t max_prim_ids_;
+    size_t *counts_;
+  };
+
+  /// (node index, other node index)
+  typedef std::pair<unsigned int, unsigned int> NodePair;
+
+  /// Returns true if `node` overlaps `other_node` transformed by `transform`.
+  bool NodePairOverlap(const Node &node, const Node &other_node,
+                       const T *transform) const {
+    real3<T> other_bmin, other_bmax;
+    TransformBoundingBox(
+        transform,
+        real3<T>(static_cast<T>(other_node.bmin[0]),
+                 static_cast<T>(other_node.bmin[1]),
+                 static_cast<T>(other_node.bmin[2])),
+        real3<T>(static_cast<T>(other_node.bmax[0]),
+                 static_cast<T>(other_node.bmax[1]),
+                 static_cast<T>(other_node.bmax[2])),
+        &other_bmin, &other_bmax);
+
+    for (int k = 0; k < 3; k++) {
+      if ((static_cast<T>(node.bmax[k]) < other_bmin[k]) ||
+          (static_cast<T>(node.bmin[k]) > other_bmax[k])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// Returns true if `node`(rather than `other_node`) should be split in
+  /// simultaneous traversal: a branch node which is larger than the other.
+  static bool SplitFirstNode(const Node &node, const Node &other_node) {
+    if (node.flag != 0) {
+      return false;
+    }
+    if (other_node.flag != 0) {
+      return true;
+    }
+    T size = static_cast<T>(0.0);
+    T other_size = static_cast<T>(0.0);
+    for (int k = 0; k < 3; k++) {
+      size += static_cast<T>(node.bmax[k]) - static_cast<T>(node.bmin[k]);
+      other_size += static_cast<T>(other_node.bmax[k]) -
+                    static_cast<T>(other_node.bmin[k]);
+    }
+    return size >= other_size;
+  }
+
+  /// Simultaneous traversal from `root`(an overlapping node pair).
+  /// Sets `*stopped` if `callback` stops the query.
+  template <class Q, class F>
+  size_t OverlapNodePairs(const BVHAccel &other, const T *transform,
+                          const NodePair &root, const Q &pair_test,
+                          F *callback, bool *stopped) const;
+
+  /// Overlap callback which appends primitive pairs to a vector.
+  class OverlapPairCollector {
+   public:
+    explicit OverlapPairCollector(
+        std::vector<std::pair<unsigned int, unsigned int> > *pairs)
+        : pairs_(pairs) {}
+
+    bool operator()(unsigned int prim_id, unsigned int other_prim_id) {
+      pairs_->push_back(std::make_pair(prim_id, other_prim_id));
+      return true;
+    }
+
+   private:
+    std::vector<std::pair<unsigned int, unsigned int> > *pairs_;
+  };
+
+  /// Runs `OverlapNodePairs` for a range of subtree pairs.
+  template <class Q>
+  class OverlapBVHTask {
+   public:
+    OverlapBVHTask(
+        const BVHAccel *accel, const BVHAccel *other, const T *transform,
+        const std::vector<NodePair> *roots, const Q &pair_test,
+        std::vector<std::vector<std::pair<unsigned int, unsigned int> > >
+            *root_pairs)
+        : accel_(accel),
+          other_(other),
+          transform_(transform),
+          roots_(roots),
+          pair_test_(&pair_test),
+          root_pairs_(root_pairs) {}
+
+    size_t operator()(size_t begin, size_t end) const {
+      size_t num_pairs = 0;
+      for (size_t i = begin; i < end; i++) {
+        OverlapPairCollector collector(&(*root_pairs_)[i]);
+        bool stopped = false;
+        num_pairs += accel_->OverlapNodePairs(*other_, transform_,
+                                              (*roots_)[i], *pair_test_,
+                                              &collector, &stopped);
+      }
+      return num_pairs;
+    }
+
+   private:
+    const BVHAccel *accel_;
+    const BVHAccel *other_;
+    const T *transform_;
+    const std::vector<NodePair> *roots_;
+    const Q *pair_test_;
+    std::vector<std::vector<std::pair<unsigned int, unsigned int> > >
+        *root_pairs_;
+  };
+
+  /// Nearest-first traversal shared by `ClosestPoint` and
+  /// `KNearestNeighbors`. Visits nodes within squared distance `radius2` of
+  /// `query`, near child first. `(*visitor)(prim_id)` is called for each
+  /// primitive of a visited leaf and returns the current squared search
+  /// radius, which must not grow.
+  template <class V>
+  void TraverseNearestFirst(const real3<T> &query, T radius2,
+                            V *visitor) const;
+
+  /// Leaf visitor of `ClosestPoint`. Keeps the closest primitive.
+  template <class Q, class H>
+  class ClosestPointVisitor {
+   public:
+    ClosestPointVisitor(const real3<T> &query, T max_dist2,
+                        const Q &prim_query, H *result)
+        : query_(query),
+          prim_query_(&prim_query),
+          result_(result),
+          best_dist2_(max_dist2),
+          found_(false) {}
+
+    T operator()(unsigned int prim_id) {
+      H candidate;
+      const T dist2 = prim_query_->ClosestPoint(query_, prim_id, &candidate);
+      if (dist2 <= best_dist2_) {
+        (*result_) = candidate;
+        best_dist2_ = dist2;
+        found_ = true;
+      }
+      return best_dist2_;
+    }
+
+    T best_dist2() const { return best_dist2_; }
+    bool found() const { return found_; }
+
+   private:
+    const real3<T> query_;
+    const Q *prim_query_;
+    H *result_;
+    T best_dist2_;
+    bool found_;
+  };
+
+  /// Leaf visitor of `KNearestNeighbors`. Keeps the `k` nearest primitives
+  /// in a max-heap(`PushNeighbor`).
+  template <class Q>
+  class KNearestNeighborsVisitor {
+   public:
+    KNearestNeighborsVisitor(const real3<T> &query, unsigned int k,
+                             T max_dist2, const Q &prim_query,
+                             unsigned int *prim_ids, T *dist2s)
+        : query_(query),
+          k_(k),
+          prim_query_(&prim_query),
+          prim_ids_(prim_ids),
+          dist2s_(dist2s),
+          radius2_(max_dist2),
+          num_found_(0) {}
+
+    T operator()(unsigned int prim_id) {
+      const T dist2 = prim_query_->DistanceSquared(query_, prim_id);
+      if ((num_found_ < k_) ? (dist2 <= radius2_) : (dist2 < radius2_)) {
+        PushNeighbor(prim_id, dist2, k_, prim_ids_, dist2s_, &num_found_);
+        if (num_found_ == k_) {
+          // Shrink to the farthest candidate once the heap is full.
+          radius2_ = dist2s_[0];
+        }
+      }
+      return radius2_;
+    }
+
+    unsigned int num_found() const { return num_found_; }
+
+   private:
+    const real3<T> query_;
+    unsigned int k_;
+    const Q *prim_query_;
+    unsigned int *prim_ids_;
+    T *dist2s_;
+    T radius2_;
+    unsigned int num_found_;
+  };
+
+  /// Runs `ClosestPoint` for a range of query points.
+  template <class Q, class H>
+  class ClosestPointTask {
+   public:
+    ClosestPointTask(const BVHAccel *accel, const T *points, T max_dist,
+                     const Q &prim_query, H *results,
+                     unsigned char *found_flags)
+        : accel_(accel),
+          points_(points),
+          max_dist_(max_dist),
+          prim_query_(&prim_query),
+          results_(results),
+          found_flags_(found_flags) {}
+
+    size_t operator()(size_t begin, size_t end) const {
+      size_t num_found = 0;
+      for (size_t i = begin; i < end; i++) {
+        const bool found = accel_->ClosestPoint(&points_[3 * i], max_dist_,
+                                                *prim_query_, &results_[i]);
+        if (found_flags_) {
+          found_flags_[i] = found ? 1 : 0;
+        }
+        num_found += found ? 1 : 0;
+      }
+      return num_found;
+    }
+
+   private:
+    const BVHAccel *accel_;
+    const T *points_;
+    T max_dist_;
+    const Q *prim_query_;
+    H *results_;
+    unsigned char *found_flags_;
+  };
+
+  /// Sort query points by Morton code in the BVH bounds.
+  void SortQueryPoints(const T *points, size_t num_points,
+                       std::vector<StreamRayKey> *order) const;
+
+  /// Push a neighbor to the bounded max-heap of `k` entries which has
+  /// `*size` entries.
+  static void PushNeighbor(unsigned int prim_id, T dist2, unsigned int k,
+                           unsigned int *prim_ids, T *dist2s,
+                           unsigned int *size) {
+    unsigned int i;
+    if ((*size) < k) {
+      // Sift up
+      i = (*size)++;
+      while (i > 0) {
+        const unsigned int parent = (i - 1) / 2;
+        if (dist2s[parent] >= dist2) {
+          break;
+        }
+        prim_ids[i] = prim_ids[parent];
+        dist2s[i] = dist2s[parent];
+        i = parent;
+      }
+    } else {
+      // Replace the farthest one and sift down
+      i = 0;
+      for (;;) {
+        const unsigned int left = 2 * i + 1;
+        if (left >= k) {
+          break;
+        }
+        const unsigned int child =
+            ((left + 1 < k) && (dist2s[left + 1] > dist2s[left])) ? left + 1
+                                                                  : left;
+        if (dist2s[child] <= dist2) {
+          break;
+        }
+        prim_ids[i] = prim_ids[child];
+        dist2s[i] = dist2s[child];
+        i = child;
+      }
+    }
+    prim_ids[i] = prim_id;
+    dist2s[i] = dist2;
+  }
+
+  /// Runs `KNearestNeighbors` for a range of sorted query points.
+  template <class Q>
+  class KNearestNeighborsTask {
+   public:
+    KNearestNeighborsTask(const BVHAccel *accel, const T *points,
+                          const std::vector<StreamRayKey> *order,
+                          unsigned int k, T max_dist, const Q &prim_query,
+                          unsigned int *prim_ids, T *dist2s,
+                          unsigned int *counts)
+        : accel_(accel),
+          points_(points),
+          order_(order),
+          k_(k),
+          max_dist_(max_dist),
+          prim_query_(&prim_query),
+          prim_ids_(prim_ids),
+          dist2s_(dist2s),
+          counts_(counts) {}
+
+    size_t operator()(size_t begin, size_t end) const {
+      size_t num_found = 0;
+      for (size_t i = begin; i < end; i++) {
+        const size_t idx = (*order_)[i].second;
+        const unsigned int count = accel_->KNearestNeighbors(
+            &points_[3 * idx], k_, max_dist_, *prim_query_,
+            &prim_ids_[idx * k_], &dist2s_[idx * k_]);
+        counts_[idx] = count;
+        num_found += count;
+      }
+      return num_found;
+    }
+
+   private:
+    const BVHAccel *accel_;
+    const T *points_;
+    const std::vector<StreamRayKey> *order_;
+    unsigned int k_;
+    T max_dist_;
+    const Q *prim_query_;
+    unsigned int *prim_ids_;
+    T *dist2s_;
+    unsigned int *counts_;
+  };
+
+  /// Frustum of a tile of rays which share the origin.
+  /// Hit distance ranges of the tile are bounded with interval arithmetic
+  /// over the ray directions.
+  class TileFrustum {
+   public:
+    /// Returns false if the rays do not share the origin.
+    bool Init(const Ray<T> *rays, size_t num_rays) {
+      for (int k = 0; k < 3; k++) {
+        org[k] = rays[0].org[k];
+      }
+      T dir_min[3], dir_max[3];
+      for (int k = 0; k < 3; k++) {
+        dir_min[k] = dir_max[k] = rays[0].dir[k];
+      }
+      min_t = rays[0].min_t;
+      max_t = rays[0].max_t;
+
+      for (size_t i = 1; i < num_rays; i++) {
+        const Ray<T> &ray = rays[i];
+        for (int k = 0; k < 3; k++) {
+          if (ray.org[k] != org[k]) {
+            return false;
+          }
+          dir_min[k] = std::min(dir_min[k], ray.dir[k]);
+          dir_max[k] = std::max(dir_max[k], ray.dir[k]);
+        }
+        min_t = std::min(min_t, ray.min_t);
+        max_t = std::max(max_t, ray.max_t);
+      }
+
+      for (int k = 0; k < 3; k++) {
+        // A direction interval which contains zero does not bound the hit
+        // distance along this axis.
+        bounded[k] = (dir_min[k] > static_cast<T>(0.0)) ||
+                     (dir_max[k] < static_cast<T>(0.0));
+        inv_dir_min[k] =
+            bounded[k] ? static_cast<T>(1.0) / dir_max[k] : static_cast<T>(0.0);
+        inv_dir_max[k] =
+            bounded[k] ? static_cast<T>(1.0) / dir_min[k] : static_cast<T>(0.0);
+        dir_sign[k] =
+            (dir_min[k] + dir_max[k] < static_cast<T>(0.0)) ? 1 : 0;
+      }
+
+      return true;
+    }
+
+    /// Returns true if any ray of the tile may hit the bounding box of
+    /// `node`.
+    bool Intersect(const Node &node) const {
+      // Relative slack which keeps the test conservative against rounding
+      // errors(and the robust per-ray test).
+      const T kSlack = static_cast<T>(4.0) * std::numeric_limits<T>::epsilon();
+
+      T tmin = min_t;
+      T tmax = max_t;
+
+      for (int k = 0; k < 3; k++) {
+        const T bmin = static_cast<T>(node.bmin[k]) - org[k];
+        const T bmax = static_cast<T>(node.bmax[k]) - org[k];
+
+        if (!bounded[k]) {
+          continue;
+        }
+
+        // [bmin, bmax] * [inv_dir_min, inv_dir_max]
+        const T t0 = bmin * inv_dir_min[k];
+        const T t1 = bmin * inv_dir_max[k];
+        const T t2 = bmax * inv_dir_min[k];
+        const T t3 = bmax * inv_dir_max[k];
+        T lo = std::min(std::min(t0, t1), std::min(t2, t3));
+        T hi = std::max(std::max(t0, t1), std::max(t2, t3));
+        lo -= std::fabs(lo) * kSlack;
+        hi += std::fabs(hi) * kSlack;
+
+        tmin = std::max(tmin, lo);
+        tmax = std::min(tmax, hi);
+      }
+
+      return tmin <= tmax;
+    }
+
+    T org[3];
+    T inv_dir_min[3];
+    T inv_dir_max[3];
+    bool bounded[3];
+    int dir_sign[3];  // sign of the center direction
+    T min_t;
+    T max_t;
+  };
+
+  /// Collect entry subtrees of a tile(near first).
+  /// Returns the number of entry nodes.
+  unsigned int FindTileEntryNodes(const TileFrustum &frustum,
+                                  const BVHTraceOptions &options,
+                                  bool cull_prim_ids,
+                                  unsigned int *entry_nodes) const;
+
+  /// Traverse from `entry_nodes`(near first) with a single ray.
+  template <class I>
+  bool TraverseFromEntryNodes(const Ray<T> &ray, const I &intersector,
+                              const unsigned int *entry_nodes,
+                              unsigned int num_entry_nodes,
+                              const BVHTraceOptions &options) const;
+
+  /// Traces a bundle of up to `kNANORT_BUNDLE_SIZE` rays which share the
+  /// origin. Returns total number of hits.
+  template <class I, class H>
+  size_t TraverseBundleRays(const Ray<T> *rays, unsigned int num_rays,
+                            const TileFrustum &frustum, unsigned int max_hits,
+                            const I &intersector, H *isects,
+                            unsigned int *num_hits,
+                            const BVHTraceOptions &options) const;
+
+  /// Runs `TraverseBundleRays` for a range of bundles.
+  template <class I, class H>
+  class BundleTraverseTask {
+   public:
+    BundleTraverseTask(const BVHAccel *accel, const Ray<T> *rays,
+                       size_t num_rays, unsigned int max_hits,
+                       const I &intersector, H *isects, unsigned int *num_hits,
+                       const BVHTraceOptions &options)
+        : accel_(accel),
+          rays_(rays),
+          num_rays_(num_rays),
+          max_hits_(max_hits),
+          intersector_(&intersector),
+          isects_(isects),
+          num_hits_(num_hits),
+          options_(options) {}
+
+    size_t operator()(size_t begin, size_t end) const {
+      size_t total_hits = 0;
+      for (size_t b = begin; b < end; b++) {
+        const size_t ray_begin = b * size_t(kNANORT_BUNDLE_SIZE);
+        const size_t ray_end =
+            std::min(num_rays_, ray_begin + size_t(kNANORT_BUNDLE_SIZE));
+
+        TileFrustum frustum;
+        if (frustum.Init(&rays_[ray_begin], ray_end - ray_begin)) {
+          total_hits += accel_->TraverseBundleRays(
+              &rays_[ray_begin], static_cast<unsigned int>(ray_end - ray_begin),
+              frustum, max_hits_, *intersector_, &isects_[ray_begin * max_hits_],
+              &num_hits_[ray_begin], options_);
+        } else {
+          // Rays do not share the origin: a single ray is always a bundle.
+          for (size_t i = ray_begin; i < ray_end; i++) {
+            frustum.Init(&rays_[i], 1);
+            total_hits += accel_->TraverseBundleRays(
+                &rays_[i], 1, frustum, max_hits_, *intersector_,
+                &isects_[i * max_hits_], &num_hits_[i], options_);
+          }
+        }
+      }
+      return total_hits;
+    }
+
+   private:
+    const BVHAccel *accel_;
+    const Ray<T> *rays_;
+    size_t num_rays_;
+    unsigned int max_hits_;
+    const I *intersector_;
+    H *isects_;
+    unsigned int *num_hits_;
+    const BVHTraceOptions options_;
+  };
+
+  /// State of a ray in flight of `TraverseInterleaved`.
+  template <class I>
+  struct InterleavedRay {
+    typename I::TraceContext ctx;
+    NodeTraversalRay<NodeT, T> node_ray;
+    size_t ray_idx;
+    T hit_t;
+    int node_stack_index;  // -1 = stack is empty
+    unsigned int leaf_index;  // Leaf to test in the next step(or ~0)
+    unsigned int node_stack[kNANORT_MAX_STACK_DEPTH];
+  };
+
+  /// Starts traversal of `ray` in `r`.
+  template <class I>
+  void BeginInterleavedRay(InterleavedRay<I> *r, const Ray<T> &ray,
+                           size_t ray_idx, const I &intersector,
+                           const BVHTraceOptions &options) const;
+
+  /// Advances `r` by one node. Returns false when traversal is finished.
+  template <class I>
+  bool StepInterleavedRay(InterleavedRay<I> *r, const Ray<T> &ray,
+                          const I &intersector, const BVHTraceOptions &options,
+                          bool cull_prim_ids) const;
+
+  /// Traces rays [`ray_begin`, `ray_end`) with `kNANORT_RAYS_IN_FLIGHT` rays
+  /// in flight. Returns the number of hits.
+  template <class I, class H>
+  size_t TraverseInterleavedRange(const Ray<T> *rays, size_t ray_begin,
+                                  size_t ray_end, const I &intersector,
+                                  H *isects, unsigned char *hit_flags,
+                                  const BVHTraceOptions &options) const;
+
+  /// Traces groups of `kNANORT_RAYS_IN_FLIGHT` rays with
+  /// `TraverseInterleavedRange`.
+  template <class I, class H>
+  class InterleavedTraverseTask {
+   public:
+    InterleavedTraverseTask(const BVHAccel *accel, const Ray<T> *rays,
+                            size_t num_rays, const I &intersector, H *isects,
+                            unsigned char *hit_flags,
+                            const BVHTraceOptions &options)
+        : accel_(accel),
+          rays_(rays),
+          num_rays_(num_rays),
+          intersector_(&intersector),
+          isects_(isects),
+          hit_flags_(hit_flags),
+          options_(options) {}
+
+    size_t operator()(size_t group_begin, size_t group_end) const {
+      const size_t G = size_t(kNANORT_RAYS_IN_FLIGHT);
+      return accel_->TraverseInterleavedRange(
+          rays_, std::min(group_begin * G, num_rays_),
+          std::min(group_end * G, num_rays_), *intersector_, isects_,
+          hit_flags_, options_);
+    }
+
+   private:
+    const BVHAccel *accel_;
+    const Ray<T> *rays_;
+    size_t num_rays_;
+    const I *intersector_;  // Shared. Per-ray state is in `InterleavedRay`.
+    H *isects_;
+    unsigned char *hit_flags_;
+    const BVHTraceOptions options_;
+  };
+
+  /// Traces packets of the sorted ray stream and scatters occlusion flags.
+  template <class I>
+  class StreamOccludedTask {
+   public:
+    StreamOccludedTask(const BVHAccel *accel, const Ray<T> *rays,
+                       const std::vector<StreamRayKey> *order,
+                       const I &intersector, unsigned char *occluded,
+                       const BVHTraceOptions &options)
+        : accel_(accel),
+          rays_(rays),
+          order_(order),
+          intersector_(intersector),
+          occluded_(occluded),
+          options_(options) {}
+
+    size_t operator()(size_t packet_begin, size_t packet_end) const {
+      const size_t N = size_t(I::kPacketSize);
+      size_t num_occluded = 0;
+
+      for (size_t p = packet_begin; p < packet_end; p++) {
+        const size_t offset = p * N;
+        const int num_lanes =
+            static_cast<int>(std::min(N, order_->size() - offset));
+
+        RayPacket<T, I::kPacketSize> packet;
+        for (int i = 0; i < num_lanes; i++) {
+          packet.SetRay(i, rays_[(*order_)[offset + size_t(i)].second]);
+        }
+
+        unsigned int mask =
+            accel_->OccludedPacket(packet, intersector_, options_);
+
+        // Scatter results to the original ray order.
+        for (int i = 0; i < num_lanes; i++) {
+          const bool hit = (mask & (1u << i)) != 0;
+          occluded_[(*order_)[offset + size_t(i)].second] = hit ? 1 : 0;
+          num_occluded += hit ? 1 : 0;
+        }
+      }
+
+      return num_occluded;
+    }
+
+   private:
+    const BVHAccel *accel_;
+    const Ray<T> *rays_;
+    const std::vector<StreamRayKey> *order_;
+    const I intersector_;
+    unsigned char *occluded_;
+    const BVHTraceOptions options_;
+  };
+
+  typedef BoundedMaxHeap<NodeHit<T>, kNANORT_MAX_MULTI_HITS,
+                         NodeHitComparator<T> >
+      NodeHitHeap;
+
+  template <class I>
+  bool TestLeafNodeIntersections(const Node &node, const Ray<T> &ray,
+                                 const I &intersector,
+                                 NodeHitHeap *isect_heap) const;
+
+  template <class I, class H>
+  bool MultiHitTestLeafNode(
+      BoundedMaxHeap<H, kNANORT_MAX_MULTI_HITS, HitDistanceComparator<H> >
+          *isect_heap,
+      const Node &node, const Ray<T> &ray, const I &intersector) const;
+
+  NodeArray nodes_;
+  IndexArray indices_;  // max 4G triangles.
+  BBoxArray bboxes_;
+  IndexArray parents_;  // Parent node links(optional)
+  IndexArray prim_id_ranges_;  // Min/max primitive ID per node(optional)
+  IndexArray node_masks_;  // OR of visibility masks per node(optional)
+  IndexArray prim_masks_;  // Visibility mask per `indices_` entry(optional)
+  NodeArray motion_nodes_;  // Key 0 and key 1 bounds per node(optional)
+  BVHBuildOptions<T> options_;
+  BVHBuildStatistics stats_;
+  size_t build_scratch_bytes_;
+  unsigned int pad0_;
+};
+
+// Predefined SAH predicator for triangle.
+// `I` is the vertex index type(e.g. `unsigned short` for 16bit index buffers).
+template <typename T = float, typename I = unsigned int>
+class TriangleSAHPred {
+ public:
+  TriangleSAHPred(
+      const T *vertices, const I *faces,
+      size_t vertex_stride_bytes)  // e.g. 12 for sizeof(float) * XYZ
+      : axis_(0),
+        pos_(static_cast<T>(0.0)),
+        vertices_(vertices),
+        faces_(faces),
+        vertex_stride_bytes_(vertex_stride_bytes) {}
+
+  TriangleSAHPred(const TriangleSAHPred<T, I> &rhs)
+      : axis_(rhs.axis_),
+        pos_(rhs.pos_),
+        vertices_(rhs.vertices_),
+        faces_(rhs.faces_),
+        vertex_stride_bytes_(rhs.vertex_stride_bytes_) {}
+
+  TriangleSAHPred<T, I> &operator=(const TriangleSAHPred<T, I> &rhs) {
+    axis_ = rhs.axis_;
+    pos_ = rhs.pos_;
+    vertices_ = rhs.vertices_;
+    faces_ = rhs.faces_;
+    vertex_stride_bytes_ = rhs.vertex_stride_bytes_;
+
+    return (*this);
+  }
+
+  void Set(int axis, T pos) const {
+    axis_ = axis;
+    pos_ = pos;
+  }
+
+  bool operator()(unsigned int i) const {
+    int axis = axis_;
+    T pos = pos_;
+
+    unsigned int i0 = faces_[3 * i + 0];
+    unsigned int i1 = faces_[3 * i + 1];
+    unsigned int i2 = faces_[3 * i + 2];
+
+    real3<T> p0(get_vertex_addr<T>(vertices_, i0, vertex_stride_bytes_));
+    real3<T> p1(get_vertex_addr<T>(vertices_, i1, vertex_stride_bytes_));
     real3<T> p2(get_vertex_addr<T>(vertices_, i2, vertex_stride_bytes_));
 
     T center = p0[axis] + p1[axis] + p2[axis];
@@ -907,16 +3003,17 @@ class TriangleSAHPred {
   mutable int axis_;
   mutable T pos_;
   const T *vertices_;
-  const unsigned int *faces_;
+  const I *faces_;
   const size_t vertex_stride_bytes_;
 };
 
 // Predefined Triangle mesh geometry.
-template <typename T = float>
+// `I` is the vertex index type(e.g. `unsigned short` for 16bit index buffers).
+template <typename T = float, typename I = unsigned int>
 class TriangleMesh {
  public:
   TriangleMesh(
-      const T *vertices, const unsigned int *faces,
+      const T *vertices, const I *faces,
       const size_t vertex_stride_bytes)  // e.g. 12 for sizeof(float) * XYZ
       : vertices_(vertices),
         faces_(faces),
@@ -949,1652 +3046,5497 @@ class TriangleMesh {
   }
 
   const T *vertices_;
-  const unsigned int *faces_;
+  const I *faces_;
   const size_t vertex_stride_bytes_;
 
-  //
-  // Accessors
-  //
-  const T *GetVertices() const {
-    return vertices_;
-  }
+  //
+  // Accessors
+  //
+  const T *GetVertices() const {
+    return vertices_;
+  }
+
+  const I *GetFaces() const {
+    return faces_;
+  }
+
+  size_t GetVertexStrideBytes() const {
+    return vertex_stride_bytes_;
+  }
+};
+
+// Predefined SAH predicator for linearly moving triangles.
+// Primitives are split by the centroid at time 0.5.
+template <typename T = float, typename I = unsigned int>
+class MotionTriangleSAHPred {
+ public:
+  MotionTriangleSAHPred(const T *vertices0, const T *vertices1, const I *faces,
+                        size_t vertex_stride_bytes)
+      : axis_(0),
+        pos_(static_cast<T>(0.0)),
+        vertices0_(vertices0),
+        vertices1_(vertices1),
+        faces_(faces),
+        vertex_stride_bytes_(vertex_stride_bytes) {}
+
+  void Set(int axis, T pos) const {
+    axis_ = axis;
+    pos_ = pos;
+  }
+
+  bool operator()(unsigned int i) const {
+    int axis = axis_;
+    T pos = pos_;
+
+    T center = static_cast<T>(0.0);
+    for (int k = 0; k < 3; k++) {
+      const unsigned int f = faces_[3 * i + k];
+      center += get_vertex_addr<T>(vertices0_, f, vertex_stride_bytes_)[axis];
+      center += get_vertex_addr<T>(vertices1_, f, vertex_stride_bytes_)[axis];
+    }
+
+    return (center < pos * static_cast<T>(6.0));
+  }
+
+ private:
+  mutable int axis_;
+  mutable T pos_;
+  const T *vertices0_;
+  const T *vertices1_;
+  const I *faces_;
+  size_t vertex_stride_bytes_;
+};
+
+// Predefined linearly moving triangle mesh geometry(two keyframes with the
+// same topology) for `BVHAccel::BuildMotionBlur`.
+template <typename T = float, typename I = unsigned int>
+class MotionTriangleMesh {
+ public:
+  MotionTriangleMesh(const T *vertices0, const T *vertices1, const I *faces,
+                     const size_t vertex_stride_bytes)
+      : vertices0_(vertices0),
+        vertices1_(vertices1),
+        faces_(faces),
+        vertex_stride_bytes_(vertex_stride_bytes) {}
+
+  /// Compute bounding box for `prim_index`th triangle over the whole time
+  /// range(union of both keys).
+  void BoundingBox(real3<T> *bmin, real3<T> *bmax,
+                   unsigned int prim_index) const {
+    real3<T> bmin1, bmax1;
+    MotionBoundingBox(bmin, bmax, prim_index, 0);
+    MotionBoundingBox(&bmin1, &bmax1, prim_index, 1);
+    for (int k = 0; k < 3; k++) {
+      (*bmin)[k] = std::min((*bmin)[k], bmin1[k]);
+      (*bmax)[k] = std::max((*bmax)[k], bmax1[k]);
+    }
+  }
+
+  /// Compute bounding box for `prim_index`th triangle at `key`(0 or 1).
+  void MotionBoundingBox(real3<T> *bmin, real3<T> *bmax,
+                         unsigned int prim_index, int key) const {
+    const T *vertices = (key == 0) ? vertices0_ : vertices1_;
+
+    for (int i = 0; i < 3; i++) {
+      const T *p = get_vertex_addr<T>(vertices, faces_[3 * prim_index + i],
+                                      vertex_stride_bytes_);
+      for (int k = 0; k < 3; k++) {
+        (*bmin)[k] = (i == 0) ? p[k] : std::min((*bmin)[k], p[k]);
+        (*bmax)[k] = (i == 0) ? p[k] : std::max((*bmax)[k], p[k]);
+      }
+    }
+  }
+
+  const T *vertices0_;
+  const T *vertices1_;
+  const I *faces_;
+  const size_t vertex_stride_bytes_;
+
+  //
+  // Accessors
+  //
+  const T *GetVertices0() const { return vertices0_; }
+
+  const T *GetVertices1() const { return vertices1_; }
+
+  const I *GetFaces() const { return faces_; }
+
+  size_t GetVertexStrideBytes() const { return vertex_stride_bytes_; }
+};
+
+///
+/// 16-bit quantized vertex positions.
+///
+/// Vertices are grouped into clusters of 2^`log2_cluster_size` consecutive
+/// vertices. Each cluster stores its own origin and scale per axis and each
+/// vertex stores 16-bit offsets relative to the cluster origin, so the storage
+/// is 6 bytes per vertex(plus a small per-cluster header) instead of
+/// 12(float) or 24(double) bytes.
+/// Meshes with spatially coherent vertex order(e.g. photogrammetry or
+/// scanned meshes) keep most of their precision.
+///
+/// Decoded positions are what the BVH is built over and what the intersector
+/// tests, so the result is watertight w.r.t. the decoded mesh.
+///
+template <typename T = float>
+class QuantizedVertices {
+ public:
+  QuantizedVertices() : num_vertices_(0), log2_cluster_size_(8) {}
+
+  /// Quantize `num_vertices` vertices(xyz, `vertex_stride_bytes` apart).
+  void Quantize(const T *vertices, size_t num_vertices,
+                size_t vertex_stride_bytes,
+                unsigned int log2_cluster_size = 8) {
+    num_vertices_ = num_vertices;
+    log2_cluster_size_ = log2_cluster_size;
+
+    const size_t cluster_size = size_t(1) << log2_cluster_size;
+    const size_t num_clusters = (num_vertices + cluster_size - 1) / cluster_size;
+
+    positions_.resize(3 * num_vertices);
+    clusters_.resize(6 * num_clusters);  // origin xyz + scale xyz
+
+    for (size_t c = 0; c < num_clusters; c++) {
+      const size_t begin = c * cluster_size;
+      const size_t end = std::min(begin + cluster_size, num_vertices);
+
+      real3<T> bmin(get_vertex_addr(vertices, begin, vertex_stride_bytes));
+      real3<T> bmax = bmin;
+      for (size_t i = begin + 1; i < end; i++) {
+        const T *p = get_vertex_addr(vertices, i, vertex_stride_bytes);
+        for (int k = 0; k < 3; k++) {
+          bmin[k] = std::min(bmin[k], p[k]);
+          bmax[k] = std::max(bmax[k], p[k]);
+        }
+      }
+
+      T inv_scale[3];
+      for (int k = 0; k < 3; k++) {
+        const T scale = (bmax[k] - bmin[k]) / static_cast<T>(65535.0);
+        clusters_[6 * c + k] = bmin[k];
+        clusters_[6 * c + 3 + k] = scale;
+        inv_scale[k] = (scale > static_cast<T>(0.0))
+                           ? static_cast<T>(1.0) / scale
+                           : static_cast<T>(0.0);
+      }
+
+      for (size_t i = begin; i < end; i++) {
+        const T *p = get_vertex_addr(vertices, i, vertex_stride_bytes);
+        for (int k = 0; k < 3; k++) {
+          T q = (p[k] - bmin[k]) * inv_scale[k] + static_cast<T>(0.5);
+          q = std::max(static_cast<T>(0.0), std::min(static_cast<T>(65535.0), q));
+          positions_[3 * i + k] = static_cast<unsigned short>(q);
+        }
+      }
+    }
+  }
+
+  /// Decode `idx`th vertex.
+  void GetVertex(size_t idx, real3<T> *p) const {
+    const T *cluster = &clusters_[6 * (idx >> log2_cluster_size_)];
+    const unsigned short *q = &positions_[3 * idx];
+    (*p)[0] = cluster[0] + static_cast<T>(q[0]) * cluster[3];
+    (*p)[1] = cluster[1] + static_cast<T>(q[1]) * cluster[4];
+    (*p)[2] = cluster[2] + static_cast<T>(q[2]) * cluster[5];
+  }
+
+  size_t GetNumVertices() const { return num_vertices_; }
+
+  unsigned int GetLog2ClusterSize() const { return log2_cluster_size_; }
+
+  /// Quantized positions(3 x 16bit per vertex).
+  const std::vector<unsigned short> &GetPositions() const {
+    return positions_;
+  }
+
+  /// Per cluster origin(xyz) and scale(xyz).
+  const std::vector<T> &GetClusters() const { return clusters_; }
+
+  /// Bytes used for vertex storage.
+  size_t MemoryBytes() const {
+    return positions_.capacity() * sizeof(unsigned short) +
+           clusters_.capacity() * sizeof(T);
+  }
+
+ private:
+  std::vector<unsigned short> positions_;
+  std::vector<T> clusters_;
+  size_t num_vertices_;
+  unsigned int log2_cluster_size_;
+};
+
+// Predefined SAH predicator for triangle with quantized vertices.
+template <typename T = float, typename I = unsigned int>
+class QuantizedTriangleSAHPred {
+ public:
+  QuantizedTriangleSAHPred(const QuantizedVertices<T> *vertices,
+                           const I *faces)
+      : axis_(0),
+        pos_(static_cast<T>(0.0)),
+        vertices_(vertices),
+        faces_(faces) {}
+
+  void Set(int axis, T pos) const {
+    axis_ = axis;
+    pos_ = pos;
+  }
+
+  bool operator()(unsigned int i) const {
+    int axis = axis_;
+    T pos = pos_;
+
+    real3<T> p0, p1, p2;
+    vertices_->GetVertex(faces_[3 * i + 0], &p0);
+    vertices_->GetVertex(faces_[3 * i + 1], &p1);
+    vertices_->GetVertex(faces_[3 * i + 2], &p2);
+
+    T center = p0[axis] + p1[axis] + p2[axis];
+
+    return (center < pos * static_cast<T>(3.0));
+  }
+
+ private:
+  mutable int axis_;
+  mutable T pos_;
+  const QuantizedVertices<T> *vertices_;
+  const I *faces_;
+};
+
+// Predefined Triangle mesh geometry with quantized vertices.
+template <typename T = float, typename I = unsigned int>
+class QuantizedTriangleMesh {
+ public:
+  QuantizedTriangleMesh(const QuantizedVertices<T> *vertices,
+                        const I *faces)
+      : vertices_(vertices), faces_(faces) {}
+
+  /// Compute bounding box for `prim_index`th triangle.
+  /// The box is enlarged by 1 ulp so that it stays conservative even when the
+  /// compiler evaluates the decode differently(e.g. FMA contraction) at the
+  /// intersector side.
+  void BoundingBox(real3<T> *bmin, real3<T> *bmax,
+                   unsigned int prim_index) const {
+    real3<T> p;
+    vertices_->GetVertex(faces_[3 * prim_index + 0], &p);
+    (*bmin) = p;
+    (*bmax) = p;
+
+    // remaining two vertices of the primitive
+    for (unsigned int i = 1; i < 3; i++) {
+      vertices_->GetVertex(faces_[3 * prim_index + i], &p);
+      for (int k = 0; k < 3; k++) {
+        (*bmin)[k] = std::min((*bmin)[k], p[k]);
+        (*bmax)[k] = std::max((*bmax)[k], p[k]);
+      }
+    }
+
+    for (int k = 0; k < 3; k++) {
+      (*bmin)[k] -= std::fabs((*bmin)[k]) * std::numeric_limits<T>::epsilon();
+      (*bmax)[k] += std::fabs((*bmax)[k]) * std::numeric_limits<T>::epsilon();
+    }
+  }
+
+  const QuantizedVertices<T> *vertices_;
+  const I *faces_;
+
+  //
+  // Accessors
+  //
+  const QuantizedVertices<T> *GetVertices() const { return vertices_; }
+
+  const I *GetFaces() const { return faces_; }
+};
+
+///
+/// Stores intersection point information for triangle geometry.
+///
+template <typename T = float>
+class TriangleIntersection {
+ public:
+  T u;
+  T v;
+
+  // Required member variables.
+  T t;
+  unsigned int prim_id;
+};
+
+///
+/// Ray coefficients for Watertight Ray/Triangle Intersection.
+///
+template <typename T = float>
+struct TriangleRayCoeff {
+  T Sx;
+  T Sy;
+  T Sz;
+  int kx;
+  int ky;
+  int kz;
+};
+
+///
+/// Compute shear constants of Watertight Ray/Triangle Intersection for `ray`.
+///
+template <typename T>
+inline void ComputeTriangleRayCoeff(const Ray<T> &ray,
+                                    TriangleRayCoeff<T> *coeff) {
+  // Calculate dimension where the ray direction is maximal.
+  coeff->kz = 0;
+  T absDir = std::fabs(ray.dir[0]);
+  if (absDir < std::fabs(ray.dir[1])) {
+    coeff->kz = 1;
+    absDir = std::fabs(ray.dir[1]);
+  }
+  if (absDir < std::fabs(ray.dir[2])) {
+    coeff->kz = 2;
+    absDir = std::fabs(ray.dir[2]);
+  }
+
+  coeff->kx = coeff->kz + 1;
+  if (coeff->kx == 3) coeff->kx = 0;
+  coeff->ky = coeff->kx + 1;
+  if (coeff->ky == 3) coeff->ky = 0;
+
+  // Swap kx and ky dimension to preserve winding direction of triangles.
+  if (ray.dir[coeff->kz] < static_cast<T>(0.0)) std::swap(coeff->kx, coeff->ky);
+
+  // Calculate shear constants.
+  coeff->Sx = ray.dir[coeff->kx] / ray.dir[coeff->kz];
+  coeff->Sy = ray.dir[coeff->ky] / ray.dir[coeff->kz];
+  coeff->Sz = static_cast<T>(1.0) / ray.dir[coeff->kz];
+}
+
+///
+/// Returns false if `prim_index` th primitive is excluded by the trace
+/// options enabled in `Features`(`TriangleIntersectorFeature`).
+///
+template <unsigned int Features>
+inline bool IsTrianglePrimitiveEnabled(const BVHTraceOptions &options,
+                                       const unsigned int prim_index) {
+  if ((Features & TRIANGLE_FEATURE_PRIM_IDS_RANGE) &&
+      ((prim_index < options.prim_ids_range[0]) ||
+       (prim_index >= options.prim_ids_range[1]))) {
+    return false;
+  }
+
+  // Self-intersection test.
+  if ((Features & TRIANGLE_FEATURE_SKIP_PRIM_ID) &&
+      (prim_index == options.skip_prim_id)) {
+    return false;
+  }
+
+  return true;
+}
+
+///
+/// Returns `options.cull_back_face` if back face culling is enabled in
+/// `Features`, otherwise false.
+///
+template <unsigned int Features>
+inline bool IsTriangleBackFaceCulled(const BVHTraceOptions &options) {
+  return (Features & TRIANGLE_FEATURE_CULL_BACK_FACE) ? options.cull_back_face
+                                                      : false;
+}
+
+///
+/// Watertight Ray/Triangle Intersection: http://jcgt.org/published/0002/01/05/
+///
+/// Same as `IntersectTriangleWatertight`, but takes triangle vertices relative
+/// to the ray origin(`A` = p0 - ray_org, ...), so that they can be shared by
+/// rays with the same origin.
+///
+template <typename T>
+inline bool IntersectTriangleWatertightRelative(
+    T *t_inout, T *u_out, T *v_out, const real3<T> &A, const real3<T> &B,
+    const real3<T> &C, const TriangleRayCoeff<T> &coeff, T t_min,
+    bool cull_back_face) {
+  const T Ax = A[coeff.kx] - coeff.Sx * A[coeff.kz];
+  const T Ay = A[coeff.ky] - coeff.Sy * A[coeff.kz];
+  const T Bx = B[coeff.kx] - coeff.Sx * B[coeff.kz];
+  const T By = B[coeff.ky] - coeff.Sy * B[coeff.kz];
+  const T Cx = C[coeff.kx] - coeff.Sx * C[coeff.kz];
+  const T Cy = C[coeff.ky] - coeff.Sy * C[coeff.kz];
+
+  T U = Cx * By - Cy * Bx;
+  T V = Ax * Cy - Ay * Cx;
+  T W = Bx * Ay - By * Ax;
+
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wfloat-equal"
+#endif
+
+  // Fall back to test against edges using double precision.
+  if (U == static_cast<T>(0.0) || V == static_cast<T>(0.0) ||
+      W == static_cast<T>(0.0)) {
+    double CxBy = static_cast<double>(Cx) * static_cast<double>(By);
+    double CyBx = static_cast<double>(Cy) * static_cast<double>(Bx);
+    U = static_cast<T>(CxBy - CyBx);
+
+    double AxCy = static_cast<double>(Ax) * static_cast<double>(Cy);
+    double AyCx = static_cast<double>(Ay) * static_cast<double>(Cx);
+    V = static_cast<T>(AxCy - AyCx);
+
+    double BxAy = static_cast<double>(Bx) * static_cast<double>(Ay);
+    double ByAx = static_cast<double>(By) * static_cast<double>(Ax);
+    W = static_cast<T>(BxAy - ByAx);
+  }
+
+  if (U < static_cast<T>(0.0) || V < static_cast<T>(0.0) ||
+      W < static_cast<T>(0.0)) {
+    if (cull_back_face ||
+        (U > static_cast<T>(0.0) || V > static_cast<T>(0.0) ||
+         W > static_cast<T>(0.0))) {
+      return false;
+    }
+  }
+
+  T det = U + V + W;
+  if (det == static_cast<T>(0.0)) return false;
+
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif
+
+  const T Az = coeff.Sz * A[coeff.kz];
+  const T Bz = coeff.Sz * B[coeff.kz];
+  const T Cz = coeff.Sz * C[coeff.kz];
+  const T D = U * Az + V * Bz + W * Cz;
+
+  const T rcpDet = static_cast<T>(1.0) / det;
+  T tt = D * rcpDet;
+
+  if (tt > (*t_inout)) {
+    return false;
+  }
+
+  if (tt < t_min) {
+    return false;
+  }
+
+  (*t_inout) = tt;
+  // Use Möller-Trumbore style barycentric coordinates
+  // U + V + W = 1.0 and interp(p) = U * p0 + V * p1 + W * p2
+  // We want interp(p) = (1 - u - v) * p0 + u * v1 + v * p2;
+  // => u = V, v = W.
+  (*u_out) = V * rcpDet;
+  (*v_out) = W * rcpDet;
+
+  return true;
+}
+
+///
+/// Tests triangle(`p0`, `p1`, `p2`) against the ray(`ray_org` and `coeff`).
+/// Returns true and updates `t_inout`, `u_out` and `v_out` when hit distance is
+/// in [`t_min`, `*t_inout`].
+///
+template <typename T>
+inline bool IntersectTriangleWatertight(T *t_inout, T *u_out, T *v_out,
+                                        const real3<T> &p0, const real3<T> &p1,
+                                        const real3<T> &p2,
+                                        const real3<T> &ray_org,
+                                        const TriangleRayCoeff<T> &coeff,
+                                        T t_min, bool cull_back_face) {
+  return IntersectTriangleWatertightRelative(
+      t_inout, u_out, v_out, p0 - ray_org, p1 - ray_org, p2 - ray_org, coeff,
+      t_min, cull_back_face);
+}
+
+///
+/// Up to `kNANORT_LEAF_SIMD_WIDTH` triangles gathered in SoA layout for
+/// `IntersectTriangleLanesWatertight`. Vertices are relative to the ray
+/// origin and their components are permuted to (kx, ky, kz) of the ray.
+///
+template <typename T>
+struct TriangleLanes {
+  T ax[kNANORT_LEAF_SIMD_WIDTH];
+  T ay[kNANORT_LEAF_SIMD_WIDTH];
+  T az[kNANORT_LEAF_SIMD_WIDTH];
+  T bx[kNANORT_LEAF_SIMD_WIDTH];
+  T by[kNANORT_LEAF_SIMD_WIDTH];
+  T bz[kNANORT_LEAF_SIMD_WIDTH];
+  T cx[kNANORT_LEAF_SIMD_WIDTH];
+  T cy[kNANORT_LEAF_SIMD_WIDTH];
+  T cz[kNANORT_LEAF_SIMD_WIDTH];
+  unsigned int enabled_mask;  // bit `i` = `i`th lane is valid
+};
+
+///
+/// Watertight test of the triangles in `lanes` at once. Same result as
+/// testing them one by one with `IntersectTriangleWatertight`: returns the
+/// lane of the nearest hit in [`t_min`, `*t_inout`](the last one on ties)
+/// and updates `t_inout`, `u_out` and `v_out`, or returns -1.
+///
+template <typename T>
+inline int IntersectTriangleLanesWatertight(const TriangleLanes<T> &lanes,
+                                            const TriangleRayCoeff<T> &coeff,
+                                            T t_min, bool cull_back_face,
+                                            T *t_inout, T *u_out, T *v_out) {
+  // Components are already permuted.
+  TriangleRayCoeff<T> lane_coeff = coeff;
+  lane_coeff.kx = 0;
+  lane_coeff.ky = 1;
+  lane_coeff.kz = 2;
+
+  int hit_lane = -1;
+  for (int i = 0; i < kNANORT_LEAF_SIMD_WIDTH; i++) {
+    if (!(lanes.enabled_mask & (1u << i))) {
+      continue;
+    }
+    const real3<T> A(lanes.ax[i], lanes.ay[i], lanes.az[i]);
+    const real3<T> B(lanes.bx[i], lanes.by[i], lanes.bz[i]);
+    const real3<T> C(lanes.cx[i], lanes.cy[i], lanes.cz[i]);
+    if (IntersectTriangleWatertightRelative(t_inout, u_out, v_out, A, B, C,
+                                            lane_coeff, t_min,
+                                            cull_back_face)) {
+      hit_lane = i;
+    }
+  }
+  return hit_lane;
+}
+
+#if defined(NANORT_SIMD_AVX) || defined(NANORT_SIMD_SSE)
+
+///
+/// Recompute edge functions of the lanes in `zero_mask` in double precision
+/// (same as the fallback of `IntersectTriangleWatertightRelative`).
+///
+inline void FixZeroEdgeLanes(unsigned int zero_mask, const float *Ax,
+                             const float *Ay, const float *Bx, const float *By,
+                             const float *Cx, const float *Cy, float *U,
+                             float *V, float *W) {
+  for (int i = 0; i < kNANORT_LEAF_SIMD_WIDTH; i++) {
+    if (!(zero_mask & (1u << i))) {
+      continue;
+    }
+    double CxBy = static_cast<double>(Cx[i]) * static_cast<double>(By[i]);
+    double CyBx = static_cast<double>(Cy[i]) * static_cast<double>(Bx[i]);
+    U[i] = static_cast<float>(CxBy - CyBx);
+
+    double AxCy = static_cast<double>(Ax[i]) * static_cast<double>(Cy[i]);
+    double AyCx = static_cast<double>(Ay[i]) * static_cast<double>(Cx[i]);
+    V[i] = static_cast<float>(AxCy - AyCx);
+
+    double BxAy = static_cast<double>(Bx[i]) * static_cast<double>(Ay[i]);
+    double ByAx = static_cast<double>(By[i]) * static_cast<double>(Ax[i]);
+    W[i] = static_cast<float>(BxAy - ByAx);
+  }
+}
+
+#if defined(NANORT_SIMD_AVX)
+typedef __m256 LeafSIMDFloat;
+#define kNANORT_LEAF_SIMD_LANES (8)
+#define NANORT_SIMD_LOAD(p) _mm256_loadu_ps(p)
+#define NANORT_SIMD_STORE(p, a) _mm256_storeu_ps(p, a)
+#define NANORT_SIMD_SET1(x) _mm256_set1_ps(x)
+#define NANORT_SIMD_ADD(a, b) _mm256_add_ps(a, b)
+#define NANORT_SIMD_SUB(a, b) _mm256_sub_ps(a, b)
+#define NANORT_SIMD_MUL(a, b) _mm256_mul_ps(a, b)
+#define NANORT_SIMD_DIV(a, b) _mm256_div_ps(a, b)
+#define NANORT_SIMD_OR(a, b) _mm256_or_ps(a, b)
+#define NANORT_SIMD_CMPEQ(a, b) _mm256_cmp_ps(a, b, _CMP_EQ_OQ)
+#define NANORT_SIMD_CMPLT(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define NANORT_SIMD_CMPGT(a, b) _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#define NANORT_SIMD_MOVEMASK(a) static_cast<unsigned int>(_mm256_movemask_ps(a))
+#else
+typedef __m128 LeafSIMDFloat;
+#define kNANORT_LEAF_SIMD_LANES (4)
+#define NANORT_SIMD_LOAD(p) _mm_loadu_ps(p)
+#define NANORT_SIMD_STORE(p, a) _mm_storeu_ps(p, a)
+#define NANORT_SIMD_SET1(x) _mm_set1_ps(x)
+#define NANORT_SIMD_ADD(a, b) _mm_add_ps(a, b)
+#define NANORT_SIMD_SUB(a, b) _mm_sub_ps(a, b)
+#define NANORT_SIMD_MUL(a, b) _mm_mul_ps(a, b)
+#define NANORT_SIMD_DIV(a, b) _mm_div_ps(a, b)
+#define NANORT_SIMD_OR(a, b) _mm_or_ps(a, b)
+#define NANORT_SIMD_CMPEQ(a, b) _mm_cmpeq_ps(a, b)
+#define NANORT_SIMD_CMPLT(a, b) _mm_cmplt_ps(a, b)
+#define NANORT_SIMD_CMPGT(a, b) _mm_cmpgt_ps(a, b)
+#define NANORT_SIMD_MOVEMASK(a) static_cast<unsigned int>(_mm_movemask_ps(a))
+#endif
+
+///
+/// SIMD version for float(AVX: 8 lanes, SSE: 2 x 4 lanes).
+///
+inline int IntersectTriangleLanesWatertight(const TriangleLanes<float> &lanes,
+                                            const TriangleRayCoeff<float> &coeff,
+                                            float t_min, bool cull_back_face,
+                                            float *t_inout, float *u_out,
+                                            float *v_out) {
+  const int N = kNANORT_LEAF_SIMD_WIDTH;
+  const int L = kNANORT_LEAF_SIMD_LANES;
+
+  float Ax[N], Ay[N], Bx[N], By[N], Cx[N], Cy[N];
+  float U[N], V[N], W[N];
+
+  const LeafSIMDFloat Sx = NANORT_SIMD_SET1(coeff.Sx);
+  const LeafSIMDFloat Sy = NANORT_SIMD_SET1(coeff.Sy);
+  const LeafSIMDFloat Sz = NANORT_SIMD_SET1(coeff.Sz);
+  const LeafSIMDFloat zero = NANORT_SIMD_SET1(0.0f);
+
+  // Shear and edge functions.
+  unsigned int zero_mask = 0;
+  for (int j = 0; j < N; j += L) {
+    const LeafSIMDFloat az = NANORT_SIMD_LOAD(&lanes.az[j]);
+    const LeafSIMDFloat bz = NANORT_SIMD_LOAD(&lanes.bz[j]);
+    const LeafSIMDFloat cz = NANORT_SIMD_LOAD(&lanes.cz[j]);
+
+    const LeafSIMDFloat ax = NANORT_SIMD_SUB(NANORT_SIMD_LOAD(&lanes.ax[j]),
+                                             NANORT_SIMD_MUL(Sx, az));
+    const LeafSIMDFloat ay = NANORT_SIMD_SUB(NANORT_SIMD_LOAD(&lanes.ay[j]),
+                                             NANORT_SIMD_MUL(Sy, az));
+    const LeafSIMDFloat bx = NANORT_SIMD_SUB(NANORT_SIMD_LOAD(&lanes.bx[j]),
+                                             NANORT_SIMD_MUL(Sx, bz));
+    const LeafSIMDFloat by = NANORT_SIMD_SUB(NANORT_SIMD_LOAD(&lanes.by[j]),
+                                             NANORT_SIMD_MUL(Sy, bz));
+    const LeafSIMDFloat cx = NANORT_SIMD_SUB(NANORT_SIMD_LOAD(&lanes.cx[j]),
+                                             NANORT_SIMD_MUL(Sx, cz));
+    const LeafSIMDFloat cy = NANORT_SIMD_SUB(NANORT_SIMD_LOAD(&lanes.cy[j]),
+                                             NANORT_SIMD_MUL(Sy, cz));
+
+    const LeafSIMDFloat u = NANORT_SIMD_SUB(NANORT_SIMD_MUL(cx, by),
+                                            NANORT_SIMD_MUL(cy, bx));
+    const LeafSIMDFloat v = NANORT_SIMD_SUB(NANORT_SIMD_MUL(ax, cy),
+                                            NANORT_SIMD_MUL(ay, cx));
+    const LeafSIMDFloat w = NANORT_SIMD_SUB(NANORT_SIMD_MUL(bx, ay),
+                                            NANORT_SIMD_MUL(by, ax));
+
+    NANORT_SIMD_STORE(&Ax[j], ax);
+    NANORT_SIMD_STORE(&Ay[j], ay);
+    NANORT_SIMD_STORE(&Bx[j], bx);
+    NANORT_SIMD_STORE(&By[j], by);
+    NANORT_SIMD_STORE(&Cx[j], cx);
+    NANORT_SIMD_STORE(&Cy[j], cy);
+    NANORT_SIMD_STORE(&U[j], u);
+    NANORT_SIMD_STORE(&V[j], v);
+    NANORT_SIMD_STORE(&W[j], w);
+
+    zero_mask |= NANORT_SIMD_MOVEMASK(NANORT_SIMD_OR(
+                     NANORT_SIMD_OR(NANORT_SIMD_CMPEQ(u, zero),
+                                    NANORT_SIMD_CMPEQ(v, zero)),
+                     NANORT_SIMD_CMPEQ(w, zero)))
+                 << j;
+  }
+
+  // Fall back to test against edges using double precision.
+  zero_mask &= lanes.enabled_mask;
+  if (zero_mask) {
+    FixZeroEdgeLanes(zero_mask, Ax, Ay, Bx, By, Cx, Cy, U, V, W);
+  }
+
+  float t[N], rcp_det[N];
+  unsigned int valid_mask = 0;
+  for (int j = 0; j < N; j += L) {
+    const LeafSIMDFloat u = NANORT_SIMD_LOAD(&U[j]);
+    const LeafSIMDFloat v = NANORT_SIMD_LOAD(&V[j]);
+    const LeafSIMDFloat w = NANORT_SIMD_LOAD(&W[j]);
+
+    const unsigned int neg = NANORT_SIMD_MOVEMASK(
+        NANORT_SIMD_OR(NANORT_SIMD_OR(NANORT_SIMD_CMPLT(u, zero),
+                                      NANORT_SIMD_CMPLT(v, zero)),
+                       NANORT_SIMD_CMPLT(w, zero)));
+    const unsigned int pos = NANORT_SIMD_MOVEMASK(
+        NANORT_SIMD_OR(NANORT_SIMD_OR(NANORT_SIMD_CMPGT(u, zero),
+                                      NANORT_SIMD_CMPGT(v, zero)),
+                       NANORT_SIMD_CMPGT(w, zero)));
+
+    const LeafSIMDFloat det = NANORT_SIMD_ADD(NANORT_SIMD_ADD(u, v), w);
+    const unsigned int det_zero =
+        NANORT_SIMD_MOVEMASK(NANORT_SIMD_CMPEQ(det, zero));
+
+    const LeafSIMDFloat az =
+        NANORT_SIMD_MUL(Sz, NANORT_SIMD_LOAD(&lanes.az[j]));
+    const LeafSIMDFloat bz =
+        NANORT_SIMD_MUL(Sz, NANORT_SIMD_LOAD(&lanes.bz[j]));
+    const LeafSIMDFloat cz =
+        NANORT_SIMD_MUL(Sz, NANORT_SIMD_LOAD(&lanes.cz[j]));
+    const LeafSIMDFloat d = NANORT_SIMD_ADD(
+        NANORT_SIMD_ADD(NANORT_SIMD_MUL(u, az), NANORT_SIMD_MUL(v, bz)),
+        NANORT_SIMD_MUL(w, cz));
+
+    const LeafSIMDFloat rcp =
+        NANORT_SIMD_DIV(NANORT_SIMD_SET1(1.0f), det);
+    const LeafSIMDFloat tt = NANORT_SIMD_MUL(d, rcp);
+
+    // `tt > *t_inout` or `tt < t_min` is a miss(NaN is not).
+    const unsigned int out_of_range = NANORT_SIMD_MOVEMASK(NANORT_SIMD_OR(
+        NANORT_SIMD_CMPGT(tt, NANORT_SIMD_SET1(*t_inout)),
+        NANORT_SIMD_CMPLT(tt, NANORT_SIMD_SET1(t_min))));
+
+    const unsigned int reject =
+        (neg & (cull_back_face ? 0xffu : pos)) | det_zero | out_of_range;
+
+    valid_mask |= ((~reject) & ((1u << L) - 1u)) << j;
+
+    NANORT_SIMD_STORE(&t[j], tt);
+    NANORT_SIMD_STORE(&rcp_det[j], rcp);
+  }
+
+  valid_mask &= lanes.enabled_mask;
+  if (!valid_mask) {
+    return -1;
+  }
+
+  // Nearest hit. The last one wins on ties as in the sequential test.
+  int hit_lane = -1;
+  float hit_t = *t_inout;
+  for (int i = 0; i < N; i++) {
+    if ((valid_mask & (1u << i)) && !(t[i] > hit_t)) {
+      hit_t = t[i];
+      hit_lane = i;
+    }
+  }
+
+  (*t_inout) = hit_t;
+  (*u_out) = V[hit_lane] * rcp_det[hit_lane];
+  (*v_out) = W[hit_lane] * rcp_det[hit_lane];
+
+  return hit_lane;
+}
+
+#undef NANORT_SIMD_LOAD
+#undef NANORT_SIMD_STORE
+#undef NANORT_SIMD_SET1
+#undef NANORT_SIMD_ADD
+#undef NANORT_SIMD_SUB
+#undef NANORT_SIMD_MUL
+#undef NANORT_SIMD_DIV
+#undef NANORT_SIMD_OR
+#undef NANORT_SIMD_CMPEQ
+#undef NANORT_SIMD_CMPLT
+#undef NANORT_SIMD_CMPGT
+#undef NANORT_SIMD_MOVEMASK
+
+#endif  // NANORT_SIMD_AVX || NANORT_SIMD_SSE
+
+///
+/// Per-ray state of `TriangleIntersector`.
+/// Allocate one for each ray(e.g. on the stack) and pass it to
+/// `BVHAccel::Traverse` so that one intersector can be shared by threads.
+///
+template <typename T = float>
+class TriangleTraceContext {
+ public:
+  TriangleTraceContext()
+      : ray_org(static_cast<T>(0.0)),
+        t_min(static_cast<T>(0.0)),
+        t(static_cast<T>(0.0)),
+        u(static_cast<T>(0.0)),
+        v(static_cast<T>(0.0)),
+        prim_id(static_cast<unsigned int>(-1)),
+        candidate_u(static_cast<T>(0.0)),
+        candidate_v(static_cast<T>(0.0)) {
+    ray_coeff.Sx = ray_coeff.Sy = ray_coeff.Sz = static_cast<T>(0.0);
+    ray_coeff.kx = 0;
+    ray_coeff.ky = 1;
+    ray_coeff.kz = 2;
+  }
+
+  real3<T> ray_org;
+  TriangleRayCoeff<T> ray_coeff;
+  BVHTraceOptions trace_options;
+  T t_min;
+
+  // Nearest hit found so far.
+  T t;
+  T u;
+  T v;
+  unsigned int prim_id;
+
+  // Barycentric coordinate of the last successful `Intersect` call.
+  T candidate_u;
+  T candidate_v;
+};
+
+///
+/// Intersector is a template class which implements intersection method and stores
+/// intesection point information(`H`)
+///
+/// @tparam T Precision(float or double)
+/// @tparam H Intersection point information struct
+/// @tparam I Vertex index type(e.g. `unsigned short` for 16bit index buffers)
+/// @tparam Features Enabled optional checks(`TriangleIntersectorFeature`)
+///
+template <typename T = float, class H = TriangleIntersection<T>,
+          typename I = unsigned int,
+          unsigned int Features = TRIANGLE_FEATURE_ALL>
+class TriangleIntersector {
+ public:
+
+  // Initialize from mesh object.
+  // M: mesh class
+  template<class M>
+  TriangleIntersector(const M &m)
+      : vertices_(m.GetVertices()),
+        faces_(m.GetFaces()),
+        vertex_stride_bytes_(m.GetVertexStrideBytes()) {}
+
+  template<class M>
+  TriangleIntersector(const M *m)
+      : vertices_(m->GetVertices()),
+        faces_(m->GetFaces()),
+        vertex_stride_bytes_(m->GetVertexStrideBytes()) {}
+
+  TriangleIntersector(const T *vertices, const I *faces,
+                      const size_t vertex_stride_bytes)  // e.g.
+                                                         // vertex_stride_bytes
+                                                         // = 12 = sizeof(float)
+                                                         // * 3
+      : vertices_(vertices),
+        faces_(faces),
+        vertex_stride_bytes_(vertex_stride_bytes) {}
+
+  // For Watertight Ray/Triangle Intersection.
+  typedef TriangleRayCoeff<T> RayCoeff;
+
+  typedef T real_type;
+
+  // Per-ray state. See `TriangleTraceContext`.
+  typedef TriangleTraceContext<T> TraceContext;
+
+  /// Do ray intersection stuff for `prim_index` th primitive and return hit
+  /// distance `t`, barycentric coordinate `u` and `v`.
+  /// Returns true if there's intersection.
+  bool Intersect(T *t_inout, const unsigned int prim_index) const {
+    return Intersect(&ctx_, t_inout, prim_index);
+  }
+
+  /// Returns the nearest hit distance.
+  T GetT() const { return GetT(ctx_); }
+
+  /// Barycentric coordinate of the last successful `Intersect` call which is
+  /// not yet committed by `Update`(e.g. for alpha test in an intersection
+  /// filter).
+  void GetCandidateUV(T *u, T *v) const { GetCandidateUV(ctx_, u, v); }
+
+  /// Test `num_prims`(<= `kNANORT_LEAF_SIMD_WIDTH`) primitives at once(SIMD
+  /// for float). Returns the index in `prim_indices` of the nearest hit
+  /// (as `Intersect` for each primitive in order), or -1.
+  int IntersectLeaf(T *t_inout, const unsigned int *prim_indices,
+                    unsigned int num_prims) const {
+    return IntersectLeaf(&ctx_, t_inout, prim_indices, num_prims);
+  }
+
+  /// Update is called when initializing intersection and nearest hit is found.
+  void Update(T t, unsigned int prim_idx) const { Update(&ctx_, t, prim_idx); }
+
+  /// Prepare BVH traversal (e.g. compute inverse ray direction)
+  /// This function is called only once in BVH traversal.
+  void PrepareTraversal(const Ray<T> &ray,
+                        const BVHTraceOptions &trace_options) const {
+    PrepareTraversal(&ctx_, ray, trace_options);
+  }
+
+  /// Post BVH traversal stuff.
+  /// Fill `isect` if there is a hit.
+  void PostTraversal(const Ray<T> &ray, bool hit, H *isect) const {
+    PostTraversal(ctx_, ray, hit, isect);
+  }
+
+  //
+  // Trace context versions of the above.
+  // These do not modify the intersector, so an intersector can be shared by
+  // threads as long as each ray uses its own `TraceContext`.
+  //
+
+  /// Test `prim_index` th primitive. Barycentric coordinate of the hit is
+  /// staged in `ctx` and committed by `Update`.
+  bool Intersect(TraceContext *ctx, T *t_inout,
+                 const unsigned int prim_index) const {
+    if (!IsTrianglePrimitiveEnabled<Features>(ctx->trace_options,
+                                              prim_index)) {
+      return false;
+    }
+
+    const unsigned int f0 = faces_[3 * prim_index + 0];
+    const unsigned int f1 = faces_[3 * prim_index + 1];
+    const unsigned int f2 = faces_[3 * prim_index + 2];
+
+    const real3<T> p0(get_vertex_addr(vertices_, f0 + 0, vertex_stride_bytes_));
+    const real3<T> p1(get_vertex_addr(vertices_, f1 + 0, vertex_stride_bytes_));
+    const real3<T> p2(get_vertex_addr(vertices_, f2 + 0, vertex_stride_bytes_));
+
+    return IntersectTriangleWatertight(
+        t_inout, &ctx->candidate_u, &ctx->candidate_v, p0, p1, p2,
+        ctx->ray_org, ctx->ray_coeff, ctx->t_min,
+        IsTriangleBackFaceCulled<Features>(ctx->trace_options));
+  }
+
+  int IntersectLeaf(TraceContext *ctx, T *t_inout,
+                    const unsigned int *prim_indices,
+                    unsigned int num_prims) const {
+    const TriangleRayCoeff<T> &coeff = ctx->ray_coeff;
+
+    // Gather vertices relative to the ray origin in (kx, ky, kz) order.
+    TriangleLanes<T> lanes;
+    lanes.enabled_mask = 0;
+    for (unsigned int i = 0; i < unsigned(kNANORT_LEAF_SIMD_WIDTH); i++) {
+      real3<T> A(static_cast<T>(0.0)), B(static_cast<T>(0.0)),
+          C(static_cast<T>(0.0));
+      if ((i < num_prims) &&
+          IsTrianglePrimitiveEnabled<Features>(ctx->trace_options,
+                                               prim_indices[i])) {
+        const unsigned int prim_index = prim_indices[i];
+        A = real3<T>(get_vertex_addr(vertices_, faces_[3 * prim_index + 0],
+                                     vertex_stride_bytes_)) -
+            ctx->ray_org;
+        B = real3<T>(get_vertex_addr(vertices_, faces_[3 * prim_index + 1],
+                                     vertex_stride_bytes_)) -
+            ctx->ray_org;
+        C = real3<T>(get_vertex_addr(vertices_, faces_[3 * prim_index + 2],
+                                     vertex_stride_bytes_)) -
+            ctx->ray_org;
+        lanes.enabled_mask |= (1u << i);
+      }
+      lanes.ax[i] = A[coeff.kx];
+      lanes.ay[i] = A[coeff.ky];
+      lanes.az[i] = A[coeff.kz];
+      lanes.bx[i] = B[coeff.kx];
+      lanes.by[i] = B[coeff.ky];
+      lanes.bz[i] = B[coeff.kz];
+      lanes.cx[i] = C[coeff.kx];
+      lanes.cy[i] = C[coeff.ky];
+      lanes.cz[i] = C[coeff.kz];
+    }
+
+    if (!lanes.enabled_mask) {
+      return -1;
+    }
+
+    return IntersectTriangleLanesWatertight(
+        lanes, coeff, ctx->t_min,
+        IsTriangleBackFaceCulled<Features>(ctx->trace_options), t_inout,
+        &ctx->candidate_u, &ctx->candidate_v);
+  }
+
+  T GetT(const TraceContext &ctx) const { return ctx.t; }
+
+  void GetCandidateUV(const TraceContext &ctx, T *u, T *v) const {
+    (*u) = ctx.candidate_u;
+    (*v) = ctx.candidate_v;
+  }
+
+  void Update(TraceContext *ctx, T t, unsigned int prim_idx) const {
+    ctx->t = t;
+    ctx->u = ctx->candidate_u;
+    ctx->v = ctx->candidate_v;
+    ctx->prim_id = prim_idx;
+  }
+
+  void PrepareTraversal(TraceContext *ctx, const Ray<T> &ray,
+                        const BVHTraceOptions &trace_options) const {
+    ctx->ray_org[0] = ray.org[0];
+    ctx->ray_org[1] = ray.org[1];
+    ctx->ray_org[2] = ray.org[2];
+
+    ComputeTriangleRayCoeff(ray, &ctx->ray_coeff);
+
+    ctx->trace_options = trace_options;
+
+    ctx->t_min = ray.min_t;
+
+    ctx->u = static_cast<T>(0.0);
+    ctx->v = static_cast<T>(0.0);
+    ctx->candidate_u = static_cast<T>(0.0);
+    ctx->candidate_v = static_cast<T>(0.0);
+  }
+
+  void PostTraversal(const TraceContext &ctx, const Ray<T> &ray, bool hit,
+                     H *isect) const {
+    if (hit && isect) {
+      (*isect).t = ctx.t;
+      (*isect).u = ctx.u;
+      (*isect).v = ctx.v;
+      (*isect).prim_id = ctx.prim_id;
+    }
+    (void)ray;
+  }
+
+ private:
+  const T *vertices_;
+  const I *faces_;
+  const size_t vertex_stride_bytes_;
+
+  // Used by the context-less interface.
+  mutable TraceContext ctx_;
+};
+
+template <typename T, class H, typename I, unsigned int Features>
+class IntersectorFeatureTraits<TriangleIntersector<T, H, I, Features> > {
+ public:
+  enum { kFeatures = Features };
+};
+
+///
+/// @brief Adapter which binds intersector `I` to trace context `ctx`.
+///
+/// Exposes the intersector interface used by BVH traversal while keeping all
+/// per-ray state in `ctx`. See `BVHAccel::Traverse(ray, intersector, ctx,
+/// isect, options)`.
+///
+template <class I>
+class ContextIntersector {
+ public:
+  typedef typename I::real_type real_type;
+  typedef typename I::TraceContext TraceContext;
+
+  ContextIntersector(const I &intersector, TraceContext *ctx)
+      : intersector_(intersector), ctx_(ctx) {}
+
+  bool Intersect(real_type *t_inout, const unsigned int prim_index) const {
+    return intersector_.Intersect(ctx_, t_inout, prim_index);
+  }
+
+  real_type GetT() const { return intersector_.GetT(*ctx_); }
+
+  void GetCandidateUV(real_type *u, real_type *v) const {
+    intersector_.GetCandidateUV(*ctx_, u, v);
+  }
+
+  int IntersectLeaf(real_type *t_inout, const unsigned int *prim_indices,
+                    unsigned int num_prims) const {
+    return intersector_.IntersectLeaf(ctx_, t_inout, prim_indices, num_prims);
+  }
+
+  void Update(real_type t, unsigned int prim_idx) const {
+    intersector_.Update(ctx_, t, prim_idx);
+  }
+
+  void PrepareTraversal(const Ray<real_type> &ray,
+                        const BVHTraceOptions &trace_options) const {
+    intersector_.PrepareTraversal(ctx_, ray, trace_options);
+  }
+
+  template <class H>
+  void PostTraversal(const Ray<real_type> &ray, bool hit, H *isect) const {
+    intersector_.PostTraversal(*ctx_, ray, hit, isect);
+  }
+
+ private:
+  const I &intersector_;
+  TraceContext *ctx_;
+};
+
+#if defined(NANORT_SIMD_AVX) || defined(NANORT_SIMD_SSE)
+template <class H, typename I, unsigned int Features>
+class LeafIntersectorTraits<TriangleIntersector<float, H, I, Features> > {
+ public:
+  typedef SIMDLeafTest Test;
+};
+#endif
+
+template <class I>
+class LeafIntersectorTraits<ContextIntersector<I> > {
+ public:
+  typedef typename LeafIntersectorTraits<I>::Test Test;
+};
+
+template <class I>
+class IntersectorFeatureTraits<ContextIntersector<I> > {
+ public:
+  enum { kFeatures = IntersectorFeatureTraits<I>::kFeatures };
+};
+
+///
+/// Per-ray state of `TriangleBundleIntersector`.
+///
+template <typename T = float>
+class TriangleBundleRay {
+ public:
+  TriangleRayCoeff<T> ray_coeff;
+  T t_min;
+};
+
+///
+/// Per-leaf state of `TriangleBundleIntersector`: vertices of up to
+/// `kNANORT_BUNDLE_LEAF_SIZE` triangles relative to the bundle origin.
+///
+template <typename T = float>
+class TriangleBundleLeaf {
+ public:
+  real3<T> vertices[3 * kNANORT_BUNDLE_LEAF_SIZE];
+  unsigned int prim_ids[kNANORT_BUNDLE_LEAF_SIZE];
+  bool enabled[kNANORT_BUNDLE_LEAF_SIZE];
+  unsigned int num_prims;
+  bool cull_back_face;
+};
+
+///
+/// Triangle intersector for `BVHAccel::TraverseBundle`(rays which share the
+/// origin). Triangle vertices are translated to the bundle origin once per
+/// visited leaf and tested against all rays of the bundle.
+/// Has no per-ray state, so it can be shared by threads.
+///
+/// @tparam T Precision(float or double)
+/// @tparam H Intersection point information struct
+/// @tparam I Vertex index type(e.g. `unsigned short` for 16bit index buffers)
+/// @tparam Features Enabled optional checks(`TriangleIntersectorFeature`)
+///
+template <typename T = float, class H = TriangleIntersection<T>,
+          typename I = unsigned int,
+          unsigned int Features = TRIANGLE_FEATURE_ALL>
+class TriangleBundleIntersector {
+ public:
+  // Initialize from mesh object.
+  // M: mesh class
+  template <class M>
+  TriangleBundleIntersector(const M &m)
+      : vertices_(m.GetVertices()),
+        faces_(m.GetFaces()),
+        vertex_stride_bytes_(m.GetVertexStrideBytes()) {}
+
+  template <class M>
+  TriangleBundleIntersector(const M *m)
+      : vertices_(m->GetVertices()),
+        faces_(m->GetFaces()),
+        vertex_stride_bytes_(m->GetVertexStrideBytes()) {}
+
+  TriangleBundleIntersector(const T *vertices, const I *faces,
+                            const size_t vertex_stride_bytes)
+      : vertices_(vertices),
+        faces_(faces),
+        vertex_stride_bytes_(vertex_stride_bytes) {}
+
+  typedef T real_type;
+  typedef TriangleBundleRay<T> BundleRay;
+  typedef TriangleBundleLeaf<T> BundleLeaf;
+
+  /// Precompute per-ray data(shear transform of watertight intersection).
+  /// Called once for each ray of the bundle.
+  void PrepareBundleRay(BundleRay *bundle_ray, const Ray<T> &ray) const {
+    ComputeTriangleRayCoeff(ray, &bundle_ray->ray_coeff);
+    bundle_ray->t_min = ray.min_t;
+  }
+
+  /// Translate `num_prims`(<= `kNANORT_BUNDLE_LEAF_SIZE`) triangles to the
+  /// bundle origin `org`.
+  void PrepareBundleLeaf(BundleLeaf *leaf, const T org[3],
+                         const unsigned int *prim_ids, unsigned int num_prims,
+                         const BVHTraceOptions &trace_options) const {
+    const real3<T> ray_org(org);
+
+    leaf->num_prims = num_prims;
+    leaf->cull_back_face = IsTriangleBackFaceCulled<Features>(trace_options);
+
+    for (unsigned int i = 0; i < num_prims; i++) {
+      const unsigned int prim_index = prim_ids[i];
+      leaf->prim_ids[i] = prim_index;
+      leaf->enabled[i] =
+          IsTrianglePrimitiveEnabled<Features>(trace_options, prim_index);
+      if (!leaf->enabled[i]) {
+        continue;
+      }
+
+      for (int k = 0; k < 3; k++) {
+        const unsigned int f = faces_[3 * prim_index + k];
+        leaf->vertices[3 * i + k] =
+            real3<T>(get_vertex_addr(vertices_, f, vertex_stride_bytes_)) -
+            ray_org;
+      }
+    }
+  }
+
+  /// Test `i` th triangle of `leaf` against the ray. Fills `isect` and
+  /// updates `t_inout` if hit distance is in [`t_min`, `*t_inout`].
+  bool IntersectBundleLeaf(const BundleRay &bundle_ray, const BundleLeaf &leaf,
+                           unsigned int i, T *t_inout, H *isect) const {
+    if (!leaf.enabled[i]) {
+      return false;
+    }
+
+    T u, v;
+    if (!IntersectTriangleWatertightRelative(
+            t_inout, &u, &v, leaf.vertices[3 * i + 0],
+            leaf.vertices[3 * i + 1], leaf.vertices[3 * i + 2],
+            bundle_ray.ray_coeff, bundle_ray.t_min, leaf.cull_back_face)) {
+      return false;
+    }
+
+    (*isect).t = (*t_inout);
+    (*isect).u = u;
+    (*isect).v = v;
+    (*isect).prim_id = leaf.prim_ids[i];
+
+    return true;
+  }
+
+ private:
+  const T *vertices_;
+  const I *faces_;
+  const size_t vertex_stride_bytes_;
+};
+
+template <typename T, class H, typename I, unsigned int Features>
+class IntersectorFeatureTraits<TriangleBundleIntersector<T, H, I, Features> > {
+ public:
+  enum { kFeatures = Features };
+};
+
+///
+/// Per-ray state of `MotionTriangleIntersector`: `TriangleTraceContext` and
+/// the ray time.
+///
+template <typename T = float>
+class MotionTriangleTraceContext : public TriangleTraceContext<T> {
+ public:
+  MotionTriangleTraceContext() : time(static_cast<T>(0.0)) {}
+
+  T time;  // clamped to [0, 1]
+};
+
+///
+/// Triangle intersector for linearly moving triangles(`MotionTriangleMesh`).
+/// Vertices are interpolated by `Ray::time` and tested with watertight
+/// intersection.
+///
+/// @tparam T Precision(float or double)
+/// @tparam H Intersection point information struct
+/// @tparam I Vertex index type(e.g. `unsigned short` for 16bit index buffers)
+/// @tparam Features Enabled optional checks(`TriangleIntersectorFeature`)
+///
+template <typename T = float, class H = TriangleIntersection<T>,
+          typename I = unsigned int,
+          unsigned int Features = TRIANGLE_FEATURE_ALL>
+class MotionTriangleIntersector {
+ public:
+  // Initialize from mesh object.
+  // M: mesh class
+  template <class M>
+  MotionTriangleIntersector(const M &m)
+      : vertices0_(m.GetVertices0()),
+        vertices1_(m.GetVertices1()),
+        faces_(m.GetFaces()),
+        vertex_stride_bytes_(m.GetVertexStrideBytes()) {}
+
+  template <class M>
+  MotionTriangleIntersector(const M *m)
+      : vertices0_(m->GetVertices0()),
+        vertices1_(m->GetVertices1()),
+        faces_(m->GetFaces()),
+        vertex_stride_bytes_(m->GetVertexStrideBytes()) {}
+
+  MotionTriangleIntersector(const T *vertices0, const T *vertices1,
+                            const I *faces, const size_t vertex_stride_bytes)
+      : vertices0_(vertices0),
+        vertices1_(vertices1),
+        faces_(faces),
+        vertex_stride_bytes_(vertex_stride_bytes) {}
+
+  typedef T real_type;
+
+  // Per-ray state. See `MotionTriangleTraceContext`.
+  typedef MotionTriangleTraceContext<T> TraceContext;
+
+  /// Do ray intersection stuff for `prim_index` th primitive and return hit
+  /// distance `t`, barycentric coordinate `u` and `v`.
+  /// Returns true if there's intersection.
+  bool Intersect(T *t_inout, const unsigned int prim_index) const {
+    return Intersect(&ctx_, t_inout, prim_index);
+  }
+
+  /// Returns the nearest hit distance.
+  T GetT() const { return GetT(ctx_); }
+
+  /// Barycentric coordinate of the last successful `Intersect` call which is
+  /// not yet committed by `Update`(e.g. for alpha test in an intersection
+  /// filter).
+  void GetCandidateUV(T *u, T *v) const { GetCandidateUV(ctx_, u, v); }
+
+  /// Update is called when initializing intersection and nearest hit is found.
+  void Update(T t, unsigned int prim_idx) const { Update(&ctx_, t, prim_idx); }
+
+  /// Prepare BVH traversal (e.g. compute inverse ray direction)
+  /// This function is called only once in BVH traversal.
+  void PrepareTraversal(const Ray<T> &ray,
+                        const BVHTraceOptions &trace_options) const {
+    PrepareTraversal(&ctx_, ray, trace_options);
+  }
+
+  /// Post BVH traversal stuff.
+  /// Fill `isect` if there is a hit.
+  void PostTraversal(const Ray<T> &ray, bool hit, H *isect) const {
+    PostTraversal(ctx_, ray, hit, isect);
+  }
+
+  //
+  // Trace context versions of the above(see `TriangleIntersector`).
+  //
+
+  bool Intersect(TraceContext *ctx, T *t_inout,
+                 const unsigned int prim_index) const {
+    if (!IsTrianglePrimitiveEnabled<Features>(ctx->trace_options,
+                                              prim_index)) {
+      return false;
+    }
+
+    real3<T> p[3];
+    for (int k = 0; k < 3; k++) {
+      const unsigned int f = faces_[3 * prim_index + k];
+      const real3<T> p0(get_vertex_addr(vertices0_, f, vertex_stride_bytes_));
+      const real3<T> p1(get_vertex_addr(vertices1_, f, vertex_stride_bytes_));
+      p[k] = p0 * (static_cast<T>(1.0) - ctx->time) + p1 * ctx->time;
+    }
+
+    return IntersectTriangleWatertight(
+        t_inout, &ctx->candidate_u, &ctx->candidate_v, p[0], p[1], p[2],
+        ctx->ray_org, ctx->ray_coeff, ctx->t_min,
+        IsTriangleBackFaceCulled<Features>(ctx->trace_options));
+  }
+
+  T GetT(const TraceContext &ctx) const { return ctx.t; }
+
+  void GetCandidateUV(const TraceContext &ctx, T *u, T *v) const {
+    (*u) = ctx.candidate_u;
+    (*v) = ctx.candidate_v;
+  }
+
+  void Update(TraceContext *ctx, T t, unsigned int prim_idx) const {
+    ctx->t = t;
+    ctx->u = ctx->candidate_u;
+    ctx->v = ctx->candidate_v;
+    ctx->prim_id = prim_idx;
+  }
+
+  void PrepareTraversal(TraceContext *ctx, const Ray<T> &ray,
+                        const BVHTraceOptions &trace_options) const {
+    ctx->ray_org[0] = ray.org[0];
+    ctx->ray_org[1] = ray.org[1];
+    ctx->ray_org[2] = ray.org[2];
+
+    ComputeTriangleRayCoeff(ray, &ctx->ray_coeff);
+
+    ctx->trace_options = trace_options;
+
+    ctx->t_min = ray.min_t;
+    // Node bounds contain the triangles only in [0, 1].
+    ctx->time = std::min(std::max(ray.time, static_cast<T>(0.0)),
+                         static_cast<T>(1.0));
+
+    ctx->u = static_cast<T>(0.0);
+    ctx->v = static_cast<T>(0.0);
+    ctx->candidate_u = static_cast<T>(0.0);
+    ctx->candidate_v = static_cast<T>(0.0);
+  }
+
+  void PostTraversal(const TraceContext &ctx, const Ray<T> &ray, bool hit,
+                     H *isect) const {
+    if (hit && isect) {
+      (*isect).t = ctx.t;
+      (*isect).u = ctx.u;
+      (*isect).v = ctx.v;
+      (*isect).prim_id = ctx.prim_id;
+    }
+    (void)ray;
+  }
+
+ private:
+  const T *vertices0_;
+  const T *vertices1_;
+  const I *faces_;
+  const size_t vertex_stride_bytes_;
+
+  // Used by the context-less interface.
+  mutable TraceContext ctx_;
+};
+
+template <typename T, class H, typename I, unsigned int Features>
+class IntersectorFeatureTraits<MotionTriangleIntersector<T, H, I, Features> > {
+ public:
+  enum { kFeatures = Features };
+};
+
+///
+/// Triangle intersector for `QuantizedVertices`.
+/// Vertices are decoded on the fly and tested with watertight intersection.
+///
+/// @tparam T Precision(float or double)
+/// @tparam H Intersection point information struct
+/// @tparam I Vertex index type(e.g. `unsigned short` for 16bit index buffers)
+/// @tparam Features Enabled optional checks(`TriangleIntersectorFeature`)
+///
+template <typename T = float, class H = TriangleIntersection<T>,
+          typename I = unsigned int,
+          unsigned int Features = TRIANGLE_FEATURE_ALL>
+class QuantizedTriangleIntersector {
+ public:
+  // Initialize from mesh object.
+  // M: mesh class
+  template <class M>
+  QuantizedTriangleIntersector(const M &m)
+      : vertices_(m.GetVertices()), faces_(m.GetFaces()) {}
+
+  template <class M>
+  QuantizedTriangleIntersector(const M *m)
+      : vertices_(m->GetVertices()), faces_(m->GetFaces()) {}
+
+  QuantizedTriangleIntersector(const QuantizedVertices<T> *vertices,
+                               const I *faces)
+      : vertices_(vertices), faces_(faces) {}
+
+  /// Do ray intersection stuff for `prim_index` th primitive and return hit
+  /// distance `t`, barycentric coordinate `u` and `v`.
+  /// Returns true if there's intersection.
+  bool Intersect(T *t_inout, const unsigned int prim_index) const {
+    if (!IsTrianglePrimitiveEnabled<Features>(trace_options_, prim_index)) {
+      return false;
+    }
+
+    real3<T> p0, p1, p2;
+    vertices_->GetVertex(faces_[3 * prim_index + 0], &p0);
+    vertices_->GetVertex(faces_[3 * prim_index + 1], &p1);
+    vertices_->GetVertex(faces_[3 * prim_index + 2], &p2);
+
+    return IntersectTriangleWatertight(
+        t_inout, &u_, &v_, p0, p1, p2, ray_org_, ray_coeff_, t_min_,
+        IsTriangleBackFaceCulled<Features>(trace_options_));
+  }
+
+  /// Returns the nearest hit distance.
+  T GetT() const { return t_; }
+
+  /// Barycentric coordinate of the last candidate hit of `Intersect`(for an
+  /// intersection filter).
+  void GetCandidateUV(T *u, T *v) const {
+    (*u) = u_;
+    (*v) = v_;
+  }
+
+  /// Update is called when initializing intersection and nearest hit is found.
+  void Update(T t, unsigned int prim_idx) const {
+    t_ = t;
+    prim_id_ = prim_idx;
+    hit_u_ = u_;
+    hit_v_ = v_;
+  }
+
+  /// Prepare BVH traversal (e.g. compute inverse ray direction)
+  /// This function is called only once in BVH traversal.
+  void PrepareTraversal(const Ray<T> &ray,
+                        const BVHTraceOptions &trace_options) const {
+    ray_org_[0] = ray.org[0];
+    ray_org_[1] = ray.org[1];
+    ray_org_[2] = ray.org[2];
+
+    ComputeTriangleRayCoeff(ray, &ray_coeff_);
+
+    trace_options_ = trace_options;
+
+    t_min_ = ray.min_t;
+
+    u_ = static_cast<T>(0.0);
+    v_ = static_cast<T>(0.0);
+    hit_u_ = static_cast<T>(0.0);
+    hit_v_ = static_cast<T>(0.0);
+  }
+
+  /// Post BVH traversal stuff.
+  /// Fill `isect` if there is a hit.
+  void PostTraversal(const Ray<T> &ray, bool hit, H *isect) const {
+    if (hit && isect) {
+      (*isect).t = t_;
+      (*isect).u = hit_u_;
+      (*isect).v = hit_v_;
+      (*isect).prim_id = prim_id_;
+    }
+    (void)ray;
+  }
+
+ private:
+  const QuantizedVertices<T> *vertices_;
+  const I *faces_;
+
+  mutable real3<T> ray_org_;
+  mutable TriangleRayCoeff<T> ray_coeff_;
+  mutable BVHTraceOptions trace_options_;
+  mutable T t_min_;
+
+  mutable T t_;
+  mutable T u_;
+  mutable T v_;
+  mutable T hit_u_;
+  mutable T hit_v_;
+  mutable unsigned int prim_id_;
+};
+
+template <typename T, class H, typename I, unsigned int Features>
+class IntersectorFeatureTraits<QuantizedTriangleIntersector<T, H, I, Features> > {
+ public:
+  enum { kFeatures = Features };
+};
+
+///
+/// Triangle intersector for ray packet traversal(`BVHAccel::TraversePacket`).
+/// Keeps intersection state per lane.
+///
+/// @tparam T Precision(float or double)
+/// @tparam N The number of rays in a packet
+/// @tparam H Intersection point information struct
+/// @tparam I Vertex index type
+/// @tparam Features Enabled optional checks(`TriangleIntersectorFeature`)
+///
+template <typename T = float, int N = 8, class H = TriangleIntersection<T>,
+          typename I = unsigned int,
+          unsigned int Features = TRIANGLE_FEATURE_ALL>
+class TrianglePacketIntersector {
+ public:
+  enum { kPacketSize = N };
+
+  // Initialize from mesh object.
+  // M: mesh class
+  template <class M>
+  TrianglePacketIntersector(const M &m)
+      : vertices_(m.GetVertices()),
+        faces_(m.GetFaces()),
+        vertex_stride_bytes_(m.GetVertexStrideBytes()) {}
+
+  template <class M>
+  TrianglePacketIntersector(const M *m)
+      : vertices_(m->GetVertices()),
+        faces_(m->GetFaces()),
+        vertex_stride_bytes_(m->GetVertexStrideBytes()) {}
+
+  TrianglePacketIntersector(const T *vertices, const I *faces,
+                            const size_t vertex_stride_bytes)
+      : vertices_(vertices),
+        faces_(faces),
+        vertex_stride_bytes_(vertex_stride_bytes) {}
+
+  /// Intersect `prim_index` th primitive against the rays of `lane_mask`.
+  /// `t_inout[i]` is updated for the lanes which hit.
+  /// Returns the mask of the lanes which hit.
+  unsigned int IntersectPacket(T t_inout[N], const unsigned int prim_index,
+                               unsigned int lane_mask) const {
+    // Vertices are fetched once for all lanes.
+    real3<T> p0, p1, p2;
+    if (!GetTriangle(prim_index, &p0, &p1, &p2)) {
+      return 0;
+    }
+
+    unsigned int hit_mask = 0;
+    while (lane_mask) {
+      const int i = LowestBit(lane_mask);
+      lane_mask &= lane_mask - 1;
+
+      if (IntersectTriangleWatertight(
+              &t_inout[i], &u_[i], &v_[i], p0, p1, p2, ray_org_[i],
+              ray_coeff_[i], t_min_[i],
+              IsTriangleBackFaceCulled<Features>(trace_options_))) {
+        hit_mask |= (1u << i);
+      }
+    }
+
+    return hit_mask;
+  }
+
+  /// Single ray version of `IntersectPacket` for `lane`th ray.
+  /// Returns true if there's intersection.
+  bool Intersect(T *t_inout, const unsigned int prim_index, int lane) const {
+    real3<T> p0, p1, p2;
+    if (!GetTriangle(prim_index, &p0, &p1, &p2)) {
+      return false;
+    }
+
+    return IntersectTriangleWatertight(
+        t_inout, &u_[lane], &v_[lane], p0, p1, p2, ray_org_[lane],
+        ray_coeff_[lane], t_min_[lane],
+        IsTriangleBackFaceCulled<Features>(trace_options_));
+  }
+
+  /// Returns the nearest hit distance of `lane`th ray.
+  T GetT(int lane) const { return t_[lane]; }
+
+  /// Update is called when nearest hit is found for `lane`th ray.
+  void Update(T t, unsigned int prim_idx, int lane) const {
+    t_[lane] = t;
+    prim_id_[lane] = prim_idx;
+  }
+
+  /// Prepare BVH traversal and initialize all lanes as no hit.
+  /// This function is called only once in BVH traversal.
+  void PrepareTraversal(const RayPacket<T, N> &packet,
+                        const BVHTraceOptions &trace_options) const {
+    for (int i = 0; i < N; i++) {
+      ray_org_[i][0] = packet.org[0][i];
+      ray_org_[i][1] = packet.org[1][i];
+      ray_org_[i][2] = packet.org[2][i];
+
+      if (packet.active_mask & (1u << i)) {
+        ComputeTriangleRayCoeff(packet.GetRay(i), &ray_coeff_[i]);
+      }
+
+      t_min_[i] = packet.min_t[i];
+
+      t_[i] = packet.max_t[i];
+      u_[i] = static_cast<T>(0.0);
+      v_[i] = static_cast<T>(0.0);
+      prim_id_[i] = static_cast<unsigned int>(-1);
+    }
+
+    trace_options_ = trace_options;
+  }
+
+  /// Post BVH traversal stuff.
+  /// Fill `isects[i]` for each lane `i` in `hit_mask`.
+  void PostTraversal(const RayPacket<T, N> &packet, unsigned int hit_mask,
+                     H *isects) const {
+    if (isects) {
+      for (int i = 0; i < N; i++) {
+        if (hit_mask & (1u << i)) {
+          isects[i].t = t_[i];
+          isects[i].u = u_[i];
+          isects[i].v = v_[i];
+          isects[i].prim_id = prim_id_[i];
+        }
+      }
+    }
+    (void)packet;
+  }
+
+ private:
+  const T *vertices_;
+  const I *faces_;
+  const size_t vertex_stride_bytes_;
+
+  // Returns false if `prim_index` th primitive is excluded by trace options.
+  bool GetTriangle(const unsigned int prim_index, real3<T> *p0, real3<T> *p1,
+                   real3<T> *p2) const {
+    if (!IsTrianglePrimitiveEnabled<Features>(trace_options_, prim_index)) {
+      return false;
+    }
+
+    const unsigned int f0 = faces_[3 * prim_index + 0];
+    const unsigned int f1 = faces_[3 * prim_index + 1];
+    const unsigned int f2 = faces_[3 * prim_index + 2];
+
+    (*p0) = real3<T>(get_vertex_addr(vertices_, f0, vertex_stride_bytes_));
+    (*p1) = real3<T>(get_vertex_addr(vertices_, f1, vertex_stride_bytes_));
+    (*p2) = real3<T>(get_vertex_addr(vertices_, f2, vertex_stride_bytes_));
+
+    return true;
+  }
+
+  mutable real3<T> ray_org_[N];
+  mutable TriangleRayCoeff<T> ray_coeff_[N];
+  mutable BVHTraceOptions trace_options_;
+  mutable T t_min_[N];
+
+  mutable T t_[N];
+  mutable T u_[N];
+  mutable T v_[N];
+  mutable unsigned int prim_id_[N];
+};
+
+template <typename T, int N, class H, typename I, unsigned int Features>
+class IntersectorFeatureTraits<TrianglePacketIntersector<T, N, H, I, Features> > {
+ public:
+  enum { kFeatures = Features };
+};
+
+///
+/// Stores closest point information for triangle geometry.
+///
+template <typename T = float>
+class TriangleClosestPoint {
+ public:
+  T position[3];  // Closest point on the triangle
+  T u;            // Barycentric coordinate(same as `TriangleIntersection`)
+  T v;
+
+  // Required member variables.
+  T distance;  // Distance from the query point
+  unsigned int prim_id;
+};
+
+///
+/// Returns the closest point on triangle(`p0`, `p1`, `p2`) to `p`.
+/// `u_out` and `v_out` are barycentric coordinates of it:
+/// closest = (1 - u - v) * p0 + u * p1 + v * p2.
+///
+/// Based on Christer Ericson, Real-Time Collision Detection, 5.1.5.
+///
+template <typename T>
+inline real3<T> ClosestPointOnTriangle(const real3<T> &p, const real3<T> &p0,
+                                       const real3<T> &p1, const real3<T> &p2,
+                                       T *u_out, T *v_out) {
+  const T kZero = static_cast<T>(0.0);
+  const T kOne = static_cast<T>(1.0);
+
+  const real3<T> e01 = p1 - p0;
+  const real3<T> e02 = p2 - p0;
+
+  // Vertex region of p0
+  const real3<T> d0 = p - p0;
+  const T d1 = vdot(e01, d0);
+  const T d2 = vdot(e02, d0);
+  if (d1 <= kZero && d2 <= kZero) {
+    (*u_out) = kZero;
+    (*v_out) = kZero;
+    return p0;
+  }
+
+  // Vertex region of p1
+  const real3<T> dp1 = p - p1;
+  const T d3 = vdot(e01, dp1);
+  const T d4 = vdot(e02, dp1);
+  if (d3 >= kZero && d4 <= d3) {
+    (*u_out) = kOne;
+    (*v_out) = kZero;
+    return p1;
+  }
+
+  // Edge region of p0-p1
+  const T vc = d1 * d4 - d3 * d2;
+  if (vc <= kZero && d1 >= kZero && d3 <= kZero) {
+    const T w = d1 / (d1 - d3);
+    (*u_out) = w;
+    (*v_out) = kZero;
+    return p0 + e01 * w;
+  }
+
+  // Vertex region of p2
+  const real3<T> dp2 = p - p2;
+  const T d5 = vdot(e01, dp2);
+  const T d6 = vdot(e02, dp2);
+  if (d6 >= kZero && d5 <= d6) {
+    (*u_out) = kZero;
+    (*v_out) = kOne;
+    return p2;
+  }
+
+  // Edge region of p0-p2
+  const T vb = d5 * d2 - d1 * d6;
+  if (vb <= kZero && d2 >= kZero && d6 <= kZero) {
+    const T w = d2 / (d2 - d6);
+    (*u_out) = kZero;
+    (*v_out) = w;
+    return p0 + e02 * w;
+  }
+
+  // Edge region of p1-p2
+  const T va = d3 * d6 - d5 * d4;
+  if (va <= kZero && (d4 - d3) >= kZero && (d5 - d6) >= kZero) {
+    const T w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+    (*u_out) = kOne - w;
+    (*v_out) = w;
+    return p1 + (p2 - p1) * w;
+  }
+
+  // Face region
+  const T denom = kOne / (va + vb + vc);
+  const T u = vb * denom;
+  const T v = vc * denom;
+  (*u_out) = u;
+  (*v_out) = v;
+  return p0 + e01 * u + e02 * v;
+}
+
+///
+/// Closest point query for triangle geometry(`BVHAccel::ClosestPoint`).
+/// Has no per-query state, so it can be shared by threads.
+///
+/// @tparam T Precision(float or double)
+/// @tparam H Closest point information struct
+/// @tparam I Vertex index type
+///
+template <typename T = float, class H = TriangleClosestPoint<T>,
+          typename I = unsigned int>
+class TriangleClosestPointQuery {
+ public:
+  // Initialize from mesh object.
+  // M: mesh class
+  template <class M>
+  TriangleClosestPointQuery(const M &m)
+      : vertices_(m.GetVertices()),
+        faces_(m.GetFaces()),
+        vertex_stride_bytes_(m.GetVertexStrideBytes()) {}
+
+  template <class M>
+  TriangleClosestPointQuery(const M *m)
+      : vertices_(m->GetVertices()),
+        faces_(m->GetFaces()),
+        vertex_stride_bytes_(m->GetVertexStrideBytes()) {}
+
+  TriangleClosestPointQuery(const T *vertices, const I *faces,
+                            const size_t vertex_stride_bytes)
+      : vertices_(vertices),
+        faces_(faces),
+        vertex_stride_bytes_(vertex_stride_bytes) {}
+
+  /// Compute the closest point on `prim_index` th primitive to `p` and fill
+  /// `closest`(except `distance`).
+  /// Returns squared distance between `p` and the closest point.
+  T ClosestPoint(const real3<T> &p, const unsigned int prim_index,
+                 H *closest) const {
+    const unsigned int f0 = faces_[3 * prim_index + 0];
+    const unsigned int f1 = faces_[3 * prim_index + 1];
+    const unsigned int f2 = faces_[3 * prim_index + 2];
+
+    const real3<T> p0(get_vertex_addr(vertices_, f0, vertex_stride_bytes_));
+    const real3<T> p1(get_vertex_addr(vertices_, f1, vertex_stride_bytes_));
+    const real3<T> p2(get_vertex_addr(vertices_, f2, vertex_stride_bytes_));
+
+    T u, v;
+    const real3<T> q = ClosestPointOnTriangle(p, p0, p1, p2, &u, &v);
+
+    (*closest).position[0] = q[0];
+    (*closest).position[1] = q[1];
+    (*closest).position[2] = q[2];
+    (*closest).u = u;
+    (*closest).v = v;
+    (*closest).prim_id = prim_index;
+
+    const real3<T> d = q - p;
+    return vdot(d, d);
+  }
+
+ private:
+  const T *vertices_;
+  const I *faces_;
+  const size_t vertex_stride_bytes_;
+};
+
+///
+/// Nearest neighbor query for point(or sphere) geometry
+/// (`BVHAccel::KNearestNeighbors`). The distance to a sphere primitive is
+/// measured to its center.
+/// Has no per-query state, so it can be shared by threads.
+///
+/// @tparam T Precision(float or double)
+///
+template <typename T = float>
+class PointNeighborQuery {
+ public:
+  PointNeighborQuery(const T *points, const size_t point_stride_bytes)
+      : points_(points), point_stride_bytes_(point_stride_bytes) {}
+
+  /// Returns squared distance between `p` and `prim_index` th point.
+  T DistanceSquared(const real3<T> &p, const unsigned int prim_index) const {
+    const real3<T> q(get_vertex_addr(points_, prim_index, point_stride_bytes_));
+    const real3<T> d = q - p;
+    return vdot(d, d);
+  }
+
+ private:
+  const T *points_;
+  const size_t point_stride_bytes_;
+};
+
+///
+/// Apply rigid transform `xf`(3x4 row major matrix, NULL = identity) to `p`.
+///
+template <typename T>
+inline real3<T> TransformPoint(const T *xf, const real3<T> &p) {
+  if (!xf) {
+    return p;
+  }
+  return real3<T>(xf[0] * p[0] + xf[1] * p[1] + xf[2] * p[2] + xf[3],
+                  xf[4] * p[0] + xf[5] * p[1] + xf[6] * p[2] + xf[7],
+                  xf[8] * p[0] + xf[9] * p[1] + xf[10] * p[2] + xf[11]);
+}
+
+///
+/// Bounding box of box [`bmin`, `bmax`] transformed by `xf`(3x4 row major
+/// matrix, NULL = identity).
+///
+template <typename T>
+inline void TransformBoundingBox(const T *xf, const real3<T> &bmin,
+                                 const real3<T> &bmax, real3<T> *out_bmin,
+                                 real3<T> *out_bmax) {
+  if (!xf) {
+    (*out_bmin) = bmin;
+    (*out_bmax) = bmax;
+    return;
+  }
+
+  const T kHalf = static_cast<T>(0.5);
+  const real3<T> center = TransformPoint(xf, (bmin + bmax) * kHalf);
+  const real3<T> extent = (bmax - bmin) * kHalf;
+
+  for (int k = 0; k < 3; k++) {
+    const T e = std::fabs(xf[4 * k + 0]) * extent[0] +
+                std::fabs(xf[4 * k + 1]) * extent[1] +
+                std::fabs(xf[4 * k + 2]) * extent[2];
+    (*out_bmin)[k] = center[k] - e;
+    (*out_bmax)[k] = center[k] + e;
+  }
+}
+
+///
+/// Returns true if triangle(`a0`, `a1`, `a2`) and triangle(`b0`, `b1`, `b2`)
+/// intersect(touching counts as intersection).
+/// Separating axis test with the face normals, the edge cross products and
+/// the in-plane edge normals(for coplanar triangles).
+///
+template <typename T>
+inline bool TriangleTriangleOverlap(const real3<T> &a0, const real3<T> &a1,
+                                    const real3<T> &a2, const real3<T> &b0,
+                                    const real3<T> &b1, const real3<T> &b2) {
+  const real3<T> ea[3] = {a1 - a0, a2 - a1, a0 - a2};
+  const real3<T> eb[3] = {b1 - b0, b2 - b1, b0 - b2};
+  const real3<T> na = vcross(ea[0], ea[1]);
+  const real3<T> nb = vcross(eb[0], eb[1]);
+
+  real3<T> axes[17];
+  int num_axes = 0;
+  axes[num_axes++] = na;
+  axes[num_axes++] = nb;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      axes[num_axes++] = vcross(ea[i], eb[j]);
+    }
+    axes[num_axes++] = vcross(na, ea[i]);
+    axes[num_axes++] = vcross(nb, eb[i]);
+  }
+
+  for (int i = 0; i < num_axes; i++) {
+    const real3<T> &axis = axes[i];
+
+    const T pa0 = vdot(axis, a0);
+    const T pa1 = vdot(axis, a1);
+    const T pa2 = vdot(axis, a2);
+    const T pb0 = vdot(axis, b0);
+    const T pb1 = vdot(axis, b1);
+    const T pb2 = vdot(axis, b2);
+
+    const T min_a = std::min(pa0, std::min(pa1, pa2));
+    const T max_a = std::max(pa0, std::max(pa1, pa2));
+    const T min_b = std::min(pb0, std::min(pb1, pb2));
+    const T max_b = std::max(pb0, std::max(pb1, pb2));
+
+    // Degenerated(zero) axis never separates.
+    if ((max_a < min_b) || (max_b < min_a)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+///
+/// Primitive pair test of `BVHAccel::OverlapBVH` which accepts all
+/// primitive pairs of overlapping leaf nodes.
+///
+class NoPrimitivePairTest {
+ public:
+  /// @param[in] transform Rigid transform from the other BVH passed to
+  /// `OverlapBVH`(NULL = identity).
+  template <typename T>
+  bool operator()(unsigned int prim_id, unsigned int other_prim_id,
+                  const T *transform) const {
+    (void)prim_id;
+    (void)other_prim_id;
+    (void)transform;
+    return true;
+  }
+};
+
+///
+/// Exact triangle-triangle test of `BVHAccel::OverlapBVH`.
+/// Triangles of the other mesh are transformed by the transform passed to
+/// `OverlapBVH`, so node and primitive tests always agree.
+///
+/// @tparam T Precision(float or double)
+/// @tparam I Vertex index type
+///
+template <typename T = float, typename I = unsigned int>
+class TriangleTriangleOverlapTest {
+ public:
+  /// @param[in] mesh Mesh of `BVHAccel` which runs the query(e.g. `TriangleMesh`)
+  /// @param[in] other_mesh Mesh of the other `BVHAccel`
+  template <class M, class OM>
+  TriangleTriangleOverlapTest(const M &mesh, const OM &other_mesh)
+      : vertices_(mesh.GetVertices()),
+        faces_(mesh.GetFaces()),
+        vertex_stride_bytes_(mesh.GetVertexStrideBytes()),
+        other_vertices_(other_mesh.GetVertices()),
+        other_faces_(other_mesh.GetFaces()),
+        other_vertex_stride_bytes_(other_mesh.GetVertexStrideBytes()) {}
+
+  TriangleTriangleOverlapTest(const T *vertices, const I *faces,
+                              const size_t vertex_stride_bytes,
+                              const T *other_vertices, const I *other_faces,
+                              const size_t other_vertex_stride_bytes)
+      : vertices_(vertices),
+        faces_(faces),
+        vertex_stride_bytes_(vertex_stride_bytes),
+        other_vertices_(other_vertices),
+        other_faces_(other_faces),
+        other_vertex_stride_bytes_(other_vertex_stride_bytes) {}
+
+  /// @param[in] transform Rigid transform from the other mesh to `mesh`
+  /// (3x4 row major matrix, NULL = identity) passed to `OverlapBVH`.
+  bool operator()(unsigned int prim_id, unsigned int other_prim_id,
+                  const T *transform) const {
+    real3<T> a[3], b[3];
+    for (int k = 0; k < 3; k++) {
+      a[k] = real3<T>(get_vertex_addr(vertices_, faces_[3 * prim_id + k],
+                                      vertex_stride_bytes_));
+      b[k] = TransformPoint(
+          transform, real3<T>(get_vertex_addr(
+                         other_vertices_, other_faces_[3 * other_prim_id + k],
+                         other_vertex_stride_bytes_)));
+    }
+
+    return TriangleTriangleOverlap(a[0], a[1], a[2], b[0], b[1], b[2]);
+  }
+
+ private:
+  const T *vertices_;
+  const I *faces_;
+  const size_t vertex_stride_bytes_;
+  const T *other_vertices_;
+  const I *other_faces_;
+  const size_t other_vertex_stride_bytes_;
+};
+
+//
+// Robust BVH Ray Traversal : http://jcgt.org/published/0002/02/02/paper.pdf
+//
+
+// NaN-safe min and max function.
+template <class T>
+const T &safemin(const T &a, const T &b) {
+  return (a < b) ? a : b;
+}
+template <class T>
+const T &safemax(const T &a, const T &b) {
+  return (a > b) ? a : b;
+}
+
+//
+// SAH functions
+//
+struct BinBuffer {
+  explicit BinBuffer(unsigned int size) {
+    bin_size = size;
+    bin.resize(2 * 3 * size);
+    clear();
+  }
+
+  void clear() { memset(&bin[0], 0, sizeof(size_t) * 2 * 3 * bin_size); }
+
+  std::vector<size_t> bin;  // (min, max) * xyz * binsize
+  unsigned int bin_size;
+  unsigned int pad0;
+};
+
+template <typename T>
+inline T CalculateSurfaceArea(const real3<T> &min, const real3<T> &max) {
+  real3<T> box = max - min;
+  return static_cast<T>(2.0) *
+         (box[0] * box[1] + box[1] * box[2] + box[2] * box[0]);
+}
+
+template <typename T>
+inline void GetBoundingBoxOfTriangle(real3<T> *bmin, real3<T> *bmax,
+                                     const T *vertices,
+                                     const unsigned int *faces,
+                                     unsigned int index) {
+  unsigned int f0 = faces[3 * index + 0];
+  unsigned int f1 = faces[3 * index + 1];
+  unsigned int f2 = faces[3 * index + 2];
+
+  real3<T> p[3];
+
+  p[0] = real3<T>(&vertices[3 * f0]);
+  p[1] = real3<T>(&vertices[3 * f1]);
+  p[2] = real3<T>(&vertices[3 * f2]);
+
+  (*bmin) = p[0];
+  (*bmax) = p[0];
+
+  for (int i = 1; i < 3; i++) {
+    (*bmin)[0] = std::min((*bmin)[0], p[i][0]);
+    (*bmin)[1] = std::min((*bmin)[1], p[i][1]);
+    (*bmin)[2] = std::min((*bmin)[2], p[i][2]);
+
+    (*bmax)[0] = std::max((*bmax)[0], p[i][0]);
+    (*bmax)[1] = std::max((*bmax)[1], p[i][1]);
+    (*bmax)[2] = std::max((*bmax)[2], p[i][2]);
+  }
+}
+
+template <typename T, class P>
+inline void ContributeBinBuffer(BinBuffer *bins,  // [out]
+                                const real3<T> &scene_min,
+                                const real3<T> &scene_max,
+                                unsigned int *indices, unsigned int left_idx,
+                                unsigned int right_idx, const P &p) {
+  T bin_size = static_cast<T>(bins->bin_size);
+
+  // Calculate extent
+  real3<T> scene_size, scene_inv_size;
+  scene_size = scene_max - scene_min;
+
+  for (int i = 0; i < 3; ++i) {
+    assert(scene_size[i] >= static_cast<T>(0.0));
+
+    if (scene_size[i] > static_cast<T>(0.0)) {
+      scene_inv_size[i] = bin_size / scene_size[i];
+    } else {
+      scene_inv_size[i] = static_cast<T>(0.0);
+    }
+  }
+
+  // Clear bin data
+  std::fill(bins->bin.begin(), bins->bin.end(), 0);
+  // memset(&bins->bin[0], 0, sizeof(2 * 3 * bins->bin_size));
+
+  size_t idx_bmin[3];
+  size_t idx_bmax[3];
+
+  for (size_t i = left_idx; i < right_idx; i++) {
+    //
+    // Quantize the position into [0, BIN_SIZE)
+    //
+    // q[i] = (int)(p[i] - scene_bmin) / scene_size
+    //
+    real3<T> bmin;
+    real3<T> bmax;
+
+    p.BoundingBox(&bmin, &bmax, indices[i]);
+    // GetBoundingBoxOfTriangle(&bmin, &bmax, vertices, faces, indices[i]);
+
+    real3<T> quantized_bmin = (bmin - scene_min) * scene_inv_size;
+    real3<T> quantized_bmax = (bmax - scene_min) * scene_inv_size;
+
+    // idx is now in [0, BIN_SIZE)
+    for (int j = 0; j < 3; ++j) {
+      int q0 = static_cast<int>(quantized_bmin[j]);
+      if (q0 < 0) q0 = 0;
+      int q1 = static_cast<int>(quantized_bmax[j]);
+      if (q1 < 0) q1 = 0;
+
+      idx_bmin[j] = static_cast<unsigned int>(q0);
+      idx_bmax[j] = static_cast<unsigned int>(q1);
+
+      if (idx_bmin[j] >= bin_size)
+        idx_bmin[j] = static_cast<unsigned int>(bin_size) - 1;
+
+      if (idx_bmax[j] >= bin_size)
+        idx_bmax[j] = static_cast<unsigned int>(bin_size) - 1;
+
+      // Increment bin counter
+      bins->bin[0 * (bins->bin_size * 3) +
+                static_cast<size_t>(j) * bins->bin_size + idx_bmin[j]] += 1;
+      bins->bin[1 * (bins->bin_size * 3) +
+                static_cast<size_t>(j) * bins->bin_size + idx_bmax[j]] += 1;
+    }
+  }
+}
+
+template <typename T>
+inline T SAH(size_t ns1, T leftArea, size_t ns2, T rightArea, T invS, T Taabb,
+             T Ttri) {
+  T sah;
+
+  sah = static_cast<T>(2.0) * Taabb +
+        (leftArea * invS) * static_cast<T>(ns1) * Ttri +
+        (rightArea * invS) * static_cast<T>(ns2) * Ttri;
+
+  return sah;
+}
+
+template <typename T>
+inline bool FindCutFromBinBuffer(T *cut_pos,        // [out] xyz
+                                 int *minCostAxis,  // [out]
+                                 const BinBuffer *bins, const real3<T> &bmin,
+                                 const real3<T> &bmax, size_t num_primitives,
+                                 T costTaabb) {      // should be in [0.0, 1.0]
+  const T kEPS = std::numeric_limits<T>::epsilon();  // * epsScale;
+
+  size_t left, right;
+  real3<T> bsize, bstep;
+  real3<T> bminLeft, bmaxLeft;
+  real3<T> bminRight, bmaxRight;
+  T saLeft, saRight, saTotal;
+  T pos;
+  T minCost[3];
+
+  T costTtri = static_cast<T>(1.0) - costTaabb;
+
+  (*minCostAxis) = 0;
+
+  bsize = bmax - bmin;
+  bstep = bsize * (static_cast<T>(1.0) / bins->bin_size);
+  saTotal = CalculateSurfaceArea(bmin, bmax);
+
+  T invSaTotal = static_cast<T>(0.0);
+  if (saTotal > kEPS) {
+    invSaTotal = static_cast<T>(1.0) / saTotal;
+  }
+
+  for (int j = 0; j < 3; ++j) {
+    //
+    // Compute SAH cost for the right side of each cell of the bbox.
+    // Exclude both extreme sides of the bbox.
+    //
+    //  i:      0    1    2    3
+    //     +----+----+----+----+----+
+    //     |    |    |    |    |    |
+    //     +----+----+----+----+----+
+    //
+
+    T minCostPos = bmin[j] + static_cast<T>(1.0) * bstep[j];
+    minCost[j] = std::numeric_limits<T>::max();
+
+    left = 0;
+    right = num_primitives;
+    bminLeft = bminRight = bmin;
+    bmaxLeft = bmaxRight = bmax;
+
+    for (int i = 0; i < static_cast<int>(bins->bin_size) - 1; ++i) {
+      left += bins->bin[0 * (3 * bins->bin_size) +
+                        static_cast<size_t>(j) * bins->bin_size +
+                        static_cast<size_t>(i)];
+      right -= bins->bin[1 * (3 * bins->bin_size) +
+                         static_cast<size_t>(j) * bins->bin_size +
+                         static_cast<size_t>(i)];
+
+      assert(left <= num_primitives);
+      assert(right <= num_primitives);
+
+      //
+      // Split pos bmin + (i + 1) * (bsize / BIN_SIZE)
+      // +1 for i since we want a position on right side of the cell.
+      //
+
+      pos = bmin[j] + (i + static_cast<T>(1.0)) * bstep[j];
+      bmaxLeft[j] = pos;
+      bminRight[j] = pos;
+
+      saLeft = CalculateSurfaceArea(bminLeft, bmaxLeft);
+      saRight = CalculateSurfaceArea(bminRight, bmaxRight);
+
+      T cost =
+          SAH(left, saLeft, right, saRight, invSaTotal, costTaabb, costTtri);
+
+      if (cost < minCost[j]) {
+        //
+        // Update the min cost
+        //
+        minCost[j] = cost;
+        minCostPos = pos;
+        // minCostAxis = j;
+      }
+    }
+
+    cut_pos[j] = minCostPos;
+  }
+
+  // cut_axis = minCostAxis;
+  // cut_pos = minCostPos;
+
+  // Find min cost axis
+  T cost = minCost[0];
+  (*minCostAxis) = 0;
+
+  if (cost > minCost[1]) {
+    (*minCostAxis) = 1;
+    cost = minCost[1];
+  }
+  if (cost > minCost[2]) {
+    (*minCostAxis) = 2;
+    cost = minCost[2];
+  }
+
+  return true;
+}
+
+#ifdef _OPENMP
+template <typename T, class P>
+void ComputeBoundingBoxOMP(real3<T> *bmin, real3<T> *bmax,
+                           const unsigned int *indices, unsigned int left_index,
+                           unsigned int right_index, const P &p) {
+  { p.BoundingBox(bmin, bmax, indices[left_index]); }
+
+  T local_bmin[3] = {(*bmin)[0], (*bmin)[1], (*bmin)[2]};
+  T local_bmax[3] = {(*bmax)[0], (*bmax)[1], (*bmax)[2]};
+
+  unsigned int n = right_index - left_index;
+
+#pragma omp parallel firstprivate(local_bmin, local_bmax) if (n > (1024 * 128))
+  {
+#pragma omp parallel for
+    // for each face
+    for (int i = int(left_index); i < int(right_index); i++) {
+      unsigned int idx = indices[i];
+
+      real3<T> bbox_min, bbox_max;
+
+      p.BoundingBox(&bbox_min, &bbox_max, idx);
+
+      // xyz
+      for (int k = 0; k < 3; k++) {
+        (*bmin)[k] = std::min((*bmin)[k], bbox_min[k]);
+        (*bmax)[k] = std::max((*bmax)[k], bbox_max[k]);
+      }
+    }
+
+#pragma omp critical
+    {
+      for (int k = 0; k < 3; k++) {
+        (*bmin)[k] = std::min((*bmin)[k], local_bmin[k]);
+        (*bmax)[k] = std::max((*bmax)[k], local_bmax[k]);
+      }
+    }
+  }
+}
+#endif
+
+#ifdef NANORT_USE_CPP11_FEATURE
+template <typename T, class P>
+inline void ComputeBoundingBoxThreaded(real3<T> *bmin, real3<T> *bmax,
+                                       const unsigned int *indices,
+                                       unsigned int left_index,
+                                       unsigned int right_index, const P &p) {
+  unsigned int n = right_index - left_index;
+
+  size_t num_threads = std::min(
+      size_t(kNANORT_MAX_THREADS),
+      std::max(size_t(1), size_t(std::thread::hardware_concurrency())));
+
+  if (n < num_threads) {
+    num_threads = n;
+  }
+
+  std::vector<std::thread> workers;
+
+  size_t ndiv = n / num_threads;
+
+  std::vector<T> local_bmins(3 * num_threads);  // 3 = xyz
+  std::vector<T> local_bmaxs(3 * num_threads);  // 3 = xyz
+
+  for (size_t t = 0; t < num_threads; t++) {
+    workers.emplace_back(std::thread([&, t]() {
+      size_t si = left_index + t * ndiv;
+      size_t ei = (t == (num_threads - 1)) ? size_t(right_index) : std::min(left_index + (t + 1) * ndiv, size_t(right_index));
+
+      local_bmins[3 * t + 0] = std::numeric_limits<T>::infinity();
+      local_bmins[3 * t + 1] = std::numeric_limits<T>::infinity();
+      local_bmins[3 * t + 2] = std::numeric_limits<T>::infinity();
+      local_bmaxs[3 * t + 0] = -std::numeric_limits<T>::infinity();
+      local_bmaxs[3 * t + 1] = -std::numeric_limits<T>::infinity();
+      local_bmaxs[3 * t + 2] = -std::numeric_limits<T>::infinity();
+
+      // for each face
+      for (size_t i = si; i < ei; i++) {
+        unsigned int idx = indices[i];
+
+        real3<T> bbox_min, bbox_max;
+        p.BoundingBox(&bbox_min, &bbox_max, idx);
+
+        // xyz
+        for (size_t k = 0; k < 3; k++) {
+          local_bmins[3 * t + k] =
+              std::min(local_bmins[3 * t + k], bbox_min[int(k)]);
+          local_bmaxs[3 * t + k] =
+              std::max(local_bmaxs[3 * t + k], bbox_max[int(k)]);
+        }
+      }
+    }));
+  }
+
+  for (auto &t : workers) {
+    t.join();
+  }
+
+  // merge bbox
+  for (size_t k = 0; k < 3; k++) {
+    (*bmin)[int(k)] = local_bmins[k];
+    (*bmax)[int(k)] = local_bmaxs[k];
+  }
+
+  for (size_t t = 1; t < num_threads; t++) {
+    for (size_t k = 0; k < 3; k++) {
+      (*bmin)[int(k)] = std::min((*bmin)[int(k)], local_bmins[3 * t + k]);
+      (*bmax)[int(k)] = std::max((*bmax)[int(k)], local_bmaxs[3 * t + k]);
+    }
+  }
+}
+#endif
+
+template <typename T, class P>
+inline void ComputeBoundingBox(real3<T> *bmin, real3<T> *bmax,
+                               const unsigned int *indices,
+                               unsigned int left_index,
+                               unsigned int right_index, const P &p) {
+  unsigned int idx = indices[left_index];
+  p.BoundingBox(bmin, bmax, idx);
+
+  {
+    // for each primitive
+    for (unsigned int i = left_index + 1; i < right_index; i++) {
+      idx = indices[i];
+      real3<T> bbox_min, bbox_max;
+      p.BoundingBox(&bbox_min, &bbox_max, idx);
+
+      // xyz
+      for (int k = 0; k < 3; k++) {
+        (*bmin)[k] = std::min((*bmin)[k], bbox_min[k]);
+        (*bmax)[k] = std::max((*bmax)[k], bbox_max[k]);
+      }
+    }
+  }
+}
+
+template <typename T, class Alloc>
+inline void GetBoundingBox(real3<T> *bmin, real3<T> *bmax,
+                           const std::vector<BBox<T>, Alloc> &bboxes,
+                           unsigned int *indices, unsigned int left_index,
+                           unsigned int right_index) {
+  unsigned int i = left_index;
+  unsigned int idx = indices[i];
+
+  (*bmin)[0] = bboxes[idx].bmin[0];
+  (*bmin)[1] = bboxes[idx].bmin[1];
+  (*bmin)[2] = bboxes[idx].bmin[2];
+  (*bmax)[0] = bboxes[idx].bmax[0];
+  (*bmax)[1] = bboxes[idx].bmax[1];
+  (*bmax)[2] = bboxes[idx].bmax[2];
+
+  // for each face
+  for (i = left_index + 1; i < right_index; i++) {
+    idx = indices[i];
+
+    // xyz
+    for (int k = 0; k < 3; k++) {
+      (*bmin)[k] = std::min((*bmin)[k], bboxes[idx].bmin[k]);
+      (*bmax)[k] = std::max((*bmax)[k], bboxes[idx].bmax[k]);
+    }
+  }
+}
+
+//
+// --
+//
+
+#if defined(NANORT_ENABLE_PARALLEL_BUILD)
+template <typename T, class A, typename NodeT>
+template <class P, class Pred>
+unsigned int BVHAccel<T, A, NodeT>::BuildShallowTree(NodeArray *out_nodes,
+                                              unsigned int left_idx,
+                                              unsigned int right_idx,
+                                              unsigned int depth,
+                                              unsigned int max_shallow_depth,
+                                              const P &p, const Pred &pred) {
+  assert(left_idx <= right_idx);
+
+  unsigned int offset = static_cast<unsigned int>(out_nodes->size());
+
+  if (stats_.max_tree_depth < depth) {
+    stats_.max_tree_depth = depth;
+  }
+
+  real3<T> bmin, bmax;
+
+#if defined(NANORT_USE_CPP11_FEATURE) && defined(NANORT_ENABLE_PARALLEL_BUILD)
+  ComputeBoundingBoxThreaded(&bmin, &bmax, &indices_.at(0), left_idx, right_idx,
+                             p);
+#else
+  ComputeBoundingBox(&bmin, &bmax, &indices_.at(0), left_idx, right_idx, p);
+#endif
+
+  unsigned int n = right_idx - left_idx;
+  if ((n <= options_.min_leaf_primitives) ||
+      (depth >= options_.max_tree_depth)) {
+    // Create leaf node.
+    Node leaf;
+
+    SetNodeBounds(&leaf, bmin, bmax);
+
+    assert(left_idx < std::numeric_limits<unsigned int>::max());
+
+    leaf.flag = 1;  // leaf
+    leaf.data[0] = n;
+    leaf.data[1] = left_idx;
+
+    out_nodes->push_back(leaf);  // atomic update
+
+    stats_.num_leaf_nodes++;
+
+    return offset;
+  }
+
+  //
+  // Create branch node.
+  //
+  if (depth >= max_shallow_depth) {
+    // Delay to build tree
+    ShallowNodeInfo info;
+    info.left_idx = left_idx;
+    info.right_idx = right_idx;
+    info.offset = offset;
+    shallow_node_infos_.push_back(info);
+
+    // Add dummy node.
+    Node node;
+    node.axis = -1;
+    node.flag = -1;
+    out_nodes->push_back(node);
+
+    return offset;
+
+  } else {
+    //
+    // TODO(LTE): multi-threaded SAH computation, or use simple object median or
+    // spacial median for shallow tree to speeding up the parallel build.
+    //
+
+    //
+    // Compute SAH and find best split axis and position
+    //
+    int min_cut_axis = 0;
+    T cut_pos[3] = {0.0, 0.0, 0.0};
+
+    BinBuffer bins(options_.bin_size);
+    ContributeBinBuffer(&bins, bmin, bmax, &indices_.at(0), left_idx, right_idx,
+                        p);
+    FindCutFromBinBuffer(cut_pos, &min_cut_axis, &bins, bmin, bmax, n,
+                         options_.cost_t_aabb);
+
+    // Try all 3 axis until good cut position avaiable.
+    unsigned int mid_idx = left_idx;
+    int cut_axis = min_cut_axis;
+
+    for (int axis_try = 0; axis_try < 3; axis_try++) {
+      unsigned int *begin = &indices_[left_idx];
+      unsigned int *end =
+          &indices_[right_idx - 1] + 1;  // mimics end() iterator
+      unsigned int *mid = 0;
+
+      // try min_cut_axis first.
+      cut_axis = (min_cut_axis + axis_try) % 3;
+
+      pred.Set(cut_axis, cut_pos[cut_axis]);
+      //
+      // Split at (cut_axis, cut_pos)
+      // indices_ will be modified.
+      //
+      mid = std::partition(begin, end, pred);
+
+      mid_idx = left_idx + static_cast<unsigned int>((mid - begin));
+
+      if ((mid_idx == left_idx) || (mid_idx == right_idx)) {
+        // Can't split well.
+        // Switch to object median (which may create unoptimized tree, but
+        // stable)
+        mid_idx = left_idx + (n >> 1);
+
+        // Try another axis if there's an axis to try.
+
+      } else {
+        // Found good cut. exit loop.
+        break;
+      }
+    }
+
+    Node node;
+    node.axis = cut_axis;
+    node.flag = 0;  // 0 = branch
+
+    out_nodes->push_back(node);
+
+    unsigned int left_child_index = 0;
+    unsigned int right_child_index = 0;
+
+    left_child_index = BuildShallowTree(out_nodes, left_idx, mid_idx, depth + 1,
+                                        max_shallow_depth, p, pred);
+
+    right_child_index = BuildShallowTree(out_nodes, mid_idx, right_idx,
+                                         depth + 1, max_shallow_depth, p, pred);
+
+    //std::cout << "shallow[" << offset << "] l and r = " << left_child_index << ", " << right_child_index << std::endl;
+    (*out_nodes)[offset].data[0] = left_child_index;
+    (*out_nodes)[offset].data[1] = right_child_index;
+
+    SetNodeBounds(&(*out_nodes)[offset], bmin, bmax);
+  }
+
+  stats_.num_branch_nodes++;
+
+  return offset;
+}
+#endif
+
+template <typename T, class A, typename NodeT>
+template <class P, class Pred>
+unsigned int BVHAccel<T, A, NodeT>::BuildTree(BVHBuildStatistics *out_stat,
+                                       NodeArray *out_nodes,
+                                       unsigned int left_idx,
+                                       unsigned int right_idx,
+                                       unsigned int depth, const P &p,
+                                       const Pred &pred) {
+  assert(left_idx <= right_idx);
+
+  unsigned int offset = static_cast<unsigned int>(out_nodes->size());
+
+  if (out_stat->max_tree_depth < depth) {
+    out_stat->max_tree_depth = depth;
+  }
+
+  real3<T> bmin, bmax;
+  if (!bboxes_.empty()) {
+    GetBoundingBox(&bmin, &bmax, bboxes_, &indices_.at(0), left_idx, right_idx);
+  } else {
+    ComputeBoundingBox(&bmin, &bmax, &indices_.at(0), left_idx, right_idx, p);
+  }
+
+  unsigned int n = right_idx - left_idx;
+  if ((n <= options_.min_leaf_primitives) ||
+      (depth >= options_.max_tree_depth)) {
+    // Create leaf node.
+    Node leaf;
+
+    SetNodeBounds(&leaf, bmin, bmax);
+
+    assert(left_idx < std::numeric_limits<unsigned int>::max());
+
+    leaf.flag = 1;  // leaf
+    leaf.data[0] = n;
+    leaf.data[1] = left_idx;
+
+    out_nodes->push_back(leaf);  // atomic update
+
+    out_stat->num_leaf_nodes++;
+
+    return offset;
+  }
+
+  //
+  // Create branch node.
+  //
+
+  //
+  // Compute SAH and find best split axis and position
+  //
+  int min_cut_axis = 0;
+  T cut_pos[3] = {0.0, 0.0, 0.0};
+
+  BinBuffer bins(options_.bin_size);
+  ContributeBinBuffer(&bins, bmin, bmax, &indices_.at(0), left_idx, right_idx,
+                      p);
+  FindCutFromBinBuffer(cut_pos, &min_cut_axis, &bins, bmin, bmax, n,
+                       options_.cost_t_aabb);
+
+  // Try all 3 axis until good cut position avaiable.
+  unsigned int mid_idx = left_idx;
+  int cut_axis = min_cut_axis;
+
+  for (int axis_try = 0; axis_try < 3; axis_try++) {
+    unsigned int *begin = &indices_[left_idx];
+    unsigned int *end = &indices_[right_idx - 1] + 1;  // mimics end() iterator.
+    unsigned int *mid = 0;
+
+    // try min_cut_axis first.
+    cut_axis = (min_cut_axis + axis_try) % 3;
+
+    pred.Set(cut_axis, cut_pos[cut_axis]);
+
+    //
+    // Split at (cut_axis, cut_pos)
+    // indices_ will be modified.
+    //
+    mid = std::partition(begin, end, pred);
+
+    mid_idx = left_idx + static_cast<unsigned int>((mid - begin));
+
+    if ((mid_idx == left_idx) || (mid_idx == right_idx)) {
+      // Can't split well.
+      // Switch to object median(which may create unoptimized tree, but
+      // stable)
+      mid_idx = left_idx + (n >> 1);
+
+      // Try another axis to find better cut.
+
+    } else {
+      // Found good cut. exit loop.
+      break;
+    }
+  }
+
+  Node node;
+  node.axis = cut_axis;
+  node.flag = 0;  // 0 = branch
+
+  out_nodes->push_back(node);
+
+  unsigned int left_child_index = 0;
+  unsigned int right_child_index = 0;
+
+  left_child_index =
+      BuildTree(out_stat, out_nodes, left_idx, mid_idx, depth + 1, p, pred);
+
+  right_child_index =
+      BuildTree(out_stat, out_nodes, mid_idx, right_idx, depth + 1, p, pred);
+
+  {
+    (*out_nodes)[offset].data[0] = left_child_index;
+    (*out_nodes)[offset].data[1] = right_child_index;
+
+    SetNodeBounds(&(*out_nodes)[offset], bmin, bmax);
+  }
+
+  out_stat->num_branch_nodes++;
+
+  return offset;
+}
+
+template <typename T, class A, typename NodeT>
+template <class Prim, class Pred>
+bool BVHAccel<T, A, NodeT>::Build(unsigned int num_primitives, const Prim &p,
+                        const Pred &pred, const BVHBuildOptions<T> &options) {
+  options_ = options;
+  stats_ = BVHBuildStatistics();
+
+  // Keep traversal stack from overflowing.
+  options_.max_tree_depth =
+      std::min(options_.max_tree_depth, unsigned(kNANORT_MAX_TREE_DEPTH));
+
+  nodes_.clear();
+  bboxes_.clear();
+  parents_.clear();
+  prim_id_ranges_.clear();
+  node_masks_.clear();
+  prim_masks_.clear();
+  motion_nodes_.clear();
+#if defined(NANORT_ENABLE_PARALLEL_BUILD)
+  shallow_node_infos_.clear();
+#endif
+
+  // For tracking temporary memory used during build.
+  size_t scratch_bytes = 0;
+  size_t build_threads = 1;
+
+  assert(options_.bin_size > 1);
+
+  if (num_primitives == 0) {
+    return false;
+  }
+
+  unsigned int n = num_primitives;
+
+  //
+  // 1. Create triangle indices(this will be permutated in BuildTree)
+  //
+  indices_.resize(n);
+
+#if defined(NANORT_USE_CPP11_FEATURE)
+  {
+    size_t num_threads = std::min(
+        size_t(kNANORT_MAX_THREADS),
+        std::max(size_t(1), size_t(std::thread::hardware_concurrency())));
+
+    if (n < num_threads) {
+      num_threads = n;
+    }
+
+    std::vector<std::thread> workers;
+
+    size_t ndiv = n / num_threads;
+
+    for (size_t t = 0; t < num_threads; t++) {
+      workers.emplace_back(std::thread([&, t]() {
+        size_t si = t * ndiv;
+        size_t ei = (t == (num_threads - 1)) ? n : std::min((t + 1) * ndiv, size_t(n));
+
+        for (size_t k = si; k < ei; k++) {
+          indices_[k] = static_cast<unsigned int>(k);
+        }
+      }));
+    }
+
+    for (auto &t : workers) {
+      t.join();
+    }
+  }
+
+#else
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int i = 0; i < static_cast<int>(n); i++) {
+    indices_[static_cast<size_t>(i)] = static_cast<unsigned int>(i);
+  }
+#endif  // !NANORT_USE_CPP11_FEATURE
+
+  //
+  // 2. Compute bounding box (optional).
+  //
+  real3<T> bmin, bmax;
+
+  if (options.cache_bbox) {
+    bmin[0] = bmin[1] = bmin[2] = std::numeric_limits<T>::max();
+    bmax[0] = bmax[1] = bmax[2] = -std::numeric_limits<T>::max();
+
+    bboxes_.resize(n);
+
+    for (size_t i = 0; i < n; i++) {  // for each primitive
+      unsigned int idx = indices_[i];
+
+      BBox<T> bbox;
+      p.BoundingBox(&(bbox.bmin), &(bbox.bmax), static_cast<unsigned int>(i));
+      bboxes_[idx] = bbox;
+
+      // xyz
+      for (int k = 0; k < 3; k++) {
+        bmin[k] = std::min(bmin[k], bbox.bmin[k]);
+        bmax[k] = std::max(bmax[k], bbox.bmax[k]);
+      }
+    }
+
+  } else {
+#if defined(NANORT_USE_CPP11_FEATURE)
+    ComputeBoundingBoxThreaded(&bmin, &bmax, &indices_.at(0), 0, n, p);
+#elif defined(_OPENMP)
+    ComputeBoundingBoxOMP(&bmin, &bmax, &indices_.at(0), 0, n, p);
+#else
+    ComputeBoundingBox(&bmin, &bmax, &indices_.at(0), 0, n, p);
+#endif
+  }
+
+//
+// 3. Build tree
+//
+#if defined(NANORT_ENABLE_PARALLEL_BUILD)
+#if defined(NANORT_USE_CPP11_FEATURE)
+
+  // Do parallel build for large enough datasets.
+  if (n > options.min_primitives_for_parallel_build) {
+    BuildShallowTree(&nodes_, 0, n, /* root depth */ 0, options.shallow_depth,
+                     p, pred);  // [0, n)
+
+    assert(shallow_node_infos_.size() > 0);
+
+    // Build deeper tree in parallel
+    std::vector<NodeArray> local_nodes(shallow_node_infos_.size(),
+                                       NodeArray(nodes_.get_allocator()));
+    std::vector<BVHBuildStatistics> local_stats(shallow_node_infos_.size());
+
+    size_t num_threads = std::min(
+        size_t(kNANORT_MAX_THREADS),
+        std::max(size_t(1), size_t(std::thread::hardware_concurrency())));
+    if (shallow_node_infos_.size() < num_threads) {
+      num_threads = shallow_node_infos_.size();
+    }
+
+    std::vector<std::thread> workers;
+    std::atomic<uint32_t> i(0);
+
+    for (size_t t = 0; t < num_threads; t++) {
+      workers.emplace_back(std::thread([&]() {
+        uint32_t idx = 0;
+        while ((idx = (i++)) < shallow_node_infos_.size()) {
+          // Create thread-local copy of Pred since some mutable variables are
+          // modified during SAH computation.
+          const Pred local_pred = pred;
+          unsigned int left_idx = shallow_node_infos_[size_t(idx)].left_idx;
+          unsigned int right_idx = shallow_node_infos_[size_t(idx)].right_idx;
+          BuildTree(&(local_stats[size_t(idx)]), &(local_nodes[size_t(idx)]),
+                    left_idx, right_idx, options.shallow_depth, p, local_pred);
+        }
+      }));
+    }
+
+    for (auto &t : workers) {
+      t.join();
+    }
+
+    build_threads = num_threads;
+    scratch_bytes += LocalNodesBytes(local_nodes);
+
+    // Join local nodes
+    for (size_t ii = 0; ii < local_nodes.size(); ii++) {
+      assert(!local_nodes[ii].empty());
+      size_t offset = nodes_.size();
+
+      // Add offset to child index (for branch node).
+      for (size_t j = 0; j < local_nodes[ii].size(); j++) {
+        if (local_nodes[ii][j].flag == 0) {  // branch
+          local_nodes[ii][j].data[0] += offset - 1;
+          local_nodes[ii][j].data[1] += offset - 1;
+        }
+      }
+
+      // replace
+      nodes_[shallow_node_infos_[ii].offset] = local_nodes[ii][0];
+
+      // Skip root element of the local node.
+      nodes_.insert(nodes_.end(), local_nodes[ii].begin() + 1,
+                    local_nodes[ii].end());
+    }
+
+    // Join statistics
+    for (size_t ii = 0; ii < local_nodes.size(); ii++) {
+      stats_.max_tree_depth =
+          std::max(stats_.max_tree_depth, local_stats[ii].max_tree_depth);
+      stats_.num_leaf_nodes += local_stats[ii].num_leaf_nodes;
+      stats_.num_branch_nodes += local_stats[ii].num_branch_nodes;
+    }
+
+  } else {
+    // Single thread.
+    BuildTree(&stats_, &nodes_, 0, n,
+              /* root depth */ 0, p, pred);  // [0, n)
+  }
+
+#elif defined(_OPENMP)
+
+  // Do parallel build for large enough datasets.
+  if (n > options.min_primitives_for_parallel_build) {
+    BuildShallowTree(&nodes_, 0, n, /* root depth */ 0, options.shallow_depth,
+                     p, pred);  // [0, n)
+
+    assert(shallow_node_infos_.size() > 0);
+
+    // Build deeper tree in parallel
+    std::vector<NodeArray> local_nodes(shallow_node_infos_.size(),
+                                       NodeArray(nodes_.get_allocator()));
+    std::vector<BVHBuildStatistics> local_stats(shallow_node_infos_.size());
+
+#pragma omp parallel for
+    for (int i = 0; i < static_cast<int>(shallow_node_infos_.size()); i++) {
+      unsigned int left_idx = shallow_node_infos_[size_t(i)].left_idx;
+      unsigned int right_idx = shallow_node_infos_[size_t(i)].right_idx;
+      const Pred local_pred = pred;
+      BuildTree(&(local_stats[size_t(i)]), &(local_nodes[size_t(i)]), left_idx,
+                right_idx, options.shallow_depth, p, local_pred);
+    }
+
+    scratch_bytes += LocalNodesBytes(local_nodes);
+
+    // Join local nodes
+    for (size_t i = 0; i < local_nodes.size(); i++) {
+      assert(!local_nodes[size_t(i)].empty());
+      size_t offset = nodes_.size();
+
+      // Add offset to child index (for branch node).
+      for (size_t j = 0; j < local_nodes[i].size(); j++) {
+        if (local_nodes[i][j].flag == 0) {  // branch
+          local_nodes[i][j].data[0] += offset - 1;
+          local_nodes[i][j].data[1] += offset - 1;
+        }
+      }
+
+      // replace
+      nodes_[shallow_node_infos_[i].offset] = local_nodes[i][0];
+
+      // Skip root element of the local node.
+      nodes_.insert(nodes_.end(), local_nodes[i].begin() + 1,
+                    local_nodes[i].end());
+    }
+
+    // Join statistics
+    for (size_t i = 0; i < local_nodes.size(); i++) {
+      stats_.max_tree_depth =
+          std::max(stats_.max_tree_depth, local_stats[i].max_tree_depth);
+      stats_.num_leaf_nodes += local_stats[i].num_leaf_nodes;
+      stats_.num_branch_nodes += local_stats[i].num_branch_nodes;
+    }
+
+  } else {
+    // Single thread
+    BuildTree(&stats_, &nodes_, 0, n,
+              /* root depth */ 0, p, pred);  // [0, n)
+  }
+
+#else  // !NANORT_ENABLE_PARALLEL_BUILD
+  {
+    BuildTree(&stats_, &nodes_, 0, n,
+              /* root depth */ 0, p, pred);  // [0, n)
+  }
+#endif
+#else  // !_OPENMP
+
+  // Single thread BVH build
+  {
+    BuildTree(&stats_, &nodes_, 0, n,
+              /* root depth */ 0, p, pred);  // [0, n)
+  }
+#endif
+
+  if (options_.build_parent_links) {
+    BuildParentLinks();
+  }
+
+  if (options_.build_prim_id_ranges) {
+    BuildPrimIdRanges();
+  }
+
+  // SAH bin buffers live along the recursion path of each thread.
+  scratch_bytes += build_threads * (stats_.max_tree_depth + 1) *
+                   BinBufferBytes(options_.bin_size);
+#if defined(NANORT_ENABLE_PARALLEL_BUILD)
+  scratch_bytes += shallow_node_infos_.capacity() * sizeof(ShallowNodeInfo);
+#endif
+  // Old buffer of the last reallocation of `nodes_`.
+  scratch_bytes += (nodes_.capacity() / 2) * sizeof(Node);
+  build_scratch_bytes_ = scratch_bytes;
+
+  return true;
+}
+
+template <typename T, class A, typename NodeT>
+BVHMemoryUsage BVHAccel<T, A, NodeT>::EstimateMemoryUsage(
+    unsigned int num_primitives, const BVHBuildOptions<T> &options,
+    unsigned int num_threads) {
+  BVHMemoryUsage usage;
+
+  size_t n = num_primitives;
+  if (n == 0) {
+    return usage;
+  }
+
+  // Each leaf has at least one primitive, so the number of nodes is less than
+  // `2 * n`. Node array may have up to 2x capacity due to its growth.
+  size_t max_nodes = 2 * n - 1;
+  usage.nodes_bytes = 2 * max_nodes * sizeof(Node);
+  usage.indices_bytes = n * sizeof(unsigned int);
+  if (options.cache_bbox) {
+    usage.bboxes_bytes = n * sizeof(BBox<T>);
+  }
+  if (options.build_parent_links) {
+    usage.aux_bytes += max_nodes * sizeof(unsigned int);
+  }
+  if (options.build_prim_id_ranges) {
+    usage.aux_bytes += 2 * max_nodes * sizeof(unsigned int);
+  }
+
+  size_t max_depth = std::min(size_t(options.max_tree_depth), max_nodes);
+  usage.build_scratch_bytes = std::max(size_t(1), size_t(num_threads)) *
+                              (max_depth + 1) *
+                              BinBufferBytes(options.bin_size);
+  usage.build_scratch_bytes += max_nodes * sizeof(Node);  // node reallocation
+#if defined(NANORT_ENABLE_PARALLEL_BUILD)
+  if (n > options.min_primitives_for_parallel_build) {
+    // Local node arrays of subtrees.
+    usage.build_scratch_bytes += 2 * max_nodes * sizeof(Node);
+    usage.build_scratch_bytes +=
+        (size_t(1) << std::min(options.shallow_depth, 31u)) *
+        sizeof(ShallowNodeInfo);
+  }
+#endif
+
+  usage.total_bytes = usage.nodes_bytes + usage.indices_bytes +
+                      usage.bboxes_bytes + usage.aux_bytes;
+
+  return usage;
+}
+
+template <typename T, class A, typename NodeT>
+void BVHAccel<T, A, NodeT>::Debug() {
+  for (size_t i = 0; i < indices_.size(); i++) {
+    printf("index[%d] = %d\n", int(i), int(indices_[i]));
+  }
+
+  for (size_t i = 0; i < nodes_.size(); i++) {
+    printf("node[%d] : bmin %f, %f, %f, bmax %f, %f, %f\n", int(i),
+           nodes_[i].bmin[0], nodes_[i].bmin[1], nodes_[i].bmin[2],
+           nodes_[i].bmax[0], nodes_[i].bmax[1], nodes_[i].bmax[2]);
+  }
+}
+
+#if defined(NANORT_ENABLE_SERIALIZATION)
+template <typename T, class A, typename NodeT>
+bool BVHAccel<T, A, NodeT>::Dump(const char *filename) const {
+  FILE *fp = fopen(filename, "wb");
+  if (!fp) {
+    // fprintf(stderr, "[BVHAccel] Cannot write a file: %s\n", filename);
+    return false;
+  }
+
+  size_t numNodes = nodes_.size();
+  assert(nodes_.size() > 0);
+
+  size_t numIndices = indices_.size();
+
+  size_t r = 0;
+  r = fwrite(&numNodes, sizeof(size_t), 1, fp);
+  assert(r == 1);
+
+  r = fwrite(&nodes_.at(0), sizeof(Node), numNodes, fp);
+  assert(r == numNodes);
+
+  r = fwrite(&numIndices, sizeof(size_t), 1, fp);
+  assert(r == 1);
+
+  r = fwrite(&indices_.at(0), sizeof(unsigned int), numIndices, fp);
+  assert(r == numIndices);
+
+  fclose(fp);
+
+  return true;
+}
+
+template <typename T, class A, typename NodeT>
+bool BVHAccel<T, A, NodeT>::Dump(FILE *fp) const {
+  size_t numNodes = nodes_.size();
+  assert(nodes_.size() > 0);
+
+  size_t numIndices = indices_.size();
+
+  size_t r = 0;
+  r = fwrite(&numNodes, sizeof(size_t), 1, fp);
+  assert(r == 1);
+
+  r = fwrite(&nodes_.at(0), sizeof(Node), numNodes, fp);
+  assert(r == numNodes);
+
+  r = fwrite(&numIndices, sizeof(size_t), 1, fp);
+  assert(r == 1);
+
+  r = fwrite(&indices_.at(0), sizeof(unsigned int), numIndices, fp);
+  assert(r == numIndices);
+
+  return true;
+}
+
+template <typename T, class A, typename NodeT>
+bool BVHAccel<T, A, NodeT>::Load(const char *filename) {
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) {
+    // fprintf(stderr, "Cannot open file: %s\n", filename);
+    return false;
+  }
+
+  const bool ret = Load(fp);
+
+  fclose(fp);
+
+  return ret;
+}
+
+template <typename T, class A, typename NodeT>
+bool BVHAccel<T, A, NodeT>::Load(FILE *fp) {
+  size_t numNodes;
+  size_t numIndices;
+
+  size_t r = 0;
+  r = fread(&numNodes, sizeof(size_t), 1, fp);
+  assert(r == 1);
+  assert(numNodes > 0);
+
+  nodes_.resize(numNodes);
+  r = fread(&nodes_.at(0), sizeof(Node), numNodes, fp);
+  assert(r == numNodes);
+
+  r = fread(&numIndices, sizeof(size_t), 1, fp);
+  assert(r == 1);
+
+  indices_.resize(numIndices);
+
+  r = fread(&indices_.at(0), sizeof(unsigned int), numIndices, fp);
+  assert(r == numIndices);
+
+  parents_.clear();
+  prim_id_ranges_.clear();
+  node_masks_.clear();
+  prim_masks_.clear();
+  motion_nodes_.clear();
+
+  // Nothing was built.
+  build_scratch_bytes_ = 0;
+
+  // Reject a tree which could overflow traversal stack.
+  if (ComputeTreeDepth() > kNANORT_MAX_TREE_DEPTH) {
+    nodes_.clear();
+    indices_.clear();
+    return false;
+  }
+
+  return true;
+}
+#endif
+
+template <typename T>
+inline bool IntersectRayAABB(T *tminOut,  // [out]
+                             T *tmaxOut,  // [out]
+                             T min_t, T max_t, const T bmin[3], const T bmax[3],
+                             real3<T> ray_org, real3<T> ray_inv_dir,
+                             const int ray_dir_sign[3]);
+template <>
+inline bool IntersectRayAABB<float>(float *tminOut,  // [out]
+                                    float *tmaxOut,  // [out]
+                                    float min_t, float max_t,
+                                    const float bmin[3], const float bmax[3],
+                                    real3<float> ray_org,
+                                    real3<float> ray_inv_dir,
+                                    const int ray_dir_sign[3]) {
+  float tmin, tmax;
+
+  const float min_x = ray_dir_sign[0] ? bmax[0] : bmin[0];
+  const float min_y = ray_dir_sign[1] ? bmax[1] : bmin[1];
+  const float min_z = ray_dir_sign[2] ? bmax[2] : bmin[2];
+  const float max_x = ray_dir_sign[0] ? bmin[0] : bmax[0];
+  const float max_y = ray_dir_sign[1] ? bmin[1] : bmax[1];
+  const float max_z = ray_dir_sign[2] ? bmin[2] : bmax[2];
+
+  // X
+  const float tmin_x = (min_x - ray_org[0]) * ray_inv_dir[0];
+  // MaxMult robust BVH traversal(up to 4 ulp).
+  // 1.0000000000000004 for double precision.
+  const float tmax_x = (max_x - ray_org[0]) * ray_inv_dir[0] * 1.00000024f;
+
+  // Y
+  const float tmin_y = (min_y - ray_org[1]) * ray_inv_dir[1];
+  const float tmax_y = (max_y - ray_org[1]) * ray_inv_dir[1] * 1.00000024f;
+
+  // Z
+  const float tmin_z = (min_z - ray_org[2]) * ray_inv_dir[2];
+  const float tmax_z = (max_z - ray_org[2]) * ray_inv_dir[2] * 1.00000024f;
+
+  tmin = safemax(tmin_z, safemax(tmin_y, safemax(tmin_x, min_t)));
+  tmax = safemin(tmax_z, safemin(tmax_y, safemin(tmax_x, max_t)));
+
+  if (tmin <= tmax) {
+    (*tminOut) = tmin;
+    (*tmaxOut) = tmax;
+
+    return true;
+  }
+  return false;  // no hit
+}
+
+template <>
+inline bool IntersectRayAABB<double>(double *tminOut,  // [out]
+                                     double *tmaxOut,  // [out]
+                                     double min_t, double max_t,
+                                     const double bmin[3], const double bmax[3],
+                                     real3<double> ray_org,
+                                     real3<double> ray_inv_dir,
+                                     const int ray_dir_sign[3]) {
+  double tmin, tmax;
+
+  const double min_x = ray_dir_sign[0] ? bmax[0] : bmin[0];
+  const double min_y = ray_dir_sign[1] ? bmax[1] : bmin[1];
+  const double min_z = ray_dir_sign[2] ? bmax[2] : bmin[2];
+  const double max_x = ray_dir_sign[0] ? bmin[0] : bmax[0];
+  const double max_y = ray_dir_sign[1] ? bmin[1] : bmax[1];
+  const double max_z = ray_dir_sign[2] ? bmin[2] : bmax[2];
+
+  // X
+  const double tmin_x = (min_x - ray_org[0]) * ray_inv_dir[0];
+  // MaxMult robust BVH traversal(up to 4 ulp).
+  const double tmax_x =
+      (max_x - ray_org[0]) * ray_inv_dir[0] * 1.0000000000000004;
+
+  // Y
+  const double tmin_y = (min_y - ray_org[1]) * ray_inv_dir[1];
+  const double tmax_y =
+      (max_y - ray_org[1]) * ray_inv_dir[1] * 1.0000000000000004;
+
+  // Z
+  const double tmin_z = (min_z - ray_org[2]) * ray_inv_dir[2];
+  const double tmax_z =
+      (max_z - ray_org[2]) * ray_inv_dir[2] * 1.0000000000000004;
+
+  tmin = safemax(tmin_z, safemax(tmin_y, safemax(tmin_x, min_t)));
+  tmax = safemin(tmax_z, safemin(tmax_y, safemin(tmax_x, max_t)));
+
+  if (tmin <= tmax) {
+    (*tminOut) = tmin;
+    (*tmaxOut) = tmax;
+
+    return true;
+  }
+  return false;  // no hit
+}
+
+///
+/// MaxMult factor for robust BVH traversal(up to 4 ulp).
+///
+template <typename T>
+inline T RobustTraversalMaxMult();
+
+template <>
+inline float RobustTraversalMaxMult<float>() {
+  return 1.00000024f;
+}
+
+template <>
+inline double RobustTraversalMaxMult<double>() {
+  return 1.0000000000000004;
+}
+
+
+template <typename T>
+class NodeTraversalRay<T, T> {
+ public:
+  NodeTraversalRay() {}
+
+  explicit NodeTraversalRay(const Ray<T> &ray) {
+    dir_sign[0] = ray.dir[0] < static_cast<T>(0.0) ? 1 : 0;
+    dir_sign[1] = ray.dir[1] < static_cast<T>(0.0) ? 1 : 0;
+    dir_sign[2] = ray.dir[2] < static_cast<T>(0.0) ? 1 : 0;
+
+    real3<T> ray_dir;
+    ray_dir[0] = ray.dir[0];
+    ray_dir[1] = ray.dir[1];
+    ray_dir[2] = ray.dir[2];
+
+    inv_dir = vsafe_inverse(ray_dir);
 
-  const unsigned int *GetFaces() const {
-    return faces_;
+    org[0] = ray.org[0];
+    org[1] = ray.org[1];
+    org[2] = ray.org[2];
   }
 
-  size_t GetVertexStrideBytes() const {
-    return vertex_stride_bytes_;
+  bool Intersect(T *tmin, T *tmax, T min_t, T max_t,
+                 const BVHNode<T> &node) const {
+    return IntersectRayAABB(tmin, tmax, min_t, max_t, node.bmin, node.bmax,
+                            org, inv_dir, dir_sign);
   }
-};
-
-///
-/// Stores intersection point information for triangle geometry.
-///
-template <typename T = float>
-class TriangleIntersection {
- public:
-  T u;
-  T v;
 
-  // Required member variables.
-  T t;
-  unsigned int prim_id;
+  real3<T> org;
+  real3<T> inv_dir;
+  int dir_sign[3];
 };
 
-///
-/// Intersector is a template class which implements intersection method and stores
-/// intesection point information(`H`)
-///
-/// @tparam T Precision(float or double)
-/// @tparam H Intersection point information struct
-///
-template <typename T = float, class H = TriangleIntersection<T> >
-class TriangleIntersector {
+// Float node traversal for double precision ray.
+//
+// Ray origin is rounded to both directions and the one giving the smaller
+// `tmin`(and larger `tmax`) is used for each slab, so the test never misses a
+// node which the double precision ray hits.
+// MaxMult is doubled(compared to float version of IntersectRayAABB) to
+// account rounding of the inverse ray direction to float.
+template <>
+class NodeTraversalRay<float, double> {
  public:
+  NodeTraversalRay() {}
 
-  // Initialize from mesh object.
-  // M: mesh class
-  template<class M>
-  TriangleIntersector(const M &m)
-      : vertices_(m.GetVertices()),
-        faces_(m.GetFaces()),
-        vertex_stride_bytes_(m.GetVertexStrideBytes()) {}
-
-  template<class M>
-  TriangleIntersector(const M *m)
-      : vertices_(m->GetVertices()),
-        faces_(m->GetFaces()),
-        vertex_stride_bytes_(m->GetVertexStrideBytes()) {}
-
-  TriangleIntersector(const T *vertices, const unsigned int *faces,
-                      const size_t vertex_stride_bytes)  // e.g.
-                                                         // vertex_stride_bytes
-                                                         // = 12 = sizeof(float)
-                                                         // * 3
-      : vertices_(vertices),
-        faces_(faces),
-        vertex_stride_bytes_(vertex_stride_bytes) {}
+  explicit NodeTraversalRay(const Ray<double> &ray) {
+    real3<double> ray_dir(ray.dir[0], ray.dir[1], ray.dir[2]);
+    real3<double> ray_inv_dir = vsafe_inverse(ray_dir);
 
-  // For Watertight Ray/Triangle Intersection.
-  typedef struct {
-    T Sx;
-    T Sy;
-    T Sz;
-    int kx;
-    int ky;
-    int kz;
-  } RayCoeff;
+    for (int k = 0; k < 3; k++) {
+      dir_sign[k] = ray.dir[k] < 0.0 ? 1 : 0;
 
-  /// Do ray intersection stuff for `prim_index` th primitive and return hit
-  /// distance `t`, barycentric coordinate `u` and `v`.
-  /// Returns true if there's intersection.
-  bool Intersect(T *t_inout, const unsigned int prim_index) const {
-    if ((prim_index < trace_options_.prim_ids_range[0]) ||
-        (prim_index >= trace_options_.prim_ids_range[1])) {
-      return false;
-    }
+      inv_dir[k] = static_cast<float>(ray_inv_dir[k]);
 
-    // Self-intersection test.
-    if (prim_index == trace_options_.skip_prim_id) {
-      return false;
+      float org_lo = NodeCoordRounding<float, double>::Lower(ray.org[k]);
+      float org_hi = NodeCoordRounding<float, double>::Upper(ray.org[k]);
+      org_near[k] = dir_sign[k] ? org_lo : org_hi;
+      org_far[k] = dir_sign[k] ? org_hi : org_lo;
     }
+  }
 
-    const unsigned int f0 = faces_[3 * prim_index + 0];
-    const unsigned int f1 = faces_[3 * prim_index + 1];
-    const unsigned int f2 = faces_[3 * prim_index + 2];
+  bool Intersect(float *tminOut, float *tmaxOut, double min_t, double max_t,
+                 const BVHNode<float> &node) const {
+    const float kMaxMult = 1.00000048f;
 
-    const real3<T> p0(get_vertex_addr(vertices_, f0 + 0, vertex_stride_bytes_));
-    const real3<T> p1(get_vertex_addr(vertices_, f1 + 0, vertex_stride_bytes_));
-    const real3<T> p2(get_vertex_addr(vertices_, f2 + 0, vertex_stride_bytes_));
+    float tmin = NodeCoordRounding<float, double>::Lower(min_t);
+    float tmax = NodeCoordRounding<float, double>::Upper(max_t);
 
-    const real3<T> A = p0 - ray_org_;
-    const real3<T> B = p1 - ray_org_;
-    const real3<T> C = p2 - ray_org_;
+    for (int k = 0; k < 3; k++) {
+      const float near_plane = dir_sign[k] ? node.bmax[k] : node.bmin[k];
+      const float far_plane = dir_sign[k] ? node.bmin[k] : node.bmax[k];
 
-    const T Ax = A[ray_coeff_.kx] - ray_coeff_.Sx * A[ray_coeff_.kz];
-    const T Ay = A[ray_coeff_.ky] - ray_coeff_.Sy * A[ray_coeff_.kz];
-    const T Bx = B[ray_coeff_.kx] - ray_coeff_.Sx * B[ray_coeff_.kz];
-    const T By = B[ray_coeff_.ky] - ray_coeff_.Sy * B[ray_coeff_.kz];
-    const T Cx = C[ray_coeff_.kx] - ray_coeff_.Sx * C[ray_coeff_.kz];
-    const T Cy = C[ray_coeff_.ky] - ray_coeff_.Sy * C[ray_coeff_.kz];
+      const float tnear = (near_plane - org_near[k]) * inv_dir[k];
+      const float tfar = (far_plane - org_far[k]) * inv_dir[k] * kMaxMult;
 
-    T U = Cx * By - Cy * Bx;
-    T V = Ax * Cy - Ay * Cx;
-    T W = Bx * Ay - By * Ax;
+      tmin = safemax(tnear, tmin);
+      tmax = safemin(tfar, tmax);
+    }
 
-#ifdef __clang__
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wfloat-equal"
-#endif
+    if (tmin <= tmax) {
+      (*tminOut) = tmin;
+      (*tmaxOut) = tmax;
 
-    // Fall back to test against edges using double precision.
-    if (U == static_cast<T>(0.0) || V == static_cast<T>(0.0) ||
-        W == static_cast<T>(0.0)) {
-      double CxBy = static_cast<double>(Cx) * static_cast<double>(By);
-      double CyBx = static_cast<double>(Cy) * static_cast<double>(Bx);
-      U = static_cast<T>(CxBy - CyBx);
+      return true;
+    }
+    return false;  // no hit
+  }
 
-      double AxCy = static_cast<double>(Ax) * static_cast<double>(Cy);
-      double AyCx = static_cast<double>(Ay) * static_cast<double>(Cx);
-      V = static_cast<T>(AxCy - AyCx);
+  float org_near[3];
+  float org_far[3];
+  float inv_dir[3];
+  int dir_sign[3];
+};
 
-      double BxAy = static_cast<double>(Bx) * static_cast<double>(Ay);
-      double ByAx = static_cast<double>(By) * static_cast<double>(Ax);
-      W = static_cast<T>(BxAy - ByAx);
-    }
+template <typename T, class A, typename NodeT>
+template <class I, class F>
+inline bool BVHAccel<T, A, NodeT>::TestLeafNode(const Node &node,
+                                                const Ray<T> &ray,
+                                                const I &intersector,
+                                                const F &filter,
+                                                PrimitiveLeafTest) const {
+  bool hit = false;
 
-    if (U < static_cast<T>(0.0) || V < static_cast<T>(0.0) ||
-        W < static_cast<T>(0.0)) {
-      if (trace_options_.cull_back_face ||
-          (U > static_cast<T>(0.0) || V > static_cast<T>(0.0) ||
-           W > static_cast<T>(0.0))) {
-        return false;
-      }
-    }
+  unsigned int num_primitives = node.data[0];
+  unsigned int offset = node.data[1];
 
-    T det = U + V + W;
-    if (det == static_cast<T>(0.0)) return false;
+  T t = intersector.GetT();  // current hit distance
 
-#ifdef __clang__
-#pragma clang diagnostic pop
-#endif
+  // Primitives whose visibility mask does not intersect the ray type are
+  // skipped.
+  const unsigned int ray_mask = prim_masks_.empty() ? 0u : ray.type;
 
-    const T Az = ray_coeff_.Sz * A[ray_coeff_.kz];
-    const T Bz = ray_coeff_.Sz * B[ray_coeff_.kz];
-    const T Cz = ray_coeff_.Sz * C[ray_coeff_.kz];
-    const T D = U * Az + V * Bz + W * Cz;
+  real3<T> ray_org;
+  ray_org[0] = ray.org[0];
+  ray_org[1] = ray.org[1];
+  ray_org[2] = ray.org[2];
 
-    const T rcpDet = static_cast<T>(1.0) / det;
-    T tt = D * rcpDet;
+  real3<T> ray_dir;
+  ray_dir[0] = ray.dir[0];
+  ray_dir[1] = ray.dir[1];
+  ray_dir[2] = ray.dir[2];
 
-    if (tt > (*t_inout)) {
-      return false;
+  for (unsigned int i = 0; i < num_primitives; i++) {
+    if (ray_mask && !(prim_masks_[i + offset] & ray_mask)) {
+      continue;
     }
 
-    if (tt < t_min_) {
-      return false;
-    }
+    unsigned int prim_idx = indices_[i + offset];
 
-    (*t_inout) = tt;
-    // Use Möller-Trumbore style barycentric coordinates
-    // U + V + W = 1.0 and interp(p) = U * p0 + V * p1 + W * p2
-    // We want interp(p) = (1 - u - v) * p0 + u * v1 + v * p2;
-    // => u = V, v = W.
-    u_ = V * rcpDet;
-    v_ = W * rcpDet;
+    T local_t = t;
+    if (intersector.Intersect(&local_t, prim_idx) &&
+        filter(ray, intersector, local_t, prim_idx)) {
+      // Update isect state
+      t = local_t;
 
-    return true;
+      intersector.Update(t, prim_idx);
+      hit = true;
+    }
   }
 
-  /// Returns the nearest hit distance.
-  T GetT() const { return t_; }
+  return hit;
+}
 
-  /// Update is called when initializing intersection and nearest hit is found.
-  void Update(T t, unsigned int prim_idx) const {
-    t_ = t;
-    prim_id_ = prim_idx;
+template <typename T, class A, typename NodeT>
+template <class I, class F>
+inline bool BVHAccel<T, A, NodeT>::TestLeafNode(const Node &node,
+                                                const Ray<T> &ray,
+                                                const I &intersector,
+                                                const F &filter,
+                                                SIMDLeafTest) const {
+  // Filter needs each candidate, and masks each primitive.
+  if (!IsNoIntersectionFilter(filter) ||
+      (!prim_masks_.empty() && (ray.type != RAY_TYPE_NONE))) {
+    return TestLeafNode(node, ray, intersector, filter, PrimitiveLeafTest());
   }
 
-  /// Prepare BVH traversal (e.g. compute inverse ray direction)
-  /// This function is called only once in BVH traversal.
-  void PrepareTraversal(const Ray<T> &ray,
-                        const BVHTraceOptions &trace_options) const {
-    ray_org_[0] = ray.org[0];
-    ray_org_[1] = ray.org[1];
-    ray_org_[2] = ray.org[2];
+  bool hit = false;
 
-    // Calculate dimension where the ray direction is maximal.
-    ray_coeff_.kz = 0;
-    T absDir = std::fabs(ray.dir[0]);
-    if (absDir < std::fabs(ray.dir[1])) {
-      ray_coeff_.kz = 1;
-      absDir = std::fabs(ray.dir[1]);
-    }
-    if (absDir < std::fabs(ray.dir[2])) {
-      ray_coeff_.kz = 2;
-      absDir = std::fabs(ray.dir[2]);
+  const unsigned int num_primitives = node.data[0];
+  const unsigned int offset = node.data[1];
+
+  T t = intersector.GetT();  // current hit distance
+
+  for (unsigned int base = 0; base < num_primitives;
+       base += kNANORT_LEAF_SIMD_WIDTH) {
+    const unsigned int n = std::min(num_primitives - base,
+                                    unsigned(kNANORT_LEAF_SIMD_WIDTH));
+
+    T local_t = t;
+    const int lane =
+        intersector.IntersectLeaf(&local_t, &indices_[offset + base], n);
+    if (lane >= 0) {
+      // Update isect state
+      t = local_t;
+
+      intersector.Update(t, indices_[offset + base + unsigned(lane)]);
+      hit = true;
     }
+  }
+
+  return hit;
+}
 
-    ray_coeff_.kx = ray_coeff_.kz + 1;
-    if (ray_coeff_.kx == 3) ray_coeff_.kx = 0;
-    ray_coeff_.ky = ray_coeff_.kx + 1;
-    if (ray_coeff_.ky == 3) ray_coeff_.ky = 0;
+template <typename T, class A, typename NodeT>
+template <class I, class H>
+bool BVHAccel<T, A, NodeT>::MultiHitTestLeafNode(
+    BoundedMaxHeap<H, kNANORT_MAX_MULTI_HITS, HitDistanceComparator<H> >
+        *isect_heap,
+    const Node &node, const Ray<T> &ray, const I &intersector) const {
+  bool hit = false;
 
-    // Swap kx and ky dimension to preserve winding direction of triangles.
-    if (ray.dir[ray_coeff_.kz] < static_cast<T>(0.0))
-      std::swap(ray_coeff_.kx, ray_coeff_.ky);
+  unsigned int num_primitives = node.data[0];
+  unsigned int offset = node.data[1];
 
-    // Calculate shear constants.
-    ray_coeff_.Sx = ray.dir[ray_coeff_.kx] / ray.dir[ray_coeff_.kz];
-    ray_coeff_.Sy = ray.dir[ray_coeff_.ky] / ray.dir[ray_coeff_.kz];
-    ray_coeff_.Sz = static_cast<T>(1.0) / ray.dir[ray_coeff_.kz];
+  // Current furthest hit distance.
+  T t = isect_heap->full() ? isect_heap->top().t : ray.max_t;
 
-    trace_options_ = trace_options;
+  const unsigned int ray_mask = prim_masks_.empty() ? 0u : ray.type;
 
-    t_min_ = ray.min_t;
+  for (unsigned int i = 0; i < num_primitives; i++) {
+    if (ray_mask && !(prim_masks_[i + offset] & ray_mask)) {
+      continue;
+    }
 
-    u_ = static_cast<T>(0.0);
-    v_ = static_cast<T>(0.0);
-  }
+    unsigned int prim_idx = indices_[i + offset];
 
-  /// Post BVH traversal stuff.
-  /// Fill `isect` if there is a hit.
-  void PostTraversal(const Ray<T> &ray, bool hit, H *isect) const {
-    if (hit && isect) {
-      (*isect).t = t_;
-      (*isect).u = u_;
-      (*isect).v = v_;
-      (*isect).prim_id = prim_id_;
+    T local_t = t;
+    if (intersector.Intersect(&local_t, prim_idx)) {
+      // Let the intersector fill hit info for this candidate.
+      H isect;
+      intersector.Update(local_t, prim_idx);
+      intersector.PostTraversal(ray, true, &isect);
+
+      if (isect_heap->push(isect)) {
+        hit = true;
+        if (isect_heap->full()) {
+          t = isect_heap->top().t;
+        }
+      }
     }
-    (void)ray;
   }
 
- private:
-  const T *vertices_;
-  const unsigned int *faces_;
-  const size_t vertex_stride_bytes_;
+  return hit;
+}
 
-  mutable real3<T> ray_org_;
-  mutable RayCoeff ray_coeff_;
-  mutable BVHTraceOptions trace_options_;
-  mutable T t_min_;
+template <typename T, class A, typename NodeT>
+template <class I, class H>
+bool BVHAccel<T, A, NodeT>::Traverse(const Ray<T> &ray, const I &intersector,
+                                     typename I::TraceContext *ctx, H *isect,
+                                     const BVHTraceOptions &options) const {
+  const ContextIntersector<I> context_intersector(intersector, ctx);
+  return Traverse(ray, context_intersector, isect, options);
+}
 
-  mutable T t_;
-  mutable T u_;
-  mutable T v_;
-  mutable unsigned int prim_id_;
-};
+template <typename T, class A, typename NodeT>
+template <class I, class H>
+bool BVHAccel<T, A, NodeT>::Traverse(const Ray<T> &ray, const I &intersector,
+                                     H *isect,
+                                     const BVHTraceOptions &options) const {
+  return Traverse(ray, intersector, isect, options, NoIntersectionFilter());
+}
 
-//
-// Robust BVH Ray Traversal : http://jcgt.org/published/0002/02/02/paper.pdf
-//
+template <typename T, class A, typename NodeT>
+template <class I, class H, class F>
+bool BVHAccel<T, A, NodeT>::Traverse(const Ray<T> &ray, const I &intersector,
+                                     H *isect, const BVHTraceOptions &options,
+                                     const F &filter) const {
+  T hit_t = ray.max_t;
 
-// NaN-safe min and max function.
-template <class T>
-const T &safemin(const T &a, const T &b) {
-  return (a < b) ? a : b;
-}
-template <class T>
-const T &safemax(const T &a, const T &b) {
-  return (a > b) ? a : b;
-}
+  // `Build` clamps and `Load` checks the tree depth(`kNANORT_MAX_TREE_DEPTH`),
+  // so the stack never overflows.
+  int node_stack_index = 0;
+  unsigned int node_stack[kNANORT_MAX_STACK_DEPTH];
+  node_stack[0] = 0;
 
-//
-// SAH functions
-//
-struct BinBuffer {
-  explicit BinBuffer(unsigned int size) {
-    bin_size = size;
-    bin.resize(2 * 3 * size);
-    clear();
-  }
+  // Init isect info as no hit
+  intersector.Update(hit_t, static_cast<unsigned int>(-1));
 
-  void clear() { memset(&bin[0], 0, sizeof(size_t) * 2 * 3 * bin_size); }
+  intersector.PrepareTraversal(ray, options);
 
-  std::vector<size_t> bin;  // (min, max) * xyz * binsize
-  unsigned int bin_size;
-  unsigned int pad0;
-};
+  if (options.distance_ordered_traversal) {
+    TraverseDistanceOrdered(ray, intersector, options, filter);
 
-template <typename T>
-inline T CalculateSurfaceArea(const real3<T> &min, const real3<T> &max) {
-  real3<T> box = max - min;
-  return static_cast<T>(2.0) *
-         (box[0] * box[1] + box[1] * box[2] + box[2] * box[0]);
-}
+    bool hit = (intersector.GetT() < ray.max_t);
+    intersector.PostTraversal(ray, hit, isect);
 
-template <typename T>
-inline void GetBoundingBoxOfTriangle(real3<T> *bmin, real3<T> *bmax,
-                                     const T *vertices,
-                                     const unsigned int *faces,
-                                     unsigned int index) {
-  unsigned int f0 = faces[3 * index + 0];
-  unsigned int f1 = faces[3 * index + 1];
-  unsigned int f2 = faces[3 * index + 2];
+    return hit;
+  }
 
-  real3<T> p[3];
+  const NodeTraversalRay<NodeT, T> node_ray(ray);
 
-  p[0] = real3<T>(&vertices[3 * f0]);
-  p[1] = real3<T>(&vertices[3 * f1]);
-  p[2] = real3<T>(&vertices[3 * f2]);
+  const bool cull_prim_ids = IsPrimIdRangeCulled(intersector);
+  const bool cull_masks =
+      !node_masks_.empty() && (ray.type != RAY_TYPE_NONE);
+  const bool motion = !motion_nodes_.empty();
 
-  (*bmin) = p[0];
-  (*bmax) = p[0];
+  NodeT min_t = std::numeric_limits<NodeT>::max();
+  NodeT max_t = -std::numeric_limits<NodeT>::max();
 
-  for (int i = 1; i < 3; i++) {
-    (*bmin)[0] = std::min((*bmin)[0], p[i][0]);
-    (*bmin)[1] = std::min((*bmin)[1], p[i][1]);
-    (*bmin)[2] = std::min((*bmin)[2], p[i][2]);
+  Node motion_node;
 
-    (*bmax)[0] = std::max((*bmax)[0], p[i][0]);
-    (*bmax)[1] = std::max((*bmax)[1], p[i][1]);
-    (*bmax)[2] = std::max((*bmax)[2], p[i][2]);
-  }
-}
+  while (node_stack_index >= 0) {
+    unsigned int index = node_stack[node_stack_index];
+    const Node &node = nodes_[index];
 
-template <typename T, class P>
-inline void ContributeBinBuffer(BinBuffer *bins,  // [out]
-                                const real3<T> &scene_min,
-                                const real3<T> &scene_max,
-                                unsigned int *indices, unsigned int left_idx,
-                                unsigned int right_idx, const P &p) {
-  T bin_size = static_cast<T>(bins->bin_size);
+    node_stack_index--;
+
+    if (cull_prim_ids && !IsNodeInPrimIdRange(index, options)) {
+      continue;
+    }
 
-  // Calculate extent
-  real3<T> scene_size, scene_inv_size;
-  scene_size = scene_max - scene_min;
+    if (cull_masks && !(node_masks_[index] & ray.type)) {
+      continue;
+    }
 
-  for (int i = 0; i < 3; ++i) {
-    assert(scene_size[i] >= static_cast<T>(0.0));
+    if (motion) {
+      InterpolateNodeBounds(index, ray.time, &motion_node);
+    }
 
-    if (scene_size[i] > static_cast<T>(0.0)) {
-      scene_inv_size[i] = bin_size / scene_size[i];
-    } else {
-      scene_inv_size[i] = static_cast<T>(0.0);
+    bool hit = node_ray.Intersect(&min_t, &max_t, ray.min_t, hit_t,
+                                  motion ? motion_node : node);
+
+    if (hit) {
+      // Branch node
+      if (node.flag == 0) {
+        int order_near = node_ray.dir_sign[node.axis];
+        int order_far = 1 - order_near;
+
+        // Traverse near first.
+        node_stack[++node_stack_index] = node.data[order_far];
+        node_stack[++node_stack_index] = node.data[order_near];
+      } else if (TestLeafNode(node, ray, intersector, filter)) {  // Leaf node
+        hit_t = intersector.GetT();
+      }
     }
   }
 
-  // Clear bin data
-  std::fill(bins->bin.begin(), bins->bin.end(), 0);
-  // memset(&bins->bin[0], 0, sizeof(2 * 3 * bins->bin_size));
+  bool hit = (intersector.GetT() < ray.max_t);
+  intersector.PostTraversal(ray, hit, isect);
 
-  size_t idx_bmin[3];
-  size_t idx_bmax[3];
+  return hit;
+}
 
-  for (size_t i = left_idx; i < right_idx; i++) {
-    //
-    // Quantize the position into [0, BIN_SIZE)
-    //
-    // q[i] = (int)(p[i] - scene_bmin) / scene_size
-    //
-    real3<T> bmin;
-    real3<T> bmax;
+template <typename T, class A, typename NodeT>
+void BVHAccel<T, A, NodeT>::BuildParentLinks() {
+  parents_.assign(nodes_.size(), 0);
 
-    p.BoundingBox(&bmin, &bmax, indices[i]);
-    // GetBoundingBoxOfTriangle(&bmin, &bmax, vertices, faces, indices[i]);
+  for (size_t i = 0; i < nodes_.size(); i++) {
+    if (nodes_[i].flag == 0) {  // branch
+      parents_[nodes_[i].data[0]] = static_cast<unsigned int>(i);
+      parents_[nodes_[i].data[1]] = static_cast<unsigned int>(i);
+    }
+  }
+}
 
-    real3<T> quantized_bmin = (bmin - scene_min) * scene_inv_size;
-    real3<T> quantized_bmax = (bmax - scene_min) * scene_inv_size;
+template <typename T, class A, typename NodeT>
+void BVHAccel<T, A, NodeT>::BuildPrimIdRanges() {
+  prim_id_ranges_.assign(2 * nodes_.size(), 0);
+
+  // Child node index is always larger than its parent's, so ranges are
+  // propagated bottom-up in a single backward pass.
+  for (size_t i = nodes_.size(); i-- > 0;) {
+    const Node &node = nodes_[i];
+    unsigned int min_id = std::numeric_limits<unsigned int>::max();
+    unsigned int max_id = 0;
+
+    if (node.flag == 0) {  // branch
+      for (int c = 0; c < 2; c++) {
+        const size_t child = node.data[c];
+        min_id = std::min(min_id, prim_id_ranges_[2 * child + 0]);
+        max_id = std::max(max_id, prim_id_ranges_[2 * child + 1]);
+      }
+    } else {  // leaf
+      const unsigned int num_primitives = node.data[0];
+      const unsigned int offset = node.data[1];
+      for (unsigned int j = 0; j < num_primitives; j++) {
+        min_id = std::min(min_id, indices_[offset + j]);
+        max_id = std::max(max_id, indices_[offset + j]);
+      }
+    }
 
-    // idx is now in [0, BIN_SIZE)
-    for (int j = 0; j < 3; ++j) {
-      int q0 = static_cast<int>(quantized_bmin[j]);
-      if (q0 < 0) q0 = 0;
-      int q1 = static_cast<int>(quantized_bmax[j]);
-      if (q1 < 0) q1 = 0;
+    prim_id_ranges_[2 * i + 0] = min_id;
+    prim_id_ranges_[2 * i + 1] = max_id;
+  }
+}
 
-      idx_bmin[j] = static_cast<unsigned int>(q0);
-      idx_bmax[j] = static_cast<unsigned int>(q1);
+template <typename T, class A, typename NodeT>
+void BVHAccel<T, A, NodeT>::SetPrimitiveMasks(const unsigned int *masks) {
+  if (!masks) {
+    node_masks_.clear();
+    prim_masks_.clear();
+    return;
+  }
 
-      if (idx_bmin[j] >= bin_size)
-        idx_bmin[j] = static_cast<unsigned int>(bin_size) - 1;
+  // Stored in `indices_` order so that leaf test reads them sequentially.
+  prim_masks_.resize(indices_.size());
+  for (size_t i = 0; i < indices_.size(); i++) {
+    prim_masks_[i] = masks[indices_[i]];
+  }
 
-      if (idx_bmax[j] >= bin_size)
-        idx_bmax[j] = static_cast<unsigned int>(bin_size) - 1;
+  node_masks_.assign(nodes_.size(), 0);
 
-      // Increment bin counter
-      bins->bin[0 * (bins->bin_size * 3) +
-                static_cast<size_t>(j) * bins->bin_size + idx_bmin[j]] += 1;
-      bins->bin[1 * (bins->bin_size * 3) +
-                static_cast<size_t>(j) * bins->bin_size + idx_bmax[j]] += 1;
+  // Bottom-up in a single backward pass(see `BuildPrimIdRanges`).
+  for (size_t i = nodes_.size(); i-- > 0;) {
+    const Node &node = nodes_[i];
+    unsigned int mask = 0;
+
+    if (node.flag == 0) {  // branch
+      mask = node_masks_[node.data[0]] | node_masks_[node.data[1]];
+    } else {  // leaf
+      const unsigned int num_primitives = node.data[0];
+      const unsigned int offset = node.data[1];
+      for (unsigned int j = 0; j < num_primitives; j++) {
+        mask |= prim_masks_[offset + j];
+      }
     }
+
+    node_masks_[i] = mask;
   }
 }
 
-template <typename T>
-inline T SAH(size_t ns1, T leftArea, size_t ns2, T rightArea, T invS, T Taabb,
-             T Ttri) {
-  T sah;
+template <typename T, class A, typename NodeT>
+template <class Prim, class Pred>
+bool BVHAccel<T, A, NodeT>::BuildMotionBlur(unsigned int num_primitives,
+                                            const Prim &p, const Pred &pred,
+                                            const BVHBuildOptions<T> &options) {
+  if (!Build(num_primitives, p, pred, options)) {
+    return false;
+  }
 
-  sah = static_cast<T>(2.0) * Taabb +
-        (leftArea * invS) * static_cast<T>(ns1) * Ttri +
-        (rightArea * invS) * static_cast<T>(ns2) * Ttri;
+  BuildMotionBounds(p);
 
-  return sah;
+  return true;
 }
 
-template <typename T>
-inline bool FindCutFromBinBuffer(T *cut_pos,        // [out] xyz
-                                 int *minCostAxis,  // [out]
-                                 const BinBuffer *bins, const real3<T> &bmin,
-                                 const real3<T> &bmax, size_t num_primitives,
-                                 T costTaabb) {      // should be in [0.0, 1.0]
-  const T kEPS = std::numeric_limits<T>::epsilon();  // * epsScale;
+template <typename T, class A, typename NodeT>
+template <class Prim>
+void BVHAccel<T, A, NodeT>::BuildMotionBounds(const Prim &p) {
+  motion_nodes_.resize(2 * nodes_.size());
 
-  size_t left, right;
-  real3<T> bsize, bstep;
-  real3<T> bminLeft, bmaxLeft;
-  real3<T> bminRight, bmaxRight;
-  T saLeft, saRight, saTotal;
-  T pos;
-  T minCost[3];
+  // Bottom-up in a single backward pass(see `BuildPrimIdRanges`).
+  for (size_t i = nodes_.size(); i-- > 0;) {
+    const Node &node = nodes_[i];
 
-  T costTtri = static_cast<T>(1.0) - costTaabb;
+    for (int key = 0; key < 2; key++) {
+      Node *motion_node = &motion_nodes_[2 * i + size_t(key)];
 
-  (*minCostAxis) = 0;
+      if (node.flag == 0) {  // branch
+        const Node &left = motion_nodes_[2 * node.data[0] + unsigned(key)];
+        const Node &right = motion_nodes_[2 * node.data[1] + unsigned(key)];
+        for (int k = 0; k < 3; k++) {
+          motion_node->bmin[k] = std::min(left.bmin[k], right.bmin[k]);
+          motion_node->bmax[k] = std::max(left.bmax[k], right.bmax[k]);
+        }
+      } else {  // leaf
+        const unsigned int num_primitives = node.data[0];
+        const unsigned int offset = node.data[1];
+
+        real3<T> bmin(std::numeric_limits<T>::max());
+        real3<T> bmax(-std::numeric_limits<T>::max());
+        for (unsigned int j = 0; j < num_primitives; j++) {
+          real3<T> prim_bmin, prim_bmax;
+          p.MotionBoundingBox(&prim_bmin, &prim_bmax, indices_[offset + j],
+                              key);
+          for (int k = 0; k < 3; k++) {
+            bmin[k] = std::min(bmin[k], prim_bmin[k]);
+            bmax[k] = std::max(bmax[k], prim_bmax[k]);
+          }
+        }
+        SetNodeBounds(motion_node, bmin, bmax);
+      }
+    }
+  }
+}
 
-  bsize = bmax - bmin;
-  bstep = bsize * (static_cast<T>(1.0) / bins->bin_size);
-  saTotal = CalculateSurfaceArea(bmin, bmax);
+template <typename T, class A, typename NodeT>
+unsigned int BVHAccel<T, A, NodeT>::ComputeTreeDepth() const {
+  // Child node index is always larger than its parent's, so depth is
+  // propagated in a single forward pass.
+  std::vector<unsigned int> depth(nodes_.size(), 0);
+  unsigned int max_depth = 0;
 
-  T invSaTotal = static_cast<T>(0.0);
-  if (saTotal > kEPS) {
-    invSaTotal = static_cast<T>(1.0) / saTotal;
+  for (size_t i = 0; i < nodes_.size(); i++) {
+    max_depth = std::max(max_depth, depth[i]);
+    if (nodes_[i].flag == 0) {  // branch
+      for (int c = 0; c < 2; c++) {
+        const size_t child = nodes_[i].data[c];
+        if ((child <= i) || (child >= nodes_.size())) {
+          return std::numeric_limits<unsigned int>::max();  // corrupted
+        }
+        depth[child] = depth[i] + 1;
+      }
+    }
   }
 
-  for (int j = 0; j < 3; ++j) {
-    //
-    // Compute SAH cost for the right side of each cell of the bbox.
-    // Exclude both extreme sides of the bbox.
-    //
-    //  i:      0    1    2    3
-    //     +----+----+----+----+----+
-    //     |    |    |    |    |    |
-    //     +----+----+----+----+----+
-    //
+  return max_depth;
+}
 
-    T minCostPos = bmin[j] + static_cast<T>(1.0) * bstep[j];
-    minCost[j] = std::numeric_limits<T>::max();
+template <typename T, class A, typename NodeT>
+template <class I, class H>
+bool BVHAccel<T, A, NodeT>::TraverseStackless(
+    const Ray<T> &ray, const I &intersector, H *isect,
+    const BVHTraceOptions &options) const {
+  if (parents_.size() != nodes_.size()) {
+    return Traverse(ray, intersector, isect, options);
+  }
 
-    left = 0;
-    right = num_primitives;
-    bminLeft = bminRight = bmin;
-    bmaxLeft = bmaxRight = bmax;
+  T hit_t = ray.max_t;
 
-    for (int i = 0; i < static_cast<int>(bins->bin_size) - 1; ++i) {
-      left += bins->bin[0 * (3 * bins->bin_size) +
-                        static_cast<size_t>(j) * bins->bin_size +
-                        static_cast<size_t>(i)];
-      right -= bins->bin[1 * (3 * bins->bin_size) +
-                         static_cast<size_t>(j) * bins->bin_size +
-                         static_cast<size_t>(i)];
+  // Init isect info as no hit
+  intersector.Update(hit_t, static_cast<unsigned int>(-1));
 
-      assert(left <= num_primitives);
-      assert(right <= num_primitives);
+  intersector.PrepareTraversal(ray, options);
 
-      //
-      // Split pos bmin + (i + 1) * (bsize / BIN_SIZE)
-      // +1 for i since we want a position on right side of the cell.
-      //
+  const NodeTraversalRay<NodeT, T> node_ray(ray);
 
-      pos = bmin[j] + (i + static_cast<T>(1.0)) * bstep[j];
-      bmaxLeft[j] = pos;
-      bminRight[j] = pos;
+  NodeT min_t, max_t;
 
-      saLeft = CalculateSurfaceArea(bminLeft, bmaxLeft);
-      saRight = CalculateSurfaceArea(bminRight, bmaxRight);
+  // Efficient Stack-less BVH Traversal for Ray Tracing(Hapala et al. 2011)
+  enum { kFromParent, kFromSibling, kFromChild };
 
-      T cost =
-          SAH(left, saLeft, right, saRight, invSaTotal, costTaabb, costTtri);
+  unsigned int current = 0;
+  int state = kFromChild;
 
-      if (cost < minCost[j]) {
-        //
-        // Update the min cost
-        //
-        minCost[j] = cost;
-        minCostPos = pos;
-        // minCostAxis = j;
-      }
+  if (node_ray.Intersect(&min_t, &max_t, ray.min_t, hit_t, nodes_[0])) {
+    if (nodes_[0].flag == 0) {
+      current = nodes_[0].data[node_ray.dir_sign[nodes_[0].axis]];
+      state = kFromParent;
+    } else if (TestLeafNode(nodes_[0], ray, intersector,
+                            NoIntersectionFilter())) {
+      hit_t = intersector.GetT();
     }
-
-    cut_pos[j] = minCostPos;
   }
 
-  // cut_axis = minCostAxis;
-  // cut_pos = minCostPos;
+  while (current != 0 || state != kFromChild) {
+    if (state == kFromChild) {
+      // Go to the far sibling if we came up from the near child, otherwise
+      // continue going up.
+      const unsigned int parent = parents_[current];
+      const Node &parent_node = nodes_[parent];
+      const int order_near = node_ray.dir_sign[parent_node.axis];
+      if (current == parent_node.data[order_near]) {
+        current = parent_node.data[1 - order_near];
+        state = kFromSibling;
+      } else {
+        current = parent;
+      }
+      continue;
+    }
 
-  // Find min cost axis
-  T cost = minCost[0];
-  (*minCostAxis) = 0;
+    // kFromParent(near child) or kFromSibling(far child)
+    const Node &node = nodes_[current];
+    bool go_down = false;
 
-  if (cost > minCost[1]) {
-    (*minCostAxis) = 1;
-    cost = minCost[1];
-  }
-  if (cost > minCost[2]) {
-    (*minCostAxis) = 2;
-    cost = minCost[2];
+    if (node_ray.Intersect(&min_t, &max_t, ray.min_t, hit_t, node)) {
+      if (node.flag == 0) {  // Branch node
+        go_down = true;
+      } else if (TestLeafNode(node, ray, intersector,
+                              NoIntersectionFilter())) {  // Leaf node
+        hit_t = intersector.GetT();
+      }
+    }
+
+    if (go_down) {
+      // Traverse near first.
+      current = node.data[node_ray.dir_sign[node.axis]];
+      state = kFromParent;
+    } else if (state == kFromParent) {
+      // Visit the far sibling.
+      const Node &parent_node = nodes_[parents_[current]];
+      current = parent_node.data[1 - node_ray.dir_sign[parent_node.axis]];
+      state = kFromSibling;
+    } else {
+      current = parents_[current];
+      state = kFromChild;
+    }
   }
 
-  return true;
+  bool hit = (intersector.GetT() < ray.max_t);
+  intersector.PostTraversal(ray, hit, isect);
+
+  return hit;
 }
 
-#ifdef _OPENMP
-template <typename T, class P>
-void ComputeBoundingBoxOMP(real3<T> *bmin, real3<T> *bmax,
-                           const unsigned int *indices, unsigned int left_index,
-                           unsigned int right_index, const P &p) {
-  { p.BoundingBox(bmin, bmax, indices[left_index]); }
+template <typename T, class A, typename NodeT>
+template <class I, class F>
+void BVHAccel<T, A, NodeT>::TraverseDistanceOrdered(
+    const Ray<T> &ray, const I &intersector, const BVHTraceOptions &options,
+    const F &filter) const {
+  T hit_t = ray.max_t;
 
-  T local_bmin[3] = {(*bmin)[0], (*bmin)[1], (*bmin)[2]};
-  T local_bmax[3] = {(*bmax)[0], (*bmax)[1], (*bmax)[2]};
+  const NodeTraversalRay<NodeT, T> node_ray(ray);
 
-  unsigned int n = right_index - left_index;
+  const bool cull_prim_ids = IsPrimIdRangeCulled(intersector);
+  const bool cull_masks =
+      !node_masks_.empty() && (ray.type != RAY_TYPE_NONE);
+  const bool motion = !motion_nodes_.empty();
 
-#pragma omp parallel firstprivate(local_bmin, local_bmax) if (n > (1024 * 128))
-  {
-#pragma omp parallel for
-    // for each face
-    for (int i = int(left_index); i < int(right_index); i++) {
-      unsigned int idx = indices[i];
+  Node motion_node;
 
-      real3<T> bbox_min, bbox_max;
+  if (motion) {
+    InterpolateNodeBounds(0, ray.time, &motion_node);
+  }
 
-      p.BoundingBox(&bbox_min, &bbox_max, idx);
+  NodeT min_t, max_t;
+  if (!node_ray.Intersect(&min_t, &max_t, ray.min_t, hit_t,
+                          motion ? motion_node : nodes_[0])) {
+    return;
+  }
 
-      // xyz
-      for (int k = 0; k < 3; k++) {
-        (*bmin)[k] = std::min((*bmin)[k], bbox_min[k]);
-        (*bmax)[k] = std::max((*bmax)[k], bbox_max[k]);
-      }
+  // Node index and its ray entry distance.
+  int node_stack_index = 0;
+  unsigned int node_stack[kNANORT_MAX_STACK_DEPTH];
+  NodeT entry_stack[kNANORT_MAX_STACK_DEPTH];
+  node_stack[0] = 0;
+  entry_stack[0] = min_t;
+
+  while (node_stack_index >= 0) {
+    unsigned int index = node_stack[node_stack_index];
+    const T entry_t = static_cast<T>(entry_stack[node_stack_index]);
+
+    node_stack_index--;
+
+    // Closer hit was found after this node was pushed.
+    if (entry_t > hit_t) {
+      continue;
     }
 
-#pragma omp critical
-    {
-      for (int k = 0; k < 3; k++) {
-        (*bmin)[k] = std::min((*bmin)[k], local_bmin[k]);
-        (*bmax)[k] = std::max((*bmax)[k], local_bmax[k]);
-      }
+    if (cull_prim_ids && !IsNodeInPrimIdRange(index, options)) {
+      continue;
     }
-  }
-}
-#endif
 
-#ifdef NANORT_USE_CPP11_FEATURE
-template <typename T, class P>
-inline void ComputeBoundingBoxThreaded(real3<T> *bmin, real3<T> *bmax,
-                                       const unsigned int *indices,
-                                       unsigned int left_index,
-                                       unsigned int right_index, const P &p) {
-  unsigned int n = right_index - left_index;
+    if (cull_masks && !(node_masks_[index] & ray.type)) {
+      continue;
+    }
 
-  size_t num_threads = std::min(
-      size_t(kNANORT_MAX_THREADS),
-      std::max(size_t(1), size_t(std::thread::hardware_concurrency())));
+    const Node &node = nodes_[index];
+
+    // Branch node
+    if (node.flag == 0) {
+      NodeT child_min_t[2];
+      bool child_hit[2];
+      for (int c = 0; c < 2; c++) {
+        if (motion) {
+          InterpolateNodeBounds(node.data[c], ray.time, &motion_node);
+        }
+        child_hit[c] = node_ray.Intersect(
+            &child_min_t[c], &max_t, ray.min_t, hit_t,
+            motion ? motion_node : nodes_[node.data[c]]);
+      }
+
+      if (child_hit[0] && child_hit[1]) {
+        const int order_near = (child_min_t[1] < child_min_t[0]) ? 1 : 0;
+        const int order_far = 1 - order_near;
 
-  if (n < num_threads) {
-    num_threads = n;
+        // Traverse near first.
+        ++node_stack_index;
+        node_stack[node_stack_index] = node.data[order_far];
+        entry_stack[node_stack_index] = child_min_t[order_far];
+        ++node_stack_index;
+        node_stack[node_stack_index] = node.data[order_near];
+        entry_stack[node_stack_index] = child_min_t[order_near];
+      } else if (child_hit[0] || child_hit[1]) {
+        const int c = child_hit[0] ? 0 : 1;
+        ++node_stack_index;
+        node_stack[node_stack_index] = node.data[c];
+        entry_stack[node_stack_index] = child_min_t[c];
+      }
+    } else if (TestLeafNode(node, ray, intersector, filter)) {  // Leaf node
+      hit_t = intersector.GetT();
+    }
   }
+}
 
-  std::vector<std::thread> workers;
+template <typename T, class A, typename NodeT>
+template <class I>
+bool BVHAccel<T, A, NodeT>::Occluded(const Ray<T> &ray, const I &intersector,
+                                     const BVHTraceOptions &options) const {
+  return Occluded(ray, intersector, options, NoIntersectionFilter());
+}
 
-  size_t ndiv = n / num_threads;
+template <typename T, class A, typename NodeT>
+template <class I, class F>
+bool BVHAccel<T, A, NodeT>::Occluded(const Ray<T> &ray, const I &intersector,
+                                     const BVHTraceOptions &options,
+                                     const F &filter) const {
+  int node_stack_index = 0;
+  unsigned int node_stack[kNANORT_MAX_STACK_DEPTH];
+  node_stack[0] = 0;
 
-  std::vector<T> local_bmins(3 * num_threads);  // 3 = xyz
-  std::vector<T> local_bmaxs(3 * num_threads);  // 3 = xyz
+  intersector.Update(ray.max_t, static_cast<unsigned int>(-1));
 
-  for (size_t t = 0; t < num_threads; t++) {
-    workers.emplace_back(std::thread([&, t]() {
-      size_t si = left_index + t * ndiv;
-      size_t ei = (t == (num_threads - 1)) ? size_t(right_index) : std::min(left_index + (t + 1) * ndiv, size_t(right_index));
+  intersector.PrepareTraversal(ray, options);
 
-      local_bmins[3 * t + 0] = std::numeric_limits<T>::infinity();
-      local_bmins[3 * t + 1] = std::numeric_limits<T>::infinity();
-      local_bmins[3 * t + 2] = std::numeric_limits<T>::infinity();
-      local_bmaxs[3 * t + 0] = -std::numeric_limits<T>::infinity();
-      local_bmaxs[3 * t + 1] = -std::numeric_limits<T>::infinity();
-      local_bmaxs[3 * t + 2] = -std::numeric_limits<T>::infinity();
+  const NodeTraversalRay<NodeT, T> node_ray(ray);
 
-      // for each face
-      for (size_t i = si; i < ei; i++) {
-        unsigned int idx = indices[i];
+  const bool cull_prim_ids = IsPrimIdRangeCulled(intersector);
+  const bool cull_masks =
+      !node_masks_.empty() && (ray.type != RAY_TYPE_NONE);
+  const bool motion = !motion_nodes_.empty();
 
-        real3<T> bbox_min, bbox_max;
-        p.BoundingBox(&bbox_min, &bbox_max, idx);
+  NodeT min_t = std::numeric_limits<NodeT>::max();
+  NodeT max_t = -std::numeric_limits<NodeT>::max();
 
-        // xyz
-        for (size_t k = 0; k < 3; k++) {
-          local_bmins[3 * t + k] =
-              std::min(local_bmins[3 * t + k], bbox_min[int(k)]);
-          local_bmaxs[3 * t + k] =
-              std::max(local_bmaxs[3 * t + k], bbox_max[int(k)]);
-        }
-      }
-    }));
-  }
+  Node motion_node;
 
-  for (auto &t : workers) {
-    t.join();
-  }
+  while (node_stack_index >= 0) {
+    unsigned int index = node_stack[node_stack_index];
+    const Node &node = nodes_[index];
 
-  // merge bbox
-  for (size_t k = 0; k < 3; k++) {
-    (*bmin)[int(k)] = local_bmins[k];
-    (*bmax)[int(k)] = local_bmaxs[k];
-  }
+    node_stack_index--;
 
-  for (size_t t = 1; t < num_threads; t++) {
-    for (size_t k = 0; k < 3; k++) {
-      (*bmin)[int(k)] = std::min((*bmin)[int(k)], local_bmins[3 * t + k]);
-      (*bmax)[int(k)] = std::max((*bmax)[int(k)], local_bmaxs[3 * t + k]);
+    if (cull_prim_ids && !IsNodeInPrimIdRange(index, options)) {
+      continue;
     }
-  }
-}
-#endif
 
-template <typename T, class P>
-inline void ComputeBoundingBox(real3<T> *bmin, real3<T> *bmax,
-                               const unsigned int *indices,
-                               unsigned int left_index,
-                               unsigned int right_index, const P &p) {
-  unsigned int idx = indices[left_index];
-  p.BoundingBox(bmin, bmax, idx);
+    if (cull_masks && !(node_masks_[index] & ray.type)) {
+      continue;
+    }
 
-  {
-    // for each primitive
-    for (unsigned int i = left_index + 1; i < right_index; i++) {
-      idx = indices[i];
-      real3<T> bbox_min, bbox_max;
-      p.BoundingBox(&bbox_min, &bbox_max, idx);
+    if (motion) {
+      InterpolateNodeBounds(index, ray.time, &motion_node);
+    }
 
-      // xyz
-      for (int k = 0; k < 3; k++) {
-        (*bmin)[k] = std::min((*bmin)[k], bbox_min[k]);
-        (*bmax)[k] = std::max((*bmax)[k], bbox_max[k]);
+    bool hit = node_ray.Intersect(&min_t, &max_t, ray.min_t, ray.max_t,
+                                  motion ? motion_node : node);
+
+    if (hit) {
+      // Branch node. Any hit is enough, so children are not ordered.
+      if (node.flag == 0) {
+        node_stack[++node_stack_index] = node.data[1];
+        node_stack[++node_stack_index] = node.data[0];
+      } else {  // Leaf node
+        unsigned int num_primitives = node.data[0];
+        unsigned int offset = node.data[1];
+
+        for (unsigned int i = 0; i < num_primitives; i++) {
+          if (cull_masks && !(prim_masks_[i + offset] & ray.type)) {
+            continue;
+          }
+
+          unsigned int prim_idx = indices_[i + offset];
+
+          T local_t = ray.max_t;
+          if (intersector.Intersect(&local_t, prim_idx) &&
+              filter(ray, intersector, local_t, prim_idx)) {
+            intersector.Update(local_t, prim_idx);
+            return true;
+          }
+        }
       }
     }
   }
-}
 
-template <typename T>
-inline void GetBoundingBox(real3<T> *bmin, real3<T> *bmax,
-                           const std::vector<BBox<T> > &bboxes,
-                           unsigned int *indices, unsigned int left_index,
-                           unsigned int right_index) {
-  unsigned int i = left_index;
-  unsigned int idx = indices[i];
-
-  (*bmin)[0] = bboxes[idx].bmin[0];
-  (*bmin)[1] = bboxes[idx].bmin[1];
-  (*bmin)[2] = bboxes[idx].bmin[2];
-  (*bmax)[0] = bboxes[idx].bmax[0];
-  (*bmax)[1] = bboxes[idx].bmax[1];
-  (*bmax)[2] = bboxes[idx].bmax[2];
+  return false;
+}
 
-  // for each face
-  for (i = left_index + 1; i < right_index; i++) {
-    idx = indices[i];
+template <typename T, class A, typename NodeT>
+template <class I>
+bool BVHAccel<T, A, NodeT>::Occluded(const Ray<T> &ray, const I &intersector,
+                                     typename I::TraceContext *ctx,
+                                     const BVHTraceOptions &options) const {
+  const ContextIntersector<I> context_intersector(intersector, ctx);
+  return Occluded(ray, context_intersector, options);
+}
 
-    // xyz
-    for (int k = 0; k < 3; k++) {
-      (*bmin)[k] = std::min((*bmin)[k], bboxes[idx].bmin[k]);
-      (*bmax)[k] = std::max((*bmax)[k], bboxes[idx].bmax[k]);
+template <typename T, class A, typename NodeT>
+template <int N>
+inline unsigned int BVHAccel<T, A, NodeT>::TestPacketNode(
+    unsigned int index, const RayPacket<T, N> &packet, const T inv_dir[3][N],
+    const int dir_sign[3][N], const T hit_t[N], unsigned int lane_mask) const {
+  const T kMaxMult = RobustTraversalMaxMult<T>();
+
+  if (!node_masks_.empty()) {
+    lane_mask = PacketVisibleLanes(packet, node_masks_[index], lane_mask);
+    if (lane_mask == 0) {
+      return 0;
     }
   }
-}
 
-//
-// --
-//
+  const Node &node = nodes_[index];
 
-#if defined(NANORT_ENABLE_PARALLEL_BUILD)
-template <typename T>
-template <class P, class Pred>
-unsigned int BVHAccel<T>::BuildShallowTree(std::vector<BVHNode<T> > *out_nodes,
-                                           unsigned int left_idx,
-                                           unsigned int right_idx,
-                                           unsigned int depth,
-                                           unsigned int max_shallow_depth,
-                                           const P &p, const Pred &pred) {
-  assert(left_idx <= right_idx);
+  // Node bounds in ray precision(exact when node precision is lower).
+  const T bmin[3] = {static_cast<T>(node.bmin[0]), static_cast<T>(node.bmin[1]),
+                     static_cast<T>(node.bmin[2])};
+  const T bmax[3] = {static_cast<T>(node.bmax[0]), static_cast<T>(node.bmax[1]),
+                     static_cast<T>(node.bmax[2])};
 
-  unsigned int offset = static_cast<unsigned int>(out_nodes->size());
+  // Branchless over lanes so that the loop can be vectorized.
+  unsigned int hit_mask = 0;
+  for (int i = 0; i < N; i++) {
+    T tmin = packet.min_t[i];
+    T tmax = hit_t[i];
 
-  if (stats_.max_tree_depth < depth) {
-    stats_.max_tree_depth = depth;
-  }
+    for (int k = 0; k < 3; k++) {
+      const T near_plane = dir_sign[k][i] ? bmax[k] : bmin[k];
+      const T far_plane = dir_sign[k][i] ? bmin[k] : bmax[k];
 
-  real3<T> bmin, bmax;
+      const T tnear = (near_plane - packet.org[k][i]) * inv_dir[k][i];
+      const T tfar = (far_plane - packet.org[k][i]) * inv_dir[k][i] * kMaxMult;
 
-#if defined(NANORT_USE_CPP11_FEATURE) && defined(NANORT_ENABLE_PARALLEL_BUILD)
-  ComputeBoundingBoxThreaded(&bmin, &bmax, &indices_.at(0), left_idx, right_idx,
-                             p);
-#else
-  ComputeBoundingBox(&bmin, &bmax, &indices_.at(0), left_idx, right_idx, p);
-#endif
+      tmin = safemax(tnear, tmin);
+      tmax = safemin(tfar, tmax);
+    }
 
-  unsigned int n = right_idx - left_idx;
-  if ((n <= options_.min_leaf_primitives) ||
-      (depth >= options_.max_tree_depth)) {
-    // Create leaf node.
-    BVHNode<T> leaf;
+    hit_mask |= (tmin <= tmax) ? (1u << i) : 0u;
+  }
 
-    leaf.bmin[0] = bmin[0];
-    leaf.bmin[1] = bmin[1];
-    leaf.bmin[2] = bmin[2];
+  return hit_mask & lane_mask;
+}
 
-    leaf.bmax[0] = bmax[0];
-    leaf.bmax[1] = bmax[1];
-    leaf.bmax[2] = bmax[2];
+template <typename T, class A, typename NodeT>
+template <int N, class I>
+bool BVHAccel<T, A, NodeT>::TraversePacketLane(unsigned int root,
+                                               const RayPacket<T, N> &packet,
+                                               int lane, const I &intersector,
+                                               T *hit_t, bool any_hit) const {
+  const Ray<T> ray = packet.GetRay(lane);
 
-    assert(left_idx < std::numeric_limits<unsigned int>::max());
+  int node_stack_index = 0;
+  unsigned int node_stack[kNANORT_MAX_STACK_DEPTH];
+  node_stack[0] = root;
 
-    leaf.flag = 1;  // leaf
-    leaf.data[0] = n;
-    leaf.data[1] = left_idx;
+  const NodeTraversalRay<NodeT, T> node_ray(ray);
 
-    out_nodes->push_back(leaf);  // atomic update
+  const bool cull_masks =
+      !node_masks_.empty() && (ray.type != RAY_TYPE_NONE);
+  const unsigned int ray_mask = prim_masks_.empty() ? 0u : ray.type;
 
-    stats_.num_leaf_nodes++;
+  NodeT min_t = std::numeric_limits<NodeT>::max();
+  NodeT max_t = -std::numeric_limits<NodeT>::max();
 
-    return offset;
-  }
+  bool found = false;
 
-  //
-  // Create branch node.
-  //
-  if (depth >= max_shallow_depth) {
-    // Delay to build tree
-    ShallowNodeInfo info;
-    info.left_idx = left_idx;
-    info.right_idx = right_idx;
-    info.offset = offset;
-    shallow_node_infos_.push_back(info);
+  while (node_stack_index >= 0) {
+    unsigned int index = node_stack[node_stack_index];
+    const Node &node = nodes_[index];
 
-    // Add dummy node.
-    BVHNode<T> node;
-    node.axis = -1;
-    node.flag = -1;
-    out_nodes->push_back(node);
+    node_stack_index--;
 
-    return offset;
+    if (cull_masks && !(node_masks_[index] & ray.type)) {
+      continue;
+    }
 
-  } else {
-    //
-    // TODO(LTE): multi-threaded SAH computation, or use simple object median or
-    // spacial median for shallow tree to speeding up the parallel build.
-    //
+    bool hit = node_ray.Intersect(&min_t, &max_t, ray.min_t, (*hit_t), node);
 
-    //
-    // Compute SAH and find best split axis and position
-    //
-    int min_cut_axis = 0;
-    T cut_pos[3] = {0.0, 0.0, 0.0};
+    if (hit) {
+      // Branch node
+      if (node.flag == 0) {
+        int order_near = node_ray.dir_sign[node.axis];
+        int order_far = 1 - order_near;
 
-    BinBuffer bins(options_.bin_size);
-    ContributeBinBuffer(&bins, bmin, bmax, &indices_.at(0), left_idx, right_idx,
-                        p);
-    FindCutFromBinBuffer(cut_pos, &min_cut_axis, &bins, bmin, bmax, n,
-                         options_.cost_t_aabb);
+        // Traverse near first.
+        node_stack[++node_stack_index] = node.data[order_far];
+        node_stack[++node_stack_index] = node.data[order_near];
+      } else {  // Leaf node
+        unsigned int num_primitives = node.data[0];
+        unsigned int offset = node.data[1];
 
-    // Try all 3 axis until good cut position avaiable.
-    unsigned int mid_idx = left_idx;
-    int cut_axis = min_cut_axis;
+        for (unsigned int i = 0; i < num_primitives; i++) {
+          if (ray_mask && !(prim_masks_[i + offset] & ray_mask)) {
+            continue;
+          }
 
-    for (int axis_try = 0; axis_try < 3; axis_try++) {
-      unsigned int *begin = &indices_[left_idx];
-      unsigned int *end =
-          &indices_[right_idx - 1] + 1;  // mimics end() iterator
-      unsigned int *mid = 0;
+          unsigned int prim_idx = indices_[i + offset];
 
-      // try min_cut_axis first.
-      cut_axis = (min_cut_axis + axis_try) % 3;
+          T local_t = (*hit_t);
+          if (intersector.Intersect(&local_t, prim_idx, lane)) {
+            if (any_hit) {
+              return true;
+            }
+            (*hit_t) = local_t;
+            intersector.Update(local_t, prim_idx, lane);
+            found = true;
+          }
+        }
+      }
+    }
+  }
 
-      pred.Set(cut_axis, cut_pos[cut_axis]);
-      //
-      // Split at (cut_axis, cut_pos)
-      // indices_ will be modified.
-      //
-      mid = std::partition(begin, end, pred);
+  return found;
+}
 
-      mid_idx = left_idx + static_cast<unsigned int>((mid - begin));
+template <typename T, class A, typename NodeT>
+template <int N, class I>
+unsigned int BVHAccel<T, A, NodeT>::TraversePacketImpl(
+    const RayPacket<T, N> &packet, unsigned int active_mask,
+    const I &intersector, T hit_t[N], bool any_hit) const {
+  // Switch to single ray traversal when this number of rays or less reach a
+  // node.
+  const int kMinPacketRays = (N >= 8) ? (N / 4) : 1;
+
+  T inv_dir[3][N];
+  int dir_sign[3][N];
+  for (int i = 0; i < N; i++) {
+    const real3<T> ray_dir(packet.dir[0][i], packet.dir[1][i],
+                           packet.dir[2][i]);
+    const real3<T> ray_inv_dir = vsafe_inverse(ray_dir);
+    for (int k = 0; k < 3; k++) {
+      inv_dir[k][i] = ray_inv_dir[k];
+      dir_sign[k][i] = packet.dir[k][i] < static_cast<T>(0.0) ? 1 : 0;
+    }
+  }
 
-      if ((mid_idx == left_idx) || (mid_idx == right_idx)) {
-        // Can't split well.
-        // Switch to object median (which may create unoptimized tree, but
-        // stable)
-        mid_idx = left_idx + (n >> 1);
+  // Lanes which found a hit.
+  unsigned int found_mask = 0;
 
-        // Try another axis if there's an axis to try.
+  int node_stack_index = 0;
+  unsigned int node_stack[kNANORT_MAX_STACK_DEPTH];
+  unsigned int mask_stack[kNANORT_MAX_STACK_DEPTH];
+  node_stack[0] = 0;
+  mask_stack[0] = active_mask;
 
-      } else {
-        // Found good cut. exit loop.
-        break;
-      }
-    }
+  while (node_stack_index >= 0) {
+    unsigned int index = node_stack[node_stack_index];
+    unsigned int mask = mask_stack[node_stack_index];
+    const Node &node = nodes_[index];
 
-    BVHNode<T> node;
-    node.axis = cut_axis;
-    node.flag = 0;  // 0 = branch
+    node_stack_index--;
 
-    out_nodes->push_back(node);
+    if (any_hit) {
+      // Occluded rays are terminated.
+      mask &= ~found_mask;
+    }
 
-    unsigned int left_child_index = 0;
-    unsigned int right_child_index = 0;
+    mask = TestPacketNode(index, packet, inv_dir, dir_sign, hit_t, mask);
+    if (mask == 0) {
+      continue;
+    }
 
-    left_child_index = BuildShallowTree(out_nodes, left_idx, mid_idx, depth + 1,
-                                        max_shallow_depth, p, pred);
+    if (CountBits(mask) <= kMinPacketRays) {
+      // Rays are no longer coherent. Trace the subtree ray by ray.
+      while (mask) {
+        const int lane = LowestBit(mask);
+        mask &= mask - 1;
+        if (TraversePacketLane(index, packet, lane, intersector, &hit_t[lane],
+                               any_hit)) {
+          found_mask |= (1u << lane);
+        }
+      }
+    } else if (node.flag == 0) {  // Branch node
+      // Use the direction of the first active ray for ordering.
+      // Order does not matter for any hit query.
+      int order_near = any_hit ? 0 : dir_sign[node.axis][LowestBit(mask)];
+      int order_far = 1 - order_near;
+
+      // Traverse near first.
+      ++node_stack_index;
+      node_stack[node_stack_index] = node.data[order_far];
+      mask_stack[node_stack_index] = mask;
+      ++node_stack_index;
+      node_stack[node_stack_index] = node.data[order_near];
+      mask_stack[node_stack_index] = mask;
+    } else {  // Leaf node
+      unsigned int num_primitives = node.data[0];
+      unsigned int offset = node.data[1];
+
+      for (unsigned int i = 0; (i < num_primitives) && mask; i++) {
+        unsigned int prim_idx = indices_[i + offset];
+
+        // Lanes whose ray type does not intersect the primitive mask skip it.
+        const unsigned int prim_lanes =
+            prim_masks_.empty()
+                ? mask
+                : PacketVisibleLanes(packet, prim_masks_[i + offset], mask);
+        if (prim_lanes == 0) {
+          continue;
+        }
 
-    right_child_index = BuildShallowTree(out_nodes, mid_idx, right_idx,
-                                         depth + 1, max_shallow_depth, p, pred);
+        unsigned int prim_hit_mask =
+            intersector.IntersectPacket(hit_t, prim_idx, prim_lanes);
+        found_mask |= prim_hit_mask;
 
-    //std::cout << "shallow[" << offset << "] l and r = " << left_child_index << ", " << right_child_index << std::endl;
-    (*out_nodes)[offset].data[0] = left_child_index;
-    (*out_nodes)[offset].data[1] = right_child_index;
+        if (any_hit) {
+          mask &= ~prim_hit_mask;
+          continue;
+        }
 
-    (*out_nodes)[offset].bmin[0] = bmin[0];
-    (*out_nodes)[offset].bmin[1] = bmin[1];
-    (*out_nodes)[offset].bmin[2] = bmin[2];
+        while (prim_hit_mask) {
+          const int lane = LowestBit(prim_hit_mask);
+          prim_hit_mask &= prim_hit_mask - 1;
+          intersector.Update(hit_t[lane], prim_idx, lane);
+        }
+      }
+    }
 
-    (*out_nodes)[offset].bmax[0] = bmax[0];
-    (*out_nodes)[offset].bmax[1] = bmax[1];
-    (*out_nodes)[offset].bmax[2] = bmax[2];
+    if (any_hit && (found_mask == active_mask)) {
+      break;
+    }
   }
 
-  stats_.num_branch_nodes++;
-
-  return offset;
+  return found_mask;
 }
-#endif
 
-template <typename T>
-template <class P, class Pred>
-unsigned int BVHAccel<T>::BuildTree(BVHBuildStatistics *out_stat,
-                                    std::vector<BVHNode<T> > *out_nodes,
-                                    unsigned int left_idx,
-                                    unsigned int right_idx, unsigned int depth,
-                                    const P &p, const Pred &pred) {
-  assert(left_idx <= right_idx);
+template <typename T, class A, typename NodeT>
+template <int N, class I, class H>
+unsigned int BVHAccel<T, A, NodeT>::TraversePacket(
+    const RayPacket<T, N> &packet, const I &intersector, H *isects,
+    const BVHTraceOptions &options) const {
+  const unsigned int active_mask = packet.active_mask & PacketLaneMask(N);
 
-  unsigned int offset = static_cast<unsigned int>(out_nodes->size());
+  intersector.PrepareTraversal(packet, options);
 
-  if (out_stat->max_tree_depth < depth) {
-    out_stat->max_tree_depth = depth;
+  if (active_mask) {
+    T hit_t[N];
+    for (int i = 0; i < N; i++) {
+      hit_t[i] = packet.max_t[i];
+    }
+
+    TraversePacketImpl(packet, active_mask, intersector, hit_t,
+                       /* any_hit */ false);
   }
 
-  real3<T> bmin, bmax;
-  if (!bboxes_.empty()) {
-    GetBoundingBox(&bmin, &bmax, bboxes_, &indices_.at(0), left_idx, right_idx);
-  } else {
-    ComputeBoundingBox(&bmin, &bmax, &indices_.at(0), left_idx, right_idx, p);
+  unsigned int hit_mask = 0;
+  for (int i = 0; i < N; i++) {
+    if ((active_mask & (1u << i)) && (intersector.GetT(i) < packet.max_t[i])) {
+      hit_mask |= (1u << i);
+    }
   }
 
-  unsigned int n = right_idx - left_idx;
-  if ((n <= options_.min_leaf_primitives) ||
-      (depth >= options_.max_tree_depth)) {
-    // Create leaf node.
-    BVHNode<T> leaf;
+  intersector.PostTraversal(packet, hit_mask, isects);
 
-    leaf.bmin[0] = bmin[0];
-    leaf.bmin[1] = bmin[1];
-    leaf.bmin[2] = bmin[2];
+  return hit_mask;
+}
 
-    leaf.bmax[0] = bmax[0];
-    leaf.bmax[1] = bmax[1];
-    leaf.bmax[2] = bmax[2];
+template <typename T, class A, typename NodeT>
+template <int N, class I>
+unsigned int BVHAccel<T, A, NodeT>::OccludedPacket(
+    const RayPacket<T, N> &packet, const I &intersector,
+    const BVHTraceOptions &options) const {
+  const unsigned int active_mask = packet.active_mask & PacketLaneMask(N);
 
-    assert(left_idx < std::numeric_limits<unsigned int>::max());
+  if (active_mask == 0) {
+    return 0;
+  }
 
-    leaf.flag = 1;  // leaf
-    leaf.data[0] = n;
-    leaf.data[1] = left_idx;
+  intersector.PrepareTraversal(packet, options);
 
-    out_nodes->push_back(leaf);  // atomic update
+  T hit_t[N];
+  for (int i = 0; i < N; i++) {
+    hit_t[i] = packet.max_t[i];
+  }
 
-    out_stat->num_leaf_nodes++;
+  return TraversePacketImpl(packet, active_mask, intersector, hit_t,
+                            /* any_hit */ true);
+}
 
-    return offset;
+template <typename T, class A, typename NodeT>
+void BVHAccel<T, A, NodeT>::SortStreamRays(
+    const Ray<T> *rays, size_t num_rays,
+    std::vector<StreamRayKey> *order) const {
+  // Direction octant(upper 3 bits) and Morton code of the ray origin in the
+  // BVH bounds(lower 27 bits).
+  T bmin[3], bmax[3];
+  BoundingBox(bmin, bmax);
+
+  T scale[3];
+  for (int k = 0; k < 3; k++) {
+    const T extent = bmax[k] - bmin[k];
+    scale[k] = (extent > static_cast<T>(0.0))
+                   ? static_cast<T>(511.0) / extent
+                   : static_cast<T>(0.0);
   }
 
-  //
-  // Create branch node.
-  //
-
-  //
-  // Compute SAH and find best split axis and position
-  //
-  int min_cut_axis = 0;
-  T cut_pos[3] = {0.0, 0.0, 0.0};
+  order->resize(num_rays);
+  for (size_t i = 0; i < num_rays; i++) {
+    const Ray<T> &ray = rays[i];
 
-  BinBuffer bins(options_.bin_size);
-  ContributeBinBuffer(&bins, bmin, bmax, &indices_.at(0), left_idx, right_idx,
-                      p);
-  FindCutFromBinBuffer(cut_pos, &min_cut_axis, &bins, bmin, bmax, n,
-                       options_.cost_t_aabb);
+    unsigned int q[3];
+    for (int k = 0; k < 3; k++) {
+      T x = (ray.org[k] - bmin[k]) * scale[k];
+      x = std::max(static_cast<T>(0.0), std::min(static_cast<T>(511.0), x));
+      q[k] = static_cast<unsigned int>(x);
+    }
 
-  // Try all 3 axis until good cut position avaiable.
-  unsigned int mid_idx = left_idx;
-  int cut_axis = min_cut_axis;
+    const unsigned int octant = (ray.dir[0] < static_cast<T>(0.0) ? 4u : 0u) |
+                                (ray.dir[1] < static_cast<T>(0.0) ? 2u : 0u) |
+                                (ray.dir[2] < static_cast<T>(0.0) ? 1u : 0u);
 
-  for (int axis_try = 0; axis_try < 3; axis_try++) {
-    unsigned int *begin = &indices_[left_idx];
-    unsigned int *end = &indices_[right_idx - 1] + 1;  // mimics end() iterator.
-    unsigned int *mid = 0;
+    (*order)[i].first = (octant << 27) | MortonCode3(q[0], q[1], q[2]);
+    (*order)[i].second = i;
+  }
 
-    // try min_cut_axis first.
-    cut_axis = (min_cut_axis + axis_try) % 3;
+  std::sort(order->begin(), order->end());
+}
 
-    pred.Set(cut_axis, cut_pos[cut_axis]);
+template <typename T, class A, typename NodeT>
+template <class Task>
+size_t BVHAccel<T, A, NodeT>::RunStreamTasks(size_t num_packets,
+                                             const Task &task,
+                                             unsigned int num_threads) const {
+  const size_t kPacketsPerTask = 64;
+  const size_t num_tasks = (num_packets + kPacketsPerTask - 1) / kPacketsPerTask;
 
-    //
-    // Split at (cut_axis, cut_pos)
-    // indices_ will be modified.
-    //
-    mid = std::partition(begin, end, pred);
+  size_t num_hits = 0;
 
-    mid_idx = left_idx + static_cast<unsigned int>((mid - begin));
+#if defined(NANORT_USE_CPP11_FEATURE)
+  size_t num_workers =
+      (num_threads == 0) ? size_t(std::thread::hardware_concurrency())
+                         : size_t(num_threads);
+  num_workers = std::min(size_t(kNANORT_MAX_THREADS),
+                         std::min(num_tasks, std::max(size_t(1), num_workers)));
 
-    if ((mid_idx == left_idx) || (mid_idx == right_idx)) {
-      // Can't split well.
-      // Switch to object median(which may create unoptimized tree, but
-      // stable)
-      mid_idx = left_idx + (n >> 1);
+  if (num_workers > 1) {
+    std::atomic<size_t> next_task(0);
+    std::atomic<size_t> total_hits(0);
 
-      // Try another axis to find better cut.
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < num_workers; t++) {
+      workers.emplace_back(std::thread([&]() {
+        const Task local_task(task);  // Each thread has its own intersector.
+        size_t local_hits = 0;
+
+        size_t task_idx;
+        while ((task_idx = next_task++) < num_tasks) {
+          const size_t begin = task_idx * kPacketsPerTask;
+          const size_t end = std::min(begin + kPacketsPerTask, num_packets);
+          local_hits += local_task(begin, end);
+        }
 
-    } else {
-      // Found good cut. exit loop.
-      break;
+        total_hits += local_hits;
+      }));
     }
-  }
 
-  BVHNode<T> node;
-  node.axis = cut_axis;
-  node.flag = 0;  // 0 = branch
+    for (auto &t : workers) {
+      t.join();
+    }
 
-  out_nodes->push_back(node);
+    num_hits = total_hits;
+  } else {
+    num_hits = task(0, num_packets);
+  }
+#elif defined(_OPENMP)
+  const int num_workers = (num_threads == 0) ? omp_get_max_threads()
+                                             : static_cast<int>(num_threads);
 
-  unsigned int left_child_index = 0;
-  unsigned int right_child_index = 0;
+#pragma omp parallel num_threads(num_workers) if (num_workers > 1) reduction(+ : num_hits)
+  {
+    const Task local_task(task);  // Each thread has its own intersector.
 
-  left_child_index =
-      BuildTree(out_stat, out_nodes, left_idx, mid_idx, depth + 1, p, pred);
+#pragma omp for schedule(dynamic, 1)
+    for (int task_idx = 0; task_idx < static_cast<int>(num_tasks); task_idx++) {
+      const size_t begin = size_t(task_idx) * kPacketsPerTask;
+      const size_t end = std::min(begin + kPacketsPerTask, num_packets);
+      num_hits += local_task(begin, end);
+    }
+  }
+#else
+  (void)num_threads;
+  (void)num_tasks;
+  num_hits = task(0, num_packets);
+#endif
 
-  right_child_index =
-      BuildTree(out_stat, out_nodes, mid_idx, right_idx, depth + 1, p, pred);
+  return num_hits;
+}
 
-  {
-    (*out_nodes)[offset].data[0] = left_child_index;
-    (*out_nodes)[offset].data[1] = right_child_index;
+template <typename T, class A, typename NodeT>
+template <class I, class H>
+size_t BVHAccel<T, A, NodeT>::TraverseStream(
+    const Ray<T> *rays, size_t num_rays, const I &intersector, H *isects,
+    unsigned char *hit_flags, const BVHTraceOptions &options,
+    unsigned int num_threads) const {
+  if (num_rays == 0) {
+    return 0;
+  }
 
-    (*out_nodes)[offset].bmin[0] = bmin[0];
-    (*out_nodes)[offset].bmin[1] = bmin[1];
-    (*out_nodes)[offset].bmin[2] = bmin[2];
+  std::vector<StreamRayKey> order;
+  SortStreamRays(rays, num_rays, &order);
 
-    (*out_nodes)[offset].bmax[0] = bmax[0];
-    (*out_nodes)[offset].bmax[1] = bmax[1];
-    (*out_nodes)[offset].bmax[2] = bmax[2];
-  }
+  const size_t num_packets =
+      (num_rays + size_t(I::kPacketSize) - 1) / size_t(I::kPacketSize);
 
-  out_stat->num_branch_nodes++;
+  const StreamTraverseTask<I, H> task(this, rays, &order, intersector, isects,
+                                      hit_flags, options);
 
-  return offset;
+  return RunStreamTasks(num_packets, task, num_threads);
 }
 
-template <typename T>
-template <class Prim, class Pred>
-bool BVHAccel<T>::Build(unsigned int num_primitives, const Prim &p,
-                        const Pred &pred, const BVHBuildOptions<T> &options) {
-  options_ = options;
-  stats_ = BVHBuildStatistics();
+template <typename T, class A, typename NodeT>
+template <class I>
+size_t BVHAccel<T, A, NodeT>::OccludedStream(
+    const Ray<T> *rays, size_t num_rays, const I &intersector,
+    unsigned char *occluded, const BVHTraceOptions &options,
+    unsigned int num_threads) const {
+  if (num_rays == 0) {
+    return 0;
+  }
 
-  nodes_.clear();
-  bboxes_.clear();
-#if defined(NANORT_ENABLE_PARALLEL_BUILD)
-  shallow_node_infos_.clear();
-#endif
+  std::vector<StreamRayKey> order;
+  SortStreamRays(rays, num_rays, &order);
 
-  assert(options_.bin_size > 1);
+  const size_t num_packets =
+      (num_rays + size_t(I::kPacketSize) - 1) / size_t(I::kPacketSize);
 
-  if (num_primitives == 0) {
-    return false;
-  }
+  const StreamOccludedTask<I> task(this, rays, &order, intersector, occluded,
+                                   options);
 
-  unsigned int n = num_primitives;
+  return RunStreamTasks(num_packets, task, num_threads);
+}
 
-  //
-  // 1. Create triangle indices(this will be permutated in BuildTree)
-  //
-  indices_.resize(n);
+template <typename T, class A, typename NodeT>
+template <class I>
+void BVHAccel<T, A, NodeT>::BeginInterleavedRay(
+    InterleavedRay<I> *r, const Ray<T> &ray, size_t ray_idx,
+    const I &intersector, const BVHTraceOptions &options) const {
+  const ContextIntersector<I> context_intersector(intersector, &r->ctx);
 
-#if defined(NANORT_USE_CPP11_FEATURE)
-  {
-    size_t num_threads = std::min(
-        size_t(kNANORT_MAX_THREADS),
-        std::max(size_t(1), size_t(std::thread::hardware_concurrency())));
+  // Init isect info as no hit
+  context_intersector.Update(ray.max_t, static_cast<unsigned int>(-1));
+  context_intersector.PrepareTraversal(ray, options);
+
+  r->node_ray = NodeTraversalRay<NodeT, T>(ray);
+  r->ray_idx = ray_idx;
+  r->hit_t = ray.max_t;
+  r->node_stack_index = 0;
+  r->leaf_index = static_cast<unsigned int>(-1);
+  r->node_stack[0] = 0;
+}
 
-    if (n < num_threads) {
-      num_threads = n;
+template <typename T, class A, typename NodeT>
+template <class I>
+bool BVHAccel<T, A, NodeT>::StepInterleavedRay(
+    InterleavedRay<I> *r, const Ray<T> &ray, const I &intersector,
+    const BVHTraceOptions &options, bool cull_prim_ids) const {
+  if (r->leaf_index != static_cast<unsigned int>(-1)) {
+    // Primitive indices of the leaf were prefetched in the previous step.
+    const ContextIntersector<I> context_intersector(intersector, &r->ctx);
+    if (TestLeafNode(nodes_[r->leaf_index], ray, context_intersector,
+                     NoIntersectionFilter())) {
+      r->hit_t = context_intersector.GetT();
     }
+    r->leaf_index = static_cast<unsigned int>(-1);
+  } else {
+    const unsigned int index = r->node_stack[r->node_stack_index];
+    const Node &node = nodes_[index];
 
-    std::vector<std::thread> workers;
+    r->node_stack_index--;
 
-    size_t ndiv = n / num_threads;
+    bool visit = true;
+    if (cull_prim_ids && !IsNodeInPrimIdRange(index, options)) {
+      visit = false;
+    }
+    if (!node_masks_.empty() && (ray.type != RAY_TYPE_NONE) &&
+        !(node_masks_[index] & ray.type)) {
+      visit = false;
+    }
 
-    for (size_t t = 0; t < num_threads; t++) {
-      workers.emplace_back(std::thread([&, t]() {
-        size_t si = t * ndiv;
-        size_t ei = (t == (num_threads - 1)) ? n : std::min((t + 1) * ndiv, size_t(n));
+    NodeT min_t, max_t;
+    if (visit &&
+        r->node_ray.Intersect(&min_t, &max_t, ray.min_t, r->hit_t, node)) {
+      if (node.flag == 0) {  // Branch node
+        int order_near = r->node_ray.dir_sign[node.axis];
+        int order_far = 1 - order_near;
 
-        for (size_t k = si; k < ei; k++) {
-          indices_[k] = static_cast<unsigned int>(k);
-        }
-      }));
+        // Traverse near first.
+        r->node_stack[++r->node_stack_index] = node.data[order_far];
+        r->node_stack[++r->node_stack_index] = node.data[order_near];
+      } else {  // Leaf node. Test it in the next step.
+        r->leaf_index = index;
+        NANORT_PREFETCH(&indices_[node.data[1]]);
+        return true;
+      }
     }
+  }
 
-    for (auto &t : workers) {
-      t.join();
-    }
+  if (r->node_stack_index < 0) {
+    return false;
   }
 
-#else
+  // Node to be visited in the next step.
+  NANORT_PREFETCH(&nodes_[r->node_stack[r->node_stack_index]]);
 
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
-  for (int i = 0; i < static_cast<int>(n); i++) {
-    indices_[static_cast<size_t>(i)] = static_cast<unsigned int>(i);
+  return true;
+}
+
+template <typename T, class A, typename NodeT>
+template <class I, class H>
+size_t BVHAccel<T, A, NodeT>::TraverseInterleavedRange(
+    const Ray<T> *rays, size_t ray_begin, size_t ray_end, const I &intersector,
+    H *isects, unsigned char *hit_flags, const BVHTraceOptions &options) const {
+  const int kNumSlots = kNANORT_RAYS_IN_FLIGHT;
+
+  const bool cull_prim_ids = IsPrimIdRangeCulled(intersector);
+
+  InterleavedRay<I> slots[kNANORT_RAYS_IN_FLIGHT];
+  bool slot_active[kNANORT_RAYS_IN_FLIGHT];
+
+  size_t next_ray = ray_begin;
+  int num_active = 0;
+
+  for (int s = 0; s < kNumSlots; s++) {
+    slot_active[s] = (next_ray < ray_end);
+    if (slot_active[s]) {
+      BeginInterleavedRay(&slots[s], rays[next_ray], next_ray, intersector,
+                          options);
+      next_ray++;
+      num_active++;
+    }
   }
-#endif  // !NANORT_USE_CPP11_FEATURE
 
-  //
-  // 2. Compute bounding box (optional).
-  //
-  real3<T> bmin, bmax;
+  size_t num_hits = 0;
 
-  if (options.cache_bbox) {
-    bmin[0] = bmin[1] = bmin[2] = std::numeric_limits<T>::max();
-    bmax[0] = bmax[1] = bmax[2] = -std::numeric_limits<T>::max();
+  // Round-robin over the rays in flight.
+  while (num_active > 0) {
+    for (int s = 0; s < kNumSlots; s++) {
+      if (!slot_active[s]) {
+        continue;
+      }
 
-    bboxes_.resize(n);
+      InterleavedRay<I> &r = slots[s];
+      const Ray<T> &ray = rays[r.ray_idx];
 
-    for (size_t i = 0; i < n; i++) {  // for each primitive
-      unsigned int idx = indices_[i];
+      if (StepInterleavedRay(&r, ray, intersector, options, cull_prim_ids)) {
+        continue;
+      }
 
-      BBox<T> bbox;
-      p.BoundingBox(&(bbox.bmin), &(bbox.bmax), static_cast<unsigned int>(i));
-      bboxes_[idx] = bbox;
+      // Finished. Write the result and start the next ray in this slot.
+      const ContextIntersector<I> context_intersector(intersector, &r.ctx);
+      const bool hit = (context_intersector.GetT() < ray.max_t);
+      context_intersector.PostTraversal(ray, hit, &isects[r.ray_idx]);
+      if (hit_flags) {
+        hit_flags[r.ray_idx] = hit ? 1 : 0;
+      }
+      num_hits += hit ? 1 : 0;
 
-      // xyz
-      for (int k = 0; k < 3; k++) {
-        bmin[k] = std::min(bmin[k], bbox.bmin[k]);
-        bmax[k] = std::max(bmax[k], bbox.bmax[k]);
+      if (next_ray < ray_end) {
+        BeginInterleavedRay(&r, rays[next_ray], next_ray, intersector,
+                            options);
+        next_ray++;
+      } else {
+        slot_active[s] = false;
+        num_active--;
       }
     }
-
-  } else {
-#if defined(NANORT_USE_CPP11_FEATURE)
-    ComputeBoundingBoxThreaded(&bmin, &bmax, &indices_.at(0), 0, n, p);
-#elif defined(_OPENMP)
-    ComputeBoundingBoxOMP(&bmin, &bmax, &indices_.at(0), 0, n, p);
-#else
-    ComputeBoundingBox(&bmin, &bmax, &indices_.at(0), 0, n, p);
-#endif
   }
 
-//
-// 3. Build tree
-//
-#if defined(NANORT_ENABLE_PARALLEL_BUILD)
-#if defined(NANORT_USE_CPP11_FEATURE)
-
-  // Do parallel build for large enough datasets.
-  if (n > options.min_primitives_for_parallel_build) {
-    BuildShallowTree(&nodes_, 0, n, /* root depth */ 0, options.shallow_depth,
-                     p, pred);  // [0, n)
-
-    assert(shallow_node_infos_.size() > 0);
+  return num_hits;
+}
 
-    // Build deeper tree in parallel
-    std::vector<std::vector<BVHNode<T> > > local_nodes(
-        shallow_node_infos_.size());
-    std::vector<BVHBuildStatistics> local_stats(shallow_node_infos_.size());
+template <typename T, class A, typename NodeT>
+template <class I, class H>
+size_t BVHAccel<T, A, NodeT>::TraverseInterleaved(
+    const Ray<T> *rays, size_t num_rays, const I &intersector, H *isects,
+    unsigned char *hit_flags, const BVHTraceOptions &options,
+    unsigned int num_threads) const {
+  if (num_rays == 0) {
+    return 0;
+  }
 
-    size_t num_threads = std::min(
-        size_t(kNANORT_MAX_THREADS),
-        std::max(size_t(1), size_t(std::thread::hardware_concurrency())));
-    if (shallow_node_infos_.size() < num_threads) {
-      num_threads = shallow_node_infos_.size();
+  if (nodes_.empty()) {
+    if (hit_flags) {
+      memset(hit_flags, 0, num_rays);
     }
+    return 0;
+  }
 
-    std::vector<std::thread> workers;
-    std::atomic<uint32_t> i(0);
+  const size_t num_groups =
+      (num_rays + size_t(kNANORT_RAYS_IN_FLIGHT) - 1) /
+      size_t(kNANORT_RAYS_IN_FLIGHT);
 
-    for (size_t t = 0; t < num_threads; t++) {
-      workers.emplace_back(std::thread([&]() {
-        uint32_t idx = 0;
-        while ((idx = (i++)) < shallow_node_infos_.size()) {
-          // Create thread-local copy of Pred since some mutable variables are
-          // modified during SAH computation.
-          const Pred local_pred = pred;
-          unsigned int left_idx = shallow_node_infos_[size_t(idx)].left_idx;
-          unsigned int right_idx = shallow_node_infos_[size_t(idx)].right_idx;
-          BuildTree(&(local_stats[size_t(idx)]), &(local_nodes[size_t(idx)]),
-                    left_idx, right_idx, options.shallow_depth, p, local_pred);
-        }
-      }));
-    }
+  const InterleavedTraverseTask<I, H> task(this, rays, num_rays, intersector,
+                                           isects, hit_flags, options);
 
-    for (auto &t : workers) {
-      t.join();
-    }
+  return RunStreamTasks(num_groups, task, num_threads);
+}
 
-    // Join local nodes
-    for (size_t ii = 0; ii < local_nodes.size(); ii++) {
-      assert(!local_nodes[ii].empty());
-      size_t offset = nodes_.size();
+template <typename T, class A, typename NodeT>
+unsigned int BVHAccel<T, A, NodeT>::FindTileEntryNodes(
+    const TileFrustum &frustum, const BVHTraceOptions &options,
+    bool cull_prim_ids, unsigned int *entry_nodes) const {
+  unsigned int num_entry_nodes = 0;
+
+  int node_stack_index = 0;
+  unsigned int node_stack[kNANORT_MAX_STACK_DEPTH];
+  node_stack[0] = 0;
 
-      // Add offset to child index (for branch node).
-      for (size_t j = 0; j < local_nodes[ii].size(); j++) {
-        if (local_nodes[ii][j].flag == 0) {  // branch
-          local_nodes[ii][j].data[0] += offset - 1;
-          local_nodes[ii][j].data[1] += offset - 1;
-        }
-      }
+  while (node_stack_index >= 0) {
+    const unsigned int index = node_stack[node_stack_index];
+    const Node &node = nodes_[index];
 
-      // replace
-      nodes_[shallow_node_infos_[ii].offset] = local_nodes[ii][0];
+    node_stack_index--;
 
-      // Skip root element of the local node.
-      nodes_.insert(nodes_.end(), local_nodes[ii].begin() + 1,
-                    local_nodes[ii].end());
+    if (cull_prim_ids && !IsNodeInPrimIdRange(index, options)) {
+      continue;
     }
 
-    // Join statistics
-    for (size_t ii = 0; ii < local_nodes.size(); ii++) {
-      stats_.max_tree_depth =
-          std::max(stats_.max_tree_depth, local_stats[ii].max_tree_depth);
-      stats_.num_leaf_nodes += local_stats[ii].num_leaf_nodes;
-      stats_.num_branch_nodes += local_stats[ii].num_branch_nodes;
+    if (!frustum.Intersect(node)) {
+      continue;
     }
 
-  } else {
-    // Single thread.
-    BuildTree(&stats_, &nodes_, 0, n,
-              /* root depth */ 0, p, pred);  // [0, n)
+    // Stop splitting when the entry nodes would exceed the limit(each
+    // pending node becomes at least one entry node).
+    const bool full =
+        (num_entry_nodes + static_cast<unsigned int>(node_stack_index + 1) +
+         2) > kNANORT_MAX_TILE_ENTRY_NODES;
+
+    if ((node.flag == 0) && !full) {
+      const int order_near = frustum.dir_sign[node.axis];
+      const int order_far = 1 - order_near;
+
+      // Visit near first.
+      node_stack[++node_stack_index] = node.data[order_far];
+      node_stack[++node_stack_index] = node.data[order_near];
+    } else {
+      entry_nodes[num_entry_nodes++] = index;
+    }
   }
 
-#elif defined(_OPENMP)
+  return num_entry_nodes;
+}
 
-  // Do parallel build for large enough datasets.
-  if (n > options.min_primitives_for_parallel_build) {
-    BuildShallowTree(&nodes_, 0, n, /* root depth */ 0, options.shallow_depth,
-                     p, pred);  // [0, n)
+template <typename T, class A, typename NodeT>
+template <class I>
+bool BVHAccel<T, A, NodeT>::TraverseFromEntryNodes(
+    const Ray<T> &ray, const I &intersector, const unsigned int *entry_nodes,
+    unsigned int num_entry_nodes, const BVHTraceOptions &options) const {
+  T hit_t = ray.max_t;
 
-    assert(shallow_node_infos_.size() > 0);
+  // Entry nodes are pushed far first, so stack usage is at most
+  // `num_entry_nodes` + tree depth.
+  int node_stack_index = -1;
+  unsigned int
+      node_stack[kNANORT_MAX_STACK_DEPTH + kNANORT_MAX_TILE_ENTRY_NODES];
+  for (unsigned int i = num_entry_nodes; i-- > 0;) {
+    node_stack[++node_stack_index] = entry_nodes[i];
+  }
 
-    // Build deeper tree in parallel
-    std::vector<std::vector<BVHNode<T> > > local_nodes(
-        shallow_node_infos_.size());
-    std::vector<BVHBuildStatistics> local_stats(shallow_node_infos_.size());
+  const NodeTraversalRay<NodeT, T> node_ray(ray);
 
-#pragma omp parallel for
-    for (int i = 0; i < static_cast<int>(shallow_node_infos_.size()); i++) {
-      unsigned int left_idx = shallow_node_infos_[size_t(i)].left_idx;
-      unsigned int right_idx = shallow_node_infos_[size_t(i)].right_idx;
-      const Pred local_pred = pred;
-      BuildTree(&(local_stats[size_t(i)]), &(local_nodes[size_t(i)]), left_idx,
-                right_idx, options.shallow_depth, p, local_pred);
-    }
+  const bool cull_prim_ids = IsPrimIdRangeCulled(intersector);
+  const bool cull_masks =
+      !node_masks_.empty() && (ray.type != RAY_TYPE_NONE);
 
-    // Join local nodes
-    for (size_t i = 0; i < local_nodes.size(); i++) {
-      assert(!local_nodes[size_t(i)].empty());
-      size_t offset = nodes_.size();
+  NodeT min_t = std::numeric_limits<NodeT>::max();
+  NodeT max_t = -std::numeric_limits<NodeT>::max();
 
-      // Add offset to child index (for branch node).
-      for (size_t j = 0; j < local_nodes[i].size(); j++) {
-        if (local_nodes[i][j].flag == 0) {  // branch
-          local_nodes[i][j].data[0] += offset - 1;
-          local_nodes[i][j].data[1] += offset - 1;
-        }
-      }
+  while (node_stack_index >= 0) {
+    unsigned int index = node_stack[node_stack_index];
+    const Node &node = nodes_[index];
 
-      // replace
-      nodes_[shallow_node_infos_[i].offset] = local_nodes[i][0];
+    node_stack_index--;
 
-      // Skip root element of the local node.
-      nodes_.insert(nodes_.end(), local_nodes[i].begin() + 1,
-                    local_nodes[i].end());
+    if (cull_prim_ids && !IsNodeInPrimIdRange(index, options)) {
+      continue;
     }
 
-    // Join statistics
-    for (size_t i = 0; i < local_nodes.size(); i++) {
-      stats_.max_tree_depth =
-          std::max(stats_.max_tree_depth, local_stats[i].max_tree_depth);
-      stats_.num_leaf_nodes += local_stats[i].num_leaf_nodes;
-      stats_.num_branch_nodes += local_stats[i].num_branch_nodes;
+    if (cull_masks && !(node_masks_[index] & ray.type)) {
+      continue;
     }
 
-  } else {
-    // Single thread
-    BuildTree(&stats_, &nodes_, 0, n,
-              /* root depth */ 0, p, pred);  // [0, n)
+    bool hit = node_ray.Intersect(&min_t, &max_t, ray.min_t, hit_t, node);
+
+    if (hit) {
+      // Branch node
+      if (node.flag == 0) {
+        int order_near = node_ray.dir_sign[node.axis];
+        int order_far = 1 - order_near;
+
+        // Traverse near first.
+        node_stack[++node_stack_index] = node.data[order_far];
+        node_stack[++node_stack_index] = node.data[order_near];
+      } else if (TestLeafNode(node, ray, intersector,
+                              NoIntersectionFilter())) {  // Leaf node
+        hit_t = intersector.GetT();
+      }
+    }
   }
 
-#else  // !NANORT_ENABLE_PARALLEL_BUILD
-  {
-    BuildTree(&stats_, &nodes_, 0, n,
-              /* root depth */ 0, p, pred);  // [0, n)
+  return intersector.GetT() < ray.max_t;
+}
+
+template <typename T, class A, typename NodeT>
+template <class I, class H>
+size_t BVHAccel<T, A, NodeT>::TraverseTile(const Ray<T> *rays,
+                                           size_t num_rays,
+                                           const I &intersector, H *isects,
+                                           unsigned char *hit_flags,
+                                           const BVHTraceOptions &options) const {
+  if (num_rays == 0) {
+    return 0;
   }
-#endif
-#else  // !_OPENMP
 
-  // Single thread BVH build
-  {
-    BuildTree(&stats_, &nodes_, 0, n,
-              /* root depth */ 0, p, pred);  // [0, n)
+  if (nodes_.empty()) {
+    if (hit_flags) {
+      memset(hit_flags, 0, num_rays);
+    }
+    return 0;
   }
-#endif
 
-  return true;
-}
+  size_t num_hits = 0;
 
-template <typename T>
-void BVHAccel<T>::Debug() {
-  for (size_t i = 0; i < indices_.size(); i++) {
-    printf("index[%d] = %d\n", int(i), int(indices_[i]));
+  TileFrustum frustum;
+  if (options.distance_ordered_traversal || !frustum.Init(rays, num_rays)) {
+    for (size_t i = 0; i < num_rays; i++) {
+      const bool hit = Traverse(rays[i], intersector, &isects[i], options);
+      if (hit_flags) {
+        hit_flags[i] = hit ? 1 : 0;
+      }
+      num_hits += hit ? 1 : 0;
+    }
+    return num_hits;
   }
 
-  for (size_t i = 0; i < nodes_.size(); i++) {
-    printf("node[%d] : bmin %f, %f, %f, bmax %f, %f, %f\n", int(i),
-           nodes_[i].bmin[0], nodes_[i].bmin[1], nodes_[i].bmin[2],
-           nodes_[i].bmax[0], nodes_[i].bmax[1], nodes_[i].bmax[2]);
+  unsigned int entry_nodes[kNANORT_MAX_TILE_ENTRY_NODES];
+  const unsigned int num_entry_nodes =
+      FindTileEntryNodes(frustum, options, IsPrimIdRangeCulled(intersector),
+                         entry_nodes);
+
+  for (size_t i = 0; i < num_rays; i++) {
+    const Ray<T> &ray = rays[i];
+
+    // Init isect info as no hit
+    intersector.Update(ray.max_t, static_cast<unsigned int>(-1));
+
+    intersector.PrepareTraversal(ray, options);
+
+    const bool hit = TraverseFromEntryNodes(ray, intersector, entry_nodes,
+                                            num_entry_nodes, options);
+
+    intersector.PostTraversal(ray, hit, &isects[i]);
+
+    if (hit_flags) {
+      hit_flags[i] = hit ? 1 : 0;
+    }
+    num_hits += hit ? 1 : 0;
   }
+
+  return num_hits;
 }
 
-#if defined(NANORT_ENABLE_SERIALIZATION)
-template <typename T>
-bool BVHAccel<T>::Dump(const char *filename) const {
-  FILE *fp = fopen(filename, "wb");
-  if (!fp) {
-    // fprintf(stderr, "[BVHAccel] Cannot write a file: %s\n", filename);
-    return false;
+template <typename T, class A, typename NodeT>
+template <class I, class H>
+size_t BVHAccel<T, A, NodeT>::TraverseBundleRays(
+    const Ray<T> *rays, unsigned int num_rays, const TileFrustum &frustum,
+    unsigned int max_hits, const I &intersector, H *isects,
+    unsigned int *num_hits, const BVHTraceOptions &options) const {
+  const HitDistanceComparator<H> comp;
+
+  NodeTraversalRay<NodeT, T> node_rays[kNANORT_BUNDLE_SIZE];
+  typename I::BundleRay bundle_rays[kNANORT_BUNDLE_SIZE];
+  T far_t[kNANORT_BUNDLE_SIZE];  // max_t, or the furthest hit once full
+
+  // Nodes are culled by the union of ray types(unless a ray accepts all).
+  unsigned int bundle_type = 0;
+  bool cull_masks = !node_masks_.empty();
+
+  for (unsigned int r = 0; r < num_rays; r++) {
+    node_rays[r] = NodeTraversalRay<NodeT, T>(rays[r]);
+    intersector.PrepareBundleRay(&bundle_rays[r], rays[r]);
+    far_t[r] = rays[r].max_t;
+    num_hits[r] = 0;
+
+    bundle_type |= rays[r].type;
+    if (rays[r].type == RAY_TYPE_NONE) {
+      cull_masks = false;
+    }
   }
 
-  size_t numNodes = nodes_.size();
-  assert(nodes_.size() > 0);
+  const bool cull_prim_ids = IsPrimIdRangeCulled(intersector);
 
-  size_t numIndices = indices_.size();
+  // Hit distance range of the frustum shrinks as rays find their hits.
+  TileFrustum bundle_frustum = frustum;
 
-  size_t r = 0;
-  r = fwrite(&numNodes, sizeof(size_t), 1, fp);
-  assert(r == 1);
+  unsigned char active[kNANORT_BUNDLE_SIZE];
+  typename I::BundleLeaf leaf;
 
-  r = fwrite(&nodes_.at(0), sizeof(BVHNode<T>), numNodes, fp);
-  assert(r == numNodes);
+  // Node index and the first ray of the bundle which may hit the node(rays
+  // before it missed an ancestor).
+  int node_stack_index = 0;
+  unsigned int node_stack[kNANORT_MAX_STACK_DEPTH];
+  unsigned int first_ray_stack[kNANORT_MAX_STACK_DEPTH];
+  node_stack[0] = 0;
+  first_ray_stack[0] = 0;
 
-  r = fwrite(&numIndices, sizeof(size_t), 1, fp);
-  assert(r == 1);
+  NodeT min_t, max_t;
 
-  r = fwrite(&indices_.at(0), sizeof(unsigned int), numIndices, fp);
-  assert(r == numIndices);
+  while (node_stack_index >= 0) {
+    const unsigned int index = node_stack[node_stack_index];
+    unsigned int first_ray = first_ray_stack[node_stack_index];
+    const Node &node = nodes_[index];
 
-  fclose(fp);
+    node_stack_index--;
 
-  return true;
-}
+    if (cull_prim_ids && !IsNodeInPrimIdRange(index, options)) {
+      continue;
+    }
 
-template <typename T>
-bool BVHAccel<T>::Dump(FILE *fp) const {
-  size_t numNodes = nodes_.size();
-  assert(nodes_.size() > 0);
+    if (cull_masks && !(node_masks_[index] & bundle_type)) {
+      continue;
+    }
 
-  size_t numIndices = indices_.size();
+    if (!bundle_frustum.Intersect(node)) {
+      continue;
+    }
 
-  size_t r = 0;
-  r = fwrite(&numNodes, sizeof(size_t), 1, fp);
-  assert(r == 1);
+    if (node.flag == 0) {  // Branch node
+      // Find the first ray which hits the node.
+      for (; first_ray < num_rays; first_ray++) {
+        if (node_rays[first_ray].Intersect(&min_t, &max_t,
+                                           rays[first_ray].min_t,
+                                           far_t[first_ray], node)) {
+          break;
+        }
+      }
 
-  r = fwrite(&nodes_.at(0), sizeof(BVHNode<T>), numNodes, fp);
-  assert(r == numNodes);
+      if (first_ray == num_rays) {
+        continue;
+      }
 
-  r = fwrite(&numIndices, sizeof(size_t), 1, fp);
-  assert(r == 1);
+      const int order_near = bundle_frustum.dir_sign[node.axis];
+      const int order_far = 1 - order_near;
+
+      // Visit near first.
+      ++node_stack_index;
+      node_stack[node_stack_index] = node.data[order_far];
+      first_ray_stack[node_stack_index] = first_ray;
+      ++node_stack_index;
+      node_stack[node_stack_index] = node.data[order_near];
+      first_ray_stack[node_stack_index] = first_ray;
+      continue;
+    }
 
-  r = fwrite(&indices_.at(0), sizeof(unsigned int), numIndices, fp);
-  assert(r == numIndices);
+    // Leaf node: find rays which hit the leaf.
+    unsigned int num_active = 0;
+    for (unsigned int r = 0; r < first_ray; r++) {
+      active[r] = 0;
+    }
+    for (unsigned int r = first_ray; r < num_rays; r++) {
+      active[r] = 0;
+      if (!node_masks_.empty() && (rays[r].type != RAY_TYPE_NONE) &&
+          !(node_masks_[index] & rays[r].type)) {
+        continue;
+      }
+      if (node_rays[r].Intersect(&min_t, &max_t, rays[r].min_t, far_t[r],
+                                 node)) {
+        active[r] = 1;
+        num_active++;
+      }
+    }
 
-  return true;
-}
+    if (num_active == 0) {
+      continue;
+    }
 
-template <typename T>
-bool BVHAccel<T>::Load(const char *filename) {
-  FILE *fp = fopen(filename, "rb");
-  if (!fp) {
-    // fprintf(stderr, "Cannot open file: %s\n", filename);
-    return false;
-  }
+    const unsigned int num_primitives = node.data[0];
+    const unsigned int offset = node.data[1];
 
-  size_t numNodes;
-  size_t numIndices;
+    for (unsigned int base = 0; base < num_primitives;
+         base += kNANORT_BUNDLE_LEAF_SIZE) {
+      const unsigned int n = std::min(num_primitives - base,
+                                      unsigned(kNANORT_BUNDLE_LEAF_SIZE));
 
-  size_t r = 0;
-  r = fread(&numNodes, sizeof(size_t), 1, fp);
-  assert(r == 1);
-  assert(numNodes > 0);
+      // Shared by all rays of the bundle.
+      intersector.PrepareBundleLeaf(&leaf, frustum.org,
+                                    &indices_[offset + base], n, options);
 
-  nodes_.resize(numNodes);
-  r = fread(&nodes_.at(0), sizeof(BVHNode<T>), numNodes, fp);
-  assert(r == numNodes);
+      for (unsigned int r = 0; r < num_rays; r++) {
+        if (!active[r]) {
+          continue;
+        }
 
-  r = fread(&numIndices, sizeof(size_t), 1, fp);
-  assert(r == 1);
+        const unsigned int ray_mask = prim_masks_.empty() ? 0u : rays[r].type;
+        H *ray_isects = &isects[r * max_hits];
 
-  indices_.resize(numIndices);
+        for (unsigned int i = 0; i < n; i++) {
+          if (ray_mask && !(prim_masks_[offset + base + i] & ray_mask)) {
+            continue;
+          }
 
-  r = fread(&indices_.at(0), sizeof(unsigned int), numIndices, fp);
-  assert(r == numIndices);
+          T t = far_t[r];
+          H isect;
+          if (!intersector.IntersectBundleLeaf(bundle_rays[r], leaf, i, &t,
+                                               &isect)) {
+            continue;
+          }
 
-  fclose(fp);
+          // Keep `max_hits` frontmost hits in a max-heap.
+          if (num_hits[r] < max_hits) {
+            ray_isects[num_hits[r]++] = isect;
+            std::push_heap(ray_isects, ray_isects + num_hits[r], comp);
+          } else if (comp(isect, ray_isects[0])) {
+            std::pop_heap(ray_isects, ray_isects + max_hits, comp);
+            ray_isects[max_hits - 1] = isect;
+            std::push_heap(ray_isects, ray_isects + max_hits, comp);
+          } else {
+            continue;
+          }
 
-  return true;
-}
+          if (num_hits[r] == max_hits) {
+            far_t[r] = ray_isects[0].t;
+          }
+        }
+      }
+    }
 
-template <typename T>
-bool BVHAccel<T>::Load(FILE *fp) {
-  size_t numNodes;
-  size_t numIndices;
+    T bundle_far_t = far_t[0];
+    for (unsigned int r = 1; r < num_rays; r++) {
+      bundle_far_t = std::max(bundle_far_t, far_t[r]);
+    }
+    bundle_frustum.max_t = bundle_far_t;
+  }
 
-  size_t r = 0;
-  r = fread(&numNodes, sizeof(size_t), 1, fp);
-  assert(r == 1);
-  assert(numNodes > 0);
+  size_t total_hits = 0;
+  for (unsigned int r = 0; r < num_rays; r++) {
+    // Store hits in frontmost order.
+    std::sort_heap(&isects[r * max_hits], &isects[r * max_hits] + num_hits[r],
+                   comp);
+    total_hits += num_hits[r];
+  }
 
-  nodes_.resize(numNodes);
-  r = fread(&nodes_.at(0), sizeof(BVHNode<T>), numNodes, fp);
-  assert(r == numNodes);
+  return total_hits;
+}
 
-  r = fread(&numIndices, sizeof(size_t), 1, fp);
-  assert(r == 1);
+template <typename T, class A, typename NodeT>
+template <class I, class H>
+size_t BVHAccel<T, A, NodeT>::TraverseBundle(
+    const Ray<T> *rays, size_t num_rays, unsigned int max_hits,
+    const I &intersector, H *isects, unsigned int *num_hits,
+    const BVHTraceOptions &options, unsigned int num_threads) const {
+  if (num_rays == 0) {
+    return 0;
+  }
 
-  indices_.resize(numIndices);
+  if (nodes_.empty() || (max_hits == 0)) {
+    for (size_t i = 0; i < num_rays; i++) {
+      num_hits[i] = 0;
+    }
+    return 0;
+  }
 
-  r = fread(&indices_.at(0), sizeof(unsigned int), numIndices, fp);
-  assert(r == numIndices);
+  const size_t num_bundles =
+      (num_rays + size_t(kNANORT_BUNDLE_SIZE) - 1) / size_t(kNANORT_BUNDLE_SIZE);
 
-  return true;
+  const BundleTraverseTask<I, H> task(this, rays, num_rays, max_hits,
+                                      intersector, isects, num_hits, options);
+
+  return RunStreamTasks(num_bundles, task, num_threads);
 }
-#endif
 
-template <typename T>
-inline bool IntersectRayAABB(T *tminOut,  // [out]
-                             T *tmaxOut,  // [out]
-                             T min_t, T max_t, const T bmin[3], const T bmax[3],
-                             real3<T> ray_org, real3<T> ray_inv_dir,
-                             int ray_dir_sign[3]);
-template <>
-inline bool IntersectRayAABB<float>(float *tminOut,  // [out]
-                                    float *tmaxOut,  // [out]
-                                    float min_t, float max_t,
-                                    const float bmin[3], const float bmax[3],
-                                    real3<float> ray_org,
-                                    real3<float> ray_inv_dir,
-                                    int ray_dir_sign[3]) {
-  float tmin, tmax;
+template <typename T, class A, typename NodeT>
+template <class V>
+void BVHAccel<T, A, NodeT>::TraverseNearestFirst(const real3<T> &query,
+                                                 T radius2,
+                                                 V *visitor) const {
+  // Node index and squared distance to its bounding box.
+  int node_stack_index = 0;
+  unsigned int node_stack[kNANORT_MAX_STACK_DEPTH];
+  T dist_stack[kNANORT_MAX_STACK_DEPTH];
+  node_stack[0] = 0;
+  dist_stack[0] = PointNodeDistanceSquared(query, nodes_[0]);
 
-  const float min_x = ray_dir_sign[0] ? bmax[0] : bmin[0];
-  const float min_y = ray_dir_sign[1] ? bmax[1] : bmin[1];
-  const float min_z = ray_dir_sign[2] ? bmax[2] : bmin[2];
-  const float max_x = ray_dir_sign[0] ? bmin[0] : bmax[0];
-  const float max_y = ray_dir_sign[1] ? bmin[1] : bmax[1];
-  const float max_z = ray_dir_sign[2] ? bmin[2] : bmax[2];
+  while (node_stack_index >= 0) {
+    const unsigned int index = node_stack[node_stack_index];
+    const T node_dist2 = dist_stack[node_stack_index];
+
+    node_stack_index--;
 
-  // X
-  const float tmin_x = (min_x - ray_org[0]) * ray_inv_dir[0];
-  // MaxMult robust BVH traversal(up to 4 ulp).
-  // 1.0000000000000004 for double precision.
-  const float tmax_x = (max_x - ray_org[0]) * ray_inv_dir[0] * 1.00000024f;
+    // Radius shrank after this node was pushed.
+    if (node_dist2 > radius2) {
+      continue;
+    }
 
-  // Y
-  const float tmin_y = (min_y - ray_org[1]) * ray_inv_dir[1];
-  const float tmax_y = (max_y - ray_org[1]) * ray_inv_dir[1] * 1.00000024f;
+    const Node &node = nodes_[index];
 
-  // Z
-  const float tmin_z = (min_z - ray_org[2]) * ray_inv_dir[2];
-  const float tmax_z = (max_z - ray_org[2]) * ray_inv_dir[2] * 1.00000024f;
+    if (node.flag == 0) {  // Branch node
+      T child_dist2[2];
+      for (int c = 0; c < 2; c++) {
+        child_dist2[c] = PointNodeDistanceSquared(query, nodes_[node.data[c]]);
+      }
 
-  tmin = safemax(tmin_z, safemax(tmin_y, safemax(tmin_x, min_t)));
-  tmax = safemin(tmax_z, safemin(tmax_y, safemin(tmax_x, max_t)));
+      const int order_near = (child_dist2[1] < child_dist2[0]) ? 1 : 0;
+      const int order_far = 1 - order_near;
 
-  if (tmin <= tmax) {
-    (*tminOut) = tmin;
-    (*tmaxOut) = tmax;
+      // Visit near first.
+      if (child_dist2[order_far] <= radius2) {
+        ++node_stack_index;
+        node_stack[node_stack_index] = node.data[order_far];
+        dist_stack[node_stack_index] = child_dist2[order_far];
+      }
+      if (child_dist2[order_near] <= radius2) {
+        ++node_stack_index;
+        node_stack[node_stack_index] = node.data[order_near];
+        dist_stack[node_stack_index] = child_dist2[order_near];
+      }
+    } else {  // Leaf node
+      const unsigned int num_primitives = node.data[0];
+      const unsigned int offset = node.data[1];
 
-    return true;
+      for (unsigned int i = 0; i < num_primitives; i++) {
+        radius2 = (*visitor)(indices_[i + offset]);
+      }
+    }
   }
-  return false;  // no hit
 }
 
-template <>
-inline bool IntersectRayAABB<double>(double *tminOut,  // [out]
-                                     double *tmaxOut,  // [out]
-                                     double min_t, double max_t,
-                                     const double bmin[3], const double bmax[3],
-                                     real3<double> ray_org,
-                                     real3<double> ray_inv_dir,
-                                     int ray_dir_sign[3]) {
-  double tmin, tmax;
+template <typename T, class A, typename NodeT>
+template <class Q, class H>
+bool BVHAccel<T, A, NodeT>::ClosestPoint(const T p[3], T max_dist,
+                                         const Q &prim_query,
+                                         H *result) const {
+  if (nodes_.empty()) {
+    return false;
+  }
 
-  const double min_x = ray_dir_sign[0] ? bmax[0] : bmin[0];
-  const double min_y = ray_dir_sign[1] ? bmax[1] : bmin[1];
-  const double min_z = ray_dir_sign[2] ? bmax[2] : bmin[2];
-  const double max_x = ray_dir_sign[0] ? bmin[0] : bmax[0];
-  const double max_y = ray_dir_sign[1] ? bmin[1] : bmax[1];
-  const double max_z = ray_dir_sign[2] ? bmin[2] : bmax[2];
+  const real3<T> query(p);
 
-  // X
-  const double tmin_x = (min_x - ray_org[0]) * ray_inv_dir[0];
-  // MaxMult robust BVH traversal(up to 4 ulp).
-  const double tmax_x =
-      (max_x - ray_org[0]) * ray_inv_dir[0] * 1.0000000000000004;
+  ClosestPointVisitor<Q, H> visitor(query, max_dist * max_dist, prim_query,
+                                    result);
+  TraverseNearestFirst(query, max_dist * max_dist, &visitor);
 
-  // Y
-  const double tmin_y = (min_y - ray_org[1]) * ray_inv_dir[1];
-  const double tmax_y =
-      (max_y - ray_org[1]) * ray_inv_dir[1] * 1.0000000000000004;
+  if (visitor.found()) {
+    (*result).distance = std::sqrt(visitor.best_dist2());
+  }
 
-  // Z
-  const double tmin_z = (min_z - ray_org[2]) * ray_inv_dir[2];
-  const double tmax_z =
-      (max_z - ray_org[2]) * ray_inv_dir[2] * 1.0000000000000004;
+  return visitor.found();
+}
 
-  tmin = safemax(tmin_z, safemax(tmin_y, safemax(tmin_x, min_t)));
-  tmax = safemin(tmax_z, safemin(tmax_y, safemin(tmax_x, max_t)));
+template <typename T, class A, typename NodeT>
+template <class Q, class H>
+size_t BVHAccel<T, A, NodeT>::ClosestPoints(const T *points, size_t num_points,
+                                            T max_dist, const Q &prim_query,
+                                            H *results,
+                                            unsigned char *found_flags,
+                                            unsigned int num_threads) const {
+  if (num_points == 0) {
+    return 0;
+  }
 
-  if (tmin <= tmax) {
-    (*tminOut) = tmin;
-    (*tmaxOut) = tmax;
+  const ClosestPointTask<Q, H> task(this, points, max_dist, prim_query,
+                                    results, found_flags);
 
-    return true;
-  }
-  return false;  // no hit
+  return RunStreamTasks(num_points, task, num_threads);
 }
 
-template <typename T>
-template <class I>
-inline bool BVHAccel<T>::TestLeafNode(const BVHNode<T> &node, const Ray<T> &ray,
-                                      const I &intersector) const {
-  bool hit = false;
+template <typename T, class A, typename NodeT>
+template <class Q>
+unsigned int BVHAccel<T, A, NodeT>::KNearestNeighbors(
+    const T p[3], unsigned int k, T max_dist, const Q &prim_query,
+    unsigned int *prim_ids, T *dist2s) const {
+  if (nodes_.empty() || (k == 0)) {
+    return 0;
+  }
 
-  unsigned int num_primitives = node.data[0];
-  unsigned int offset = node.data[1];
+  const real3<T> query(p);
 
-  T t = intersector.GetT();  // current hit distance
+  KNearestNeighborsVisitor<Q> visitor(query, k, max_dist * max_dist,
+                                      prim_query, prim_ids, dist2s);
+  TraverseNearestFirst(query, max_dist * max_dist, &visitor);
 
-  real3<T> ray_org;
-  ray_org[0] = ray.org[0];
-  ray_org[1] = ray.org[1];
-  ray_org[2] = ray.org[2];
+  const unsigned int num_found = visitor.num_found();
 
-  real3<T> ray_dir;
-  ray_dir[0] = ray.dir[0];
-  ray_dir[1] = ray.dir[1];
-  ray_dir[2] = ray.dir[2];
+  // Heap sort: move the farthest to the end.
+  for (unsigned int n = num_found; n > 1; n--) {
+    const unsigned int last_prim_id = prim_ids[n - 1];
+    const T last_dist2 = dist2s[n - 1];
+    prim_ids[n - 1] = prim_ids[0];
+    dist2s[n - 1] = dist2s[0];
 
-  for (unsigned int i = 0; i < num_primitives; i++) {
-    unsigned int prim_idx = indices_[i + offset];
+    unsigned int size = n - 1;
+    PushNeighbor(last_prim_id, last_dist2, size, prim_ids, dist2s, &size);
+  }
 
-    T local_t = t;
-    if (intersector.Intersect(&local_t, prim_idx)) {
-      // Update isect state
-      t = local_t;
+  return num_found;
+}
 
-      intersector.Update(t, prim_idx);
-      hit = true;
+template <typename T, class A, typename NodeT>
+void BVHAccel<T, A, NodeT>::SortQueryPoints(
+    const T *points, size_t num_points,
+    std::vector<StreamRayKey> *order) const {
+  T bmin[3], bmax[3];
+  BoundingBox(bmin, bmax);
+
+  T scale[3];
+  for (int k = 0; k < 3; k++) {
+    const T extent = bmax[k] - bmin[k];
+    scale[k] = (extent > static_cast<T>(0.0))
+                   ? static_cast<T>(1023.0) / extent
+                   : static_cast<T>(0.0);
+  }
+
+  order->resize(num_points);
+  for (size_t i = 0; i < num_points; i++) {
+    unsigned int q[3];
+    for (int k = 0; k < 3; k++) {
+      T x = (points[3 * i + k] - bmin[k]) * scale[k];
+      x = std::max(static_cast<T>(0.0), std::min(static_cast<T>(1023.0), x));
+      q[k] = static_cast<unsigned int>(x);
     }
+
+    (*order)[i].first = MortonCode3(q[0], q[1], q[2]);
+    (*order)[i].second = i;
   }
 
-  return hit;
+  std::sort(order->begin(), order->end());
 }
 
-#if 0  // TODO(LTE): Implement
-template <typename T> template<class I, class H, class Comp>
-bool BVHAccel<T>::MultiHitTestLeafNode(
-  std::priority_queue<H, std::vector<H>, Comp>  *isect_pq,
-  int max_intersections,
-  const BVHNode<T> &node,
-  const Ray<T> &ray,
-  const I &intersector) const {
-  bool hit = false;
-
-  unsigned int num_primitives = node.data[0];
-  unsigned int offset = node.data[1];
+template <typename T, class A, typename NodeT>
+template <class Q>
+size_t BVHAccel<T, A, NodeT>::KNearestNeighborsBatch(
+    const T *points, size_t num_points, unsigned int k, T max_dist,
+    const Q &prim_query, unsigned int *prim_ids, T *dist2s,
+    unsigned int *counts, unsigned int num_threads) const {
+  if (num_points == 0) {
+    return 0;
+  }
 
-  T t = std::numeric_limits<T>::max();
-  if (isect_pq->size() >= static_cast<size_t>(max_intersections)) {
-    t = isect_pq->top().t;  // current furthest hit distance
+  if (nodes_.empty() || (k == 0)) {
+    for (size_t i = 0; i < num_points; i++) {
+      counts[i] = 0;
+    }
+    return 0;
   }
 
-  real3<T> ray_org;
-  ray_org[0] = ray.org[0];
-  ray_org[1] = ray.org[1];
-  ray_org[2] = ray.org[2];
+  std::vector<StreamRayKey> order;
+  SortQueryPoints(points, num_points, &order);
 
-  real3<T> ray_dir;
-  ray_dir[0] = ray.dir[0];
-  ray_dir[1] = ray.dir[1];
-  ray_dir[2] = ray.dir[2];
+  const KNearestNeighborsTask<Q> task(this, points, &order, k, max_dist,
+                                      prim_query, prim_ids, dist2s, counts);
 
-  for (unsigned int i = 0; i < num_primitives; i++) {
-    unsigned int prim_idx = indices_[i + offset];
+  return RunStreamTasks(num_points, task, num_threads);
+}
+
+template <typename T, class A, typename NodeT>
+template <class V, class P, class F>
+size_t BVHAccel<T, A, NodeT>::OverlapTraverse(const V &volume, const P &prims,
+                                              F *callback) const {
+  if (nodes_.empty()) {
+    return 0;
+  }
 
-    T local_t = t, u = 0.0f, v = 0.0f;
+  size_t count = 0;
 
-    if (intersector.Intersect(&local_t, &u, &v, prim_idx))
-    {
-      // Update isect state
-      if ((local_t > ray.min_t))
-      {
-        if (isect_pq->size() < static_cast<size_t>(max_intersections))
-        {
-          H isect;
-          t = local_t;
-          isect.t = t;
-          isect.u = u;
-          isect.v = v;
-          isect.prim_id = prim_idx;
-          isect_pq->push(isect);
+  int node_stack_index = 0;
+  unsigned int node_stack[kNANORT_MAX_STACK_DEPTH];
+  node_stack[0] = 0;
 
-          // Update t to furthest distance.
-          t = ray.max_t;
+  while (node_stack_index >= 0) {
+    const Node &node = nodes_[node_stack[node_stack_index]];
 
-          hit = true;
-        }
-        else if (local_t < isect_pq->top().t)
-        {
-          // delete furthest intersection and add new intersection.
-          isect_pq->pop();
-
-          H hit;
-          hit.t = local_t;
-          hit.u = u;
-          hit.v = v;
-          hit.prim_id = prim_idx;
-          isect_pq->push(hit);
-
-          // Update furthest hit distance
-          t = isect_pq->top().t;
-
-          hit = true;
+    node_stack_index--;
+
+    const real3<T> node_bmin(static_cast<T>(node.bmin[0]),
+                             static_cast<T>(node.bmin[1]),
+                             static_cast<T>(node.bmin[2]));
+    const real3<T> node_bmax(static_cast<T>(node.bmax[0]),
+                             static_cast<T>(node.bmax[1]),
+                             static_cast<T>(node.bmax[2]));
+    if (!volume.Overlap(node_bmin, node_bmax)) {
+      continue;
+    }
+
+    if (node.flag == 0) {  // Branch node
+      node_stack[++node_stack_index] = node.data[1];
+      node_stack[++node_stack_index] = node.data[0];
+    } else {  // Leaf node
+      const unsigned int num_primitives = node.data[0];
+      const unsigned int offset = node.data[1];
+
+      for (unsigned int i = 0; i < num_primitives; i++) {
+        const unsigned int prim_idx = indices_[i + offset];
+
+        real3<T> bmin, bmax;
+        prims.BoundingBox(&bmin, &bmax, prim_idx);
+        if (volume.Overlap(bmin, bmax)) {
+          count++;
+          if (!(*callback)(prim_idx)) {
+            return count;
+          }
         }
       }
     }
   }
 
-  return hit;
+  return count;
 }
-#endif
 
-template <typename T>
-template <class I, class H>
-bool BVHAccel<T>::Traverse(const Ray<T> &ray, const I &intersector, H *isect,
-                           const BVHTraceOptions &options) const {
-  const int kMaxStackDepth = 512;
-  (void)kMaxStackDepth;
+template <typename T, class A, typename NodeT>
+template <class P, class F>
+size_t BVHAccel<T, A, NodeT>::OverlapBox(const T bmin[3], const T bmax[3],
+                                         const P &prims, F *callback) const {
+  return OverlapTraverse(OverlapBoxVolume(bmin, bmax), prims, callback);
+}
 
-  T hit_t = ray.max_t;
+template <typename T, class A, typename NodeT>
+template <class P>
+size_t BVHAccel<T, A, NodeT>::OverlapBox(const T bmin[3], const T bmax[3],
+                                         const P &prims,
+                                         unsigned int *prim_ids,
+                                         size_t max_prim_ids) const {
+  OverlapCollector collector(prim_ids, max_prim_ids);
+  return OverlapTraverse(OverlapBoxVolume(bmin, bmax), prims, &collector);
+}
 
-  int node_stack_index = 0;
-  unsigned int node_stack[512];
-  node_stack[0] = 0;
+template <typename T, class A, typename NodeT>
+template <class P, class F>
+size_t BVHAccel<T, A, NodeT>::OverlapSphere(const T center[3], T radius,
+                                            const P &prims,
+                                            F *callback) const {
+  return OverlapTraverse(OverlapSphereVolume(center, radius), prims, callback);
+}
 
-  // Init isect info as no hit
-  intersector.Update(hit_t, static_cast<unsigned int>(-1));
+template <typename T, class A, typename NodeT>
+template <class P>
+size_t BVHAccel<T, A, NodeT>::OverlapSphere(const T center[3], T radius,
+                                            const P &prims,
+                                            unsigned int *prim_ids,
+                                            size_t max_prim_ids) const {
+  OverlapCollector collector(prim_ids, max_prim_ids);
+  return OverlapTraverse(OverlapSphereVolume(center, radius), prims,
+                         &collector);
+}
 
-  intersector.PrepareTraversal(ray, options);
+template <typename T, class A, typename NodeT>
+template <class P>
+size_t BVHAccel<T, A, NodeT>::OverlapBoxes(const T *boxes, size_t num_boxes,
+                                           const P &prims,
+                                           unsigned int *prim_ids,
+                                           size_t max_prim_ids, size_t *counts,
+                                           unsigned int num_threads) const {
+  if (num_boxes == 0) {
+    return 0;
+  }
 
-  int dir_sign[3];
-  dir_sign[0] = ray.dir[0] < static_cast<T>(0.0) ? 1 : 0;
-  dir_sign[1] = ray.dir[1] < static_cast<T>(0.0) ? 1 : 0;
-  dir_sign[2] = ray.dir[2] < static_cast<T>(0.0) ? 1 : 0;
+  const OverlapTask<OverlapBoxVolume, P> task(this, boxes, prims, prim_ids,
+                                              max_prim_ids, counts);
 
-  real3<T> ray_inv_dir;
-  real3<T> ray_dir;
-  ray_dir[0] = ray.dir[0];
-  ray_dir[1] = ray.dir[1];
-  ray_dir[2] = ray.dir[2];
+  return RunStreamTasks(num_boxes, task, num_threads);
+}
 
-  ray_inv_dir = vsafe_inverse(ray_dir);
+template <typename T, class A, typename NodeT>
+template <class P>
+size_t BVHAccel<T, A, NodeT>::OverlapSpheres(const T *spheres,
+                                             size_t num_spheres,
+                                             const P &prims,
+                                             unsigned int *prim_ids,
+                                             size_t max_prim_ids,
+                                             size_t *counts,
+                                             unsigned int num_threads) const {
+  if (num_spheres == 0) {
+    return 0;
+  }
 
-  real3<T> ray_org;
-  ray_org[0] = ray.org[0];
-  ray_org[1] = ray.org[1];
-  ray_org[2] = ray.org[2];
+  const OverlapTask<OverlapSphereVolume, P> task(this, spheres, prims, prim_ids,
+                                                 max_prim_ids, counts);
 
-  T min_t = std::numeric_limits<T>::max();
-  T max_t = -std::numeric_limits<T>::max();
+  return RunStreamTasks(num_spheres, task, num_threads);
+}
+
+template <typename T, class A, typename NodeT>
+template <class Q, class F>
+size_t BVHAccel<T, A, NodeT>::OverlapNodePairs(const BVHAccel &other,
+                                               const T *transform,
+                                               const NodePair &root,
+                                               const Q &pair_test, F *callback,
+                                               bool *stopped) const {
+  size_t count = 0;
+
+  // Each step splits one node of the pair, so stack usage is at most the sum
+  // of both tree depths + 1.
+  int node_stack_index = 0;
+  NodePair node_stack[2 * kNANORT_MAX_STACK_DEPTH];
+  node_stack[0] = root;
 
   while (node_stack_index >= 0) {
-    unsigned int index = node_stack[node_stack_index];
-    const BVHNode<T> &node = nodes_[index];
+    const NodePair pair = node_stack[node_stack_index];
+    const Node &node = nodes_[pair.first];
+    const Node &other_node = other.nodes_[pair.second];
 
     node_stack_index--;
 
-    bool hit = IntersectRayAABB(&min_t, &max_t, ray.min_t, hit_t, node.bmin,
-                                node.bmax, ray_org, ray_inv_dir, dir_sign);
+    if (!NodePairOverlap(node, other_node, transform)) {
+      continue;
+    }
 
-    if (hit) {
-      // Branch node
-      if (node.flag == 0) {
-        int order_near = dir_sign[node.axis];
-        int order_far = 1 - order_near;
+    if (SplitFirstNode(node, other_node)) {
+      node_stack[++node_stack_index] = NodePair(node.data[1], pair.second);
+      node_stack[++node_stack_index] = NodePair(node.data[0], pair.second);
+    } else if (other_node.flag == 0) {
+      node_stack[++node_stack_index] = NodePair(pair.first, other_node.data[1]);
+      node_stack[++node_stack_index] = NodePair(pair.first, other_node.data[0]);
+    } else {  // Both are leaf nodes
+      for (unsigned int i = 0; i < node.data[0]; i++) {
+        const unsigned int prim_idx = indices_[node.data[1] + i];
+
+        for (unsigned int j = 0; j < other_node.data[0]; j++) {
+          const unsigned int other_prim_idx =
+              other.indices_[other_node.data[1] + j];
+
+          if (pair_test(prim_idx, other_prim_idx, transform)) {
+            count++;
+            if (!(*callback)(prim_idx, other_prim_idx)) {
+              (*stopped) = true;
+              return count;
+            }
+          }
+        }
+      }
+    }
+  }
 
-        // Traverse near first.
-        node_stack[++node_stack_index] = node.data[order_far];
-        node_stack[++node_stack_index] = node.data[order_near];
-      } else if (TestLeafNode(node, ray, intersector)) {  // Leaf node
-        hit_t = intersector.GetT();
+  return count;
+}
+
+template <typename T, class A, typename NodeT>
+template <class Q, class F>
+size_t BVHAccel<T, A, NodeT>::OverlapBVH(const BVHAccel &other,
+                                         const T *transform,
+                                         const Q &pair_test,
+                                         F *callback) const {
+  if (nodes_.empty() || other.nodes_.empty()) {
+    return 0;
+  }
+
+  bool stopped = false;
+  return OverlapNodePairs(other, transform, NodePair(0, 0), pair_test,
+                          callback, &stopped);
+}
+
+template <typename T, class A, typename NodeT>
+template <class Q>
+size_t BVHAccel<T, A, NodeT>::OverlapBVHPairs(
+    const BVHAccel &other, const T *transform, const Q &pair_test,
+    std::vector<std::pair<unsigned int, unsigned int> > *pairs,
+    unsigned int num_threads) const {
+  pairs->clear();
+
+  if (nodes_.empty() || other.nodes_.empty()) {
+    return 0;
+  }
+
+  // Split both trees into overlapping subtree pairs(breadth first) to
+  // distribute them over threads.
+  const size_t kMinSubtreePairs = 1024;
+
+  std::vector<NodePair> roots;
+  if (NodePairOverlap(nodes_[0], other.nodes_[0], transform)) {
+    roots.push_back(NodePair(0, 0));
+  }
+
+  bool split = true;
+  while (split && (roots.size() < kMinSubtreePairs)) {
+    split = false;
+
+    std::vector<NodePair> next_roots;
+    for (size_t i = 0; i < roots.size(); i++) {
+      const Node &node = nodes_[roots[i].first];
+      const Node &other_node = other.nodes_[roots[i].second];
+
+      NodePair children[2];
+      if (SplitFirstNode(node, other_node)) {
+        children[0] = NodePair(node.data[0], roots[i].second);
+        children[1] = NodePair(node.data[1], roots[i].second);
+      } else if (other_node.flag == 0) {
+        children[0] = NodePair(roots[i].first, other_node.data[0]);
+        children[1] = NodePair(roots[i].first, other_node.data[1]);
+      } else {  // Both are leaf nodes
+        next_roots.push_back(roots[i]);
+        continue;
+      }
+
+      split = true;
+      for (int c = 0; c < 2; c++) {
+        if (NodePairOverlap(nodes_[children[c].first],
+                            other.nodes_[children[c].second], transform)) {
+          next_roots.push_back(children[c]);
+        }
       }
     }
+
+    roots.swap(next_roots);
   }
 
-  assert(node_stack_index < kNANORT_MAX_STACK_DEPTH);
+  if (roots.empty()) {
+    return 0;
+  }
 
-  bool hit = (intersector.GetT() < ray.max_t);
-  intersector.PostTraversal(ray, hit, isect);
+  std::vector<std::vector<std::pair<unsigned int, unsigned int> > > root_pairs(
+      roots.size());
 
-  return hit;
+  const OverlapBVHTask<Q> task(this, &other, transform, &roots, pair_test,
+                               &root_pairs);
+
+  const size_t num_pairs = RunStreamTasks(roots.size(), task, num_threads);
+
+  pairs->reserve(num_pairs);
+  for (size_t i = 0; i < root_pairs.size(); i++) {
+    pairs->insert(pairs->end(), root_pairs[i].begin(), root_pairs[i].end());
+  }
+
+  return num_pairs;
 }
 
-template <typename T>
+template <typename T, class A, typename NodeT>
 template <class I>
-inline bool BVHAccel<T>::TestLeafNodeIntersections(
-    const BVHNode<T> &node, const Ray<T> &ray, const int max_intersections,
-    const I &intersector,
-    std::priority_queue<NodeHit<T>, std::vector<NodeHit<T> >,
-                        NodeHitComparator<T> > *isect_pq) const {
+inline bool BVHAccel<T, A, NodeT>::TestLeafNodeIntersections(
+    const Node &node, const Ray<T> &ray, const I &intersector,
+    NodeHitHeap *isect_heap) const {
   bool hit = false;
 
   unsigned int num_primitives = node.data[0];
@@ -2624,13 +8566,9 @@ inline bool BVHAccel<T>::TestLeafNodeIntersections(
       isect.t_max = max_t;
       isect.node_id = prim_idx;
 
-      if (isect_pq->size() < static_cast<size_t>(max_intersections)) {
-        isect_pq->push(isect);
-      } else if (min_t < isect_pq->top().t_min) {
-        // delete the furthest intersection and add a new intersection.
-        isect_pq->pop();
-
-        isect_pq->push(isect);
+      // Replaces the furthest intersection when the heap is full.
+      if (isect_heap->push(isect)) {
+        hit = true;
       }
     }
   }
@@ -2638,85 +8576,56 @@ inline bool BVHAccel<T>::TestLeafNodeIntersections(
   return hit;
 }
 
-template <typename T>
+template <typename T, class A, typename NodeT>
 template <class I>
-bool BVHAccel<T>::ListNodeIntersections(
+bool BVHAccel<T, A, NodeT>::ListNodeIntersections(
     const Ray<T> &ray, int max_intersections, const I &intersector,
     StackVector<NodeHit<T>, 128> *hits) const {
-  const int kMaxStackDepth = 512;
-
   T hit_t = ray.max_t;
 
+  // `Build` clamps and `Load` checks the tree depth(`kNANORT_MAX_TREE_DEPTH`),
+  // so the stack never overflows.
   int node_stack_index = 0;
-  unsigned int node_stack[512];
+  unsigned int node_stack[kNANORT_MAX_STACK_DEPTH];
   node_stack[0] = 0;
 
   // Stores furthest intersection at top
-  std::priority_queue<NodeHit<T>, std::vector<NodeHit<T> >,
-                      NodeHitComparator<T> >
-      isect_pq;
+  NodeHitHeap isect_heap(static_cast<size_t>(std::max(0, max_intersections)));
 
   (*hits)->clear();
 
-  int dir_sign[3];
-  dir_sign[0] = ray.dir[0] < static_cast<T>(0.0) ? 1 : 0;
-  dir_sign[1] = ray.dir[1] < static_cast<T>(0.0) ? 1 : 0;
-  dir_sign[2] = ray.dir[2] < static_cast<T>(0.0) ? 1 : 0;
-
-  real3<T> ray_inv_dir;
-  real3<T> ray_dir;
-
-  ray_dir[0] = ray.dir[0];
-  ray_dir[1] = ray.dir[1];
-  ray_dir[2] = ray.dir[2];
-
-  ray_inv_dir = vsafe_inverse(ray_dir);
-
-  real3<T> ray_org;
-  ray_org[0] = ray.org[0];
-  ray_org[1] = ray.org[1];
-  ray_org[2] = ray.org[2];
+  const NodeTraversalRay<NodeT, T> node_ray(ray);
 
-  T min_t, max_t;
+  NodeT min_t, max_t;
 
   while (node_stack_index >= 0) {
     unsigned int index = node_stack[node_stack_index];
-    const BVHNode<T> &node = nodes_[static_cast<size_t>(index)];
+    const Node &node = nodes_[static_cast<size_t>(index)];
 
     node_stack_index--;
 
-    bool hit = IntersectRayAABB(&min_t, &max_t, ray.min_t, hit_t, node.bmin,
-                                node.bmax, ray_org, ray_inv_dir, dir_sign);
+    bool hit = node_ray.Intersect(&min_t, &max_t, ray.min_t, hit_t, node);
 
     if (hit) {
       // Branch node
       if (node.flag == 0) {
-        int order_near = dir_sign[node.axis];
+        int order_near = node_ray.dir_sign[node.axis];
         int order_far = 1 - order_near;
 
         // Traverse near first.
         node_stack[++node_stack_index] = node.data[order_far];
         node_stack[++node_stack_index] = node.data[order_near];
       } else {  // Leaf node
-        TestLeafNodeIntersections(node, ray, max_intersections, intersector,
-                                  &isect_pq);
+        TestLeafNodeIntersections(node, ray, intersector, &isect_heap);
       }
     }
   }
 
-  assert(node_stack_index < kMaxStackDepth);
-  (void)kMaxStackDepth;
-
-  if (!isect_pq.empty()) {
-    // Store intesection in reverse order (make it frontmost order)
-    size_t n = isect_pq.size();
-    (*hits)->resize(n);
-
-    for (size_t i = 0; i < n; i++) {
-      const NodeHit<T> &isect = isect_pq.top();
-      (*hits)[n - i - 1] = isect;
-      isect_pq.pop();
-    }
+  if (!isect_heap.empty()) {
+    // Store intersections in frontmost order.
+    const size_t n = isect_heap.size();
+    const NodeHit<T> *sorted = isect_heap.sort();
+    (*hits)->assign(sorted, sorted + n);
 
     return true;
   }
@@ -2724,110 +8633,89 @@ bool BVHAccel<T>::ListNodeIntersections(
   return false;
 }
 
-#if 0  // TODO(LTE): Implement
-template <typename T> template<class I, class H, class Comp>
-bool BVHAccel<T>::MultiHitTraverse(const Ray<T> &ray,
-                                         int max_intersections,
-                                         const I &intersector,
-                                         StackVector<H, 128> *hits,
-                                         const BVHTraceOptions& options) const {
-  const int kMaxStackDepth = 512;
-
+template <typename T, class A, typename NodeT>
+template <class I, class H>
+bool BVHAccel<T, A, NodeT>::MultiHitTraverse(
+    const Ray<T> &ray, int max_intersections, const I &intersector,
+    StackVector<H, kNANORT_MAX_MULTI_HITS> *isects,
+    const BVHTraceOptions &options) const {
   T hit_t = ray.max_t;
 
   int node_stack_index = 0;
-  unsigned int node_stack[512];
+  unsigned int node_stack[kNANORT_MAX_STACK_DEPTH];
   node_stack[0] = 0;
 
   // Stores furthest intersection at top
-  std::priority_queue<H, std::vector<H>, Comp>  isect_pq;
+  BoundedMaxHeap<H, kNANORT_MAX_MULTI_HITS, HitDistanceComparator<H> >
+      isect_heap(static_cast<size_t>(std::max(0, max_intersections)));
 
-  (*hits)->clear();
+  (*isects)->clear();
+
+  if (max_intersections <= 0) {
+    return false;
+  }
 
   // Init isect info as no hit
   intersector.Update(hit_t, static_cast<unsigned int>(-1));
 
   intersector.PrepareTraversal(ray, options);
 
-  int dir_sign[3];
-  dir_sign[0] = ray.dir[0] < static_cast<T>(0.0) ? static_cast<T>(1) : static_cast<T>(0);
-  dir_sign[1] = ray.dir[1] < static_cast<T>(0.0) ? static_cast<T>(1) : static_cast<T>(0);
-  dir_sign[2] = ray.dir[2] < static_cast<T>(0.0) ? static_cast<T>(1) : static_cast<T>(0);
-
-  real3<T> ray_inv_dir;
-  real3<T> ray_dir;
-
-  ray_dir[0] = ray.dir[0];
-  ray_dir[1] = ray.dir[1];
-  ray_dir[2] = ray.dir[2];
+  const NodeTraversalRay<NodeT, T> node_ray(ray);
 
-  ray_inv_dir = vsafe_inverse(ray_dir);
+  const bool cull_masks =
+      !node_masks_.empty() && (ray.type != RAY_TYPE_NONE);
+  const bool motion = !motion_nodes_.empty();
 
-  real3<T> ray_org;
-  ray_org[0] = ray.org[0];
-  ray_org[1] = ray.org[1];
-  ray_org[2] = ray.org[2];
+  NodeT min_t, max_t;
 
-  T min_t, max_t;
+  Node motion_node;
 
-  while (node_stack_index >= 0)
-  {
+  while (node_stack_index >= 0) {
     unsigned int index = node_stack[node_stack_index];
-    const BVHNode<T> &node = nodes_[static_cast<size_t>(index)];
+    const Node &node = nodes_[static_cast<size_t>(index)];
 
     node_stack_index--;
 
-    bool hit = IntersectRayAABB(&min_t, &max_t, ray.min_t, hit_t, node.bmin,
-                                node.bmax, ray_org, ray_inv_dir, dir_sign);
+    if (cull_masks && !(node_masks_[index] & ray.type)) {
+      continue;
+    }
 
-    // branch node
-    if(hit)
-    {
-      if (node.flag == 0)
-      {
-        int order_near = dir_sign[node.axis];
+    if (motion) {
+      InterpolateNodeBounds(index, ray.time, &motion_node);
+    }
+
+    bool hit = node_ray.Intersect(&min_t, &max_t, ray.min_t, hit_t,
+                                  motion ? motion_node : node);
+
+    if (hit) {
+      // Branch node
+      if (node.flag == 0) {
+        int order_near = node_ray.dir_sign[node.axis];
         int order_far = 1 - order_near;
 
         // Traverse near first.
         node_stack[++node_stack_index] = node.data[order_far];
         node_stack[++node_stack_index] = node.data[order_near];
-      }
-      else
-      {
-        if (MultiHitTestLeafNode(&isect_pq, max_intersections, node, ray, intersector))
-        {
-          // Only update `hit_t` when queue is full.
-          if (isect_pq.size() >= static_cast<size_t>(max_intersections))
-          {
-            hit_t = isect_pq.top().t;
-          }
+      } else if (MultiHitTestLeafNode(&isect_heap, node, ray, intersector)) {
+        // Only update `hit_t` when the heap is full.
+        if (isect_heap.full()) {
+          hit_t = isect_heap.top().t;
         }
       }
     }
   }
 
-  assert(node_stack_index < kMaxStackDepth);
-  (void)kMaxStackDepth;
-
-  if (!isect_pq.empty())
-  {
-    // Store intesection in reverse order (make it frontmost order)
-    size_t n = isect_pq.size();
-    (*hits)->resize(n);
-
-    for (size_t i = 0; i < n; i++)
-    {
-      const H &isect = isect_pq.top();
-      (*hits)[n - i - 1] = isect;
-      isect_pq.pop();
-    }
-
-    return true;
+  if (isect_heap.empty()) {
+    return false;
   }
 
-  return false;
+  // Store intersections in frontmost order.
+  const size_t n = isect_heap.size();
+  const H *sorted = isect_heap.sort();
+  (*isects)->assign(sorted, sorted + n);
+
+  return true;
 }
-#endif
 
 #ifdef __clang__
 #pragma clang diagnostic pop
@@ -0,0 +1,225 @@
+// The SIMD leaf triangle test(`NANORT_ENABLE_SIMD`) must give bit-identical
+// results to the scalar watertight test, including rays through shared grid
+// edges and vertices(zero edge functions) and duplicated triangles(ties).
+//
+// Traversal with an intersection filter always uses the scalar test, so it is
+// the reference. The printed checksum must also be the same for SSE, AVX and
+// scalar builds(see Makefile.dev).
+#include "nanort.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+typedef float real;
+
+static unsigned int g_seed = 1;
+
+static real Rand01() {
+  g_seed = g_seed * 1103515245u + 12345u;
+  return real((g_seed >> 8) & 0xFFFFFF) / real(0x1000000);
+}
+
+// Accepts all hits. Forces the scalar(per-primitive) leaf test.
+class AcceptAllFilter {
+ public:
+  template <class I>
+  bool operator()(const nanort::Ray<real> &ray, const I &intersector, real t,
+                  unsigned int prim_id) const {
+    (void)ray;
+    (void)intersector;
+    (void)t;
+    (void)prim_id;
+    return true;
+  }
+};
+
+static unsigned int Bits(real x) {
+  unsigned int u;
+  memcpy(&u, &x, sizeof(u));
+  return u;
+}
+
+int main(int argc, char *argv[]) {
+  (void)argc;
+  (void)argv;
+
+  std::vector<real> vertices;
+  std::vector<unsigned int> faces;
+
+  // Indexed grid of unit quads on z = 0 and x = 0, two triangles per quad, so
+  // that neighbouring triangles share edges and vertices.
+  const int grid = 16;
+  for (int plane = 0; plane < 2; plane++) {
+    const unsigned int base = static_cast<unsigned int>(vertices.size() / 3);
+    for (int j = 0; j <= grid; j++) {
+      for (int i = 0; i <= grid; i++) {
+        real p[3] = {real(i - grid / 2), real(j - grid / 2), 0};
+        if (plane == 1) {
+          p[2] = p[0] + real(grid);
+          p[0] = 0;
+        }
+        vertices.push_back(p[0]);
+        vertices.push_back(p[1]);
+        vertices.push_back(p[2]);
+      }
+    }
+    for (int j = 0; j < grid; j++) {
+      for (int i = 0; i < grid; i++) {
+        const unsigned int v00 = base + unsigned(j * (grid + 1) + i);
+        const unsigned int v10 = v00 + 1;
+        const unsigned int v01 = v00 + unsigned(grid + 1);
+        const unsigned int v11 = v01 + 1;
+        const unsigned int quad[6] = {v00, v10, v11, v00, v11, v01};
+        faces.insert(faces.end(), quad, quad + 6);
+      }
+    }
+  }
+
+  // Duplicate some grid triangles(ties).
+  const size_t num_grid_faces = faces.size() / 3;
+  for (size_t i = 0; i < num_grid_faces; i += 5) {
+    faces.insert(faces.end(), faces.begin() + long(3 * i),
+                 faces.begin() + long(3 * i + 3));
+  }
+
+  // Random triangle soup.
+  for (unsigned int i = 0; i < 2000; i++) {
+    real c[3] = {Rand01() * 16 - 8, Rand01() * 16 - 8, Rand01() * 16 - 8};
+    for (int k = 0; k < 3; k++) {
+      faces.push_back(static_cast<unsigned int>(vertices.size() / 3));
+      for (int j = 0; j < 3; j++) {
+        vertices.push_back(c[j] + Rand01() - real(0.5));
+      }
+    }
+  }
+
+  const unsigned int num_faces = static_cast<unsigned int>(faces.size() / 3);
+  nanort::TriangleMesh<real> triangle_mesh(&vertices[0], &faces[0],
+                                           sizeof(real) * 3);
+  nanort::TriangleSAHPred<real> triangle_pred(&vertices[0], &faces[0],
+                                              sizeof(real) * 3);
+  nanort::BVHAccel<real> accel;
+  if (!accel.Build(num_faces, triangle_mesh, triangle_pred)) {
+    printf("Build failed\n");
+    return 1;
+  }
+
+  std::vector<nanort::Ray<real> > rays;
+
+  // Axis-aligned rays through grid vertices and edges.
+  for (int j = -grid; j <= grid; j++) {
+    for (int i = -grid; i <= grid; i++) {
+      const real x = real(i) * real(0.5);
+      const real y = real(j) * real(0.5);
+      for (int sign = 0; sign < 2; sign++) {
+        nanort::Ray<real> ray;
+        ray.org[0] = x;
+        ray.org[1] = y;
+        ray.org[2] = sign ? real(-20) : real(20);
+        ray.dir[0] = 0;
+        ray.dir[1] = 0;
+        ray.dir[2] = sign ? real(1) : real(-1);
+        rays.push_back(ray);
+
+        ray.org[0] = sign ? real(-20) : real(20);
+        ray.org[1] = y;
+        ray.org[2] = x + real(grid);
+        ray.dir[0] = sign ? real(1) : real(-1);
+        ray.dir[1] = 0;
+        ray.dir[2] = 0;
+        rays.push_back(ray);
+      }
+    }
+  }
+
+  // Diagonal rays through grid vertices(and along diagonal edges).
+  for (int j = -grid / 2; j <= grid / 2; j++) {
+    for (int i = -grid / 2; i <= grid / 2; i++) {
+      nanort::Ray<real> ray;
+      ray.org[0] = real(i) - 1;
+      ray.org[1] = real(j) - 1;
+      ray.org[2] = 1;
+      ray.dir[0] = 1;
+      ray.dir[1] = 1;
+      ray.dir[2] = -1;
+      rays.push_back(ray);
+    }
+  }
+
+  // Rays from random origins aimed at grid vertices. Edge functions round to
+  // zero in single precision.
+  for (int i = 0; i < 20000; i++) {
+    nanort::Ray<real> ray;
+    const real target[3] = {real(int(Rand01() * grid) - grid / 2),
+                            real(int(Rand01() * grid) - grid / 2), 0};
+    real d[3];
+    for (int k = 0; k < 3; k++) {
+      ray.org[k] = Rand01() * 40 - 20;
+      d[k] = target[k] - ray.org[k];
+    }
+    const real len = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+    for (int k = 0; k < 3; k++) {
+      ray.dir[k] = d[k] / len;
+    }
+    rays.push_back(ray);
+  }
+
+  // Random rays.
+  for (int i = 0; i < 20000; i++) {
+    nanort::Ray<real> ray;
+    real d[3];
+    for (int k = 0; k < 3; k++) {
+      ray.org[k] = Rand01() * 40 - 20;
+      d[k] = Rand01() * 2 - 1;
+    }
+    const real len = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+    for (int k = 0; k < 3; k++) {
+      ray.dir[k] = d[k] / len;
+    }
+    rays.push_back(ray);
+  }
+
+  nanort::TriangleIntersector<real> triangle_intersector(triangle_mesh);
+
+  nanort::BVHTraceOptions options[3];
+  options[1].cull_back_face = true;
+  options[2].prim_ids_range[0] = 100;
+  options[2].prim_ids_range[1] = num_faces / 2;
+
+  size_t num_hits = 0;
+  size_t num_errors = 0;
+  unsigned int checksum = 0;
+  for (int o = 0; o < 3; o++) {
+    for (size_t i = 0; i < rays.size(); i++) {
+      nanort::TriangleIntersection<real> isect, ref;
+      isect.prim_id = ref.prim_id = static_cast<unsigned int>(-1);
+      const bool hit =
+          accel.Traverse(rays[i], triangle_intersector, &isect, options[o]);
+      const bool ref_hit = accel.Traverse(rays[i], triangle_intersector, &ref,
+                                          options[o], AcceptAllFilter());
+      if (hit != ref_hit ||
+          (hit && (Bits(isect.t) != Bits(ref.t) ||
+                   Bits(isect.u) != Bits(ref.u) ||
+                   Bits(isect.v) != Bits(ref.v) ||
+                   isect.prim_id != ref.prim_id))) {
+        printf("options %d ray %zu: leaf test differs from scalar test\n", o,
+               i);
+        num_errors++;
+      }
+      if (ref_hit) {
+        num_hits++;
+        checksum = checksum * 31u + Bits(ref.t);
+        checksum = checksum * 31u + Bits(ref.u);
+        checksum = checksum * 31u + Bits(ref.v);
+        checksum = checksum * 31u + ref.prim_id;
+      }
+    }
+  }
+
+  printf("%zu hits, checksum %08x, %zu errors\n", num_hits, checksum,
+         num_errors);
+
+  return (num_errors == 0) ? 0 : 1;
+}
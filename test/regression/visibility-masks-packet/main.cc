@@ -0,0 +1,133 @@
+// Packet and stream traversal must honor visibility masks
+// (`BVHAccel::SetPrimitiveMasks`) in the same way as `Traverse`.
+//
+// g++ -I../../../ -std=c++11 -O2 -o masks main.cc
+#include "nanort.h"
+
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+typedef float real;
+
+static unsigned int g_seed = 1;
+
+static real Rand01() {
+  g_seed = g_seed * 1103515245u + 12345u;
+  return real((g_seed >> 8) & 0xFFFFFF) / real(0x1000000);
+}
+
+int main(int argc, char *argv[]) {
+  (void)argc;
+  (void)argv;
+
+  // Random triangle soup.
+  const unsigned int num_faces = 5000;
+  std::vector<real> vertices(num_faces * 9);
+  std::vector<unsigned int> faces(num_faces * 3);
+  for (unsigned int i = 0; i < num_faces; i++) {
+    real c[3] = {Rand01() * 10 - 5, Rand01() * 10 - 5, Rand01() * 10 - 5};
+    for (int k = 0; k < 3; k++) {
+      for (int j = 0; j < 3; j++) {
+        vertices[9 * i + 3 * k + j] = c[j] + Rand01() - real(0.5);
+      }
+      faces[3 * i + k] = 3 * i + k;
+    }
+  }
+
+  nanort::TriangleMesh<real> triangle_mesh(&vertices[0], &faces[0],
+                                           sizeof(real) * 3);
+  nanort::TriangleSAHPred<real> triangle_pred(&vertices[0], &faces[0],
+                                              sizeof(real) * 3);
+  nanort::BVHAccel<real> accel;
+  if (!accel.Build(num_faces, triangle_mesh, triangle_pred)) {
+    printf("Build failed\n");
+    return 1;
+  }
+
+  // Alternating masks: even faces are visible to primary rays only, odd faces
+  // to secondary rays only.
+  std::vector<unsigned int> masks(num_faces);
+  for (unsigned int i = 0; i < num_faces; i++) {
+    masks[i] = (i & 1) ? nanort::RAY_TYPE_SECONDARY : nanort::RAY_TYPE_PRIMARY;
+  }
+  accel.SetPrimitiveMasks(&masks[0]);
+
+  // Coherent rays from a few origins(so that packets stay coherent) with
+  // mixed ray types.
+  const size_t num_rays = 4096;
+  std::vector<nanort::Ray<real> > rays(num_rays);
+  const unsigned int types[3] = {nanort::RAY_TYPE_PRIMARY,
+                                 nanort::RAY_TYPE_SECONDARY,
+                                 nanort::RAY_TYPE_NONE};
+  for (size_t i = 0; i < num_rays; i++) {
+    nanort::Ray<real> &ray = rays[i];
+    const size_t origin = i / 1024;
+    ray.org[0] = real(origin) * 2 - 3;
+    ray.org[1] = real(origin) - 8;
+    ray.org[2] = -8;
+    real d[3] = {Rand01() - real(0.5), Rand01() * real(0.5) + real(0.3),
+                 real(1.0)};
+    const real len = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+    for (int k = 0; k < 3; k++) {
+      ray.dir[k] = d[k] / len;
+    }
+    ray.min_t = 0;
+    ray.max_t = real(1.0e+30);
+    ray.type = types[(i / 7) % 3];
+  }
+
+  nanort::TriangleIntersector<real> triangle_intersector(triangle_mesh);
+  nanort::TrianglePacketIntersector<real, 8> packet_intersector(
+      triangle_mesh);
+
+  std::vector<nanort::TriangleIntersection<real> > isects(num_rays);
+  std::vector<unsigned char> hit_flags(num_rays);
+  std::vector<unsigned char> occluded(num_rays);
+  accel.TraverseStream(&rays[0], num_rays, packet_intersector, &isects[0],
+                       &hit_flags[0]);
+  accel.OccludedStream(&rays[0], num_rays, packet_intersector, &occluded[0]);
+
+  size_t num_hits = 0;
+  size_t num_errors = 0;
+  for (size_t i = 0; i < num_rays; i++) {
+    const nanort::Ray<real> &ray = rays[i];
+
+    nanort::TriangleIntersection<real> isect;
+    isect.prim_id = static_cast<unsigned int>(-1);
+    const bool hit = accel.Traverse(ray, triangle_intersector, &isect);
+    num_hits += hit ? 1 : 0;
+
+    if (hit && ray.type && !(masks[isect.prim_id] & ray.type)) {
+      printf("ray %zu: Traverse hit masked face %u\n", i, isect.prim_id);
+      num_errors++;
+    }
+
+    if ((hit_flags[i] != 0) != hit ||
+        (hit && (isects[i].prim_id != isect.prim_id ||
+                 isects[i].t != isect.t))) {
+      printf("ray %zu: TraverseStream differs from Traverse\n", i);
+      num_errors++;
+    }
+
+    if ((occluded[i] != 0) != hit ||
+        accel.Occluded(ray, triangle_intersector) != hit) {
+      printf("ray %zu: OccludedStream/Occluded differs from Traverse\n", i);
+      num_errors++;
+    }
+
+    nanort::StackVector<nanort::TriangleIntersection<real>,
+                        kNANORT_MAX_MULTI_HITS>
+        multi_isects;
+    const bool multi_hit = accel.MultiHitTraverse(
+        ray, 4, triangle_intersector, &multi_isects);
+    if (multi_hit != hit || (hit && multi_isects[0].prim_id != isect.prim_id)) {
+      printf("ray %zu: MultiHitTraverse differs from Traverse\n", i);
+      num_errors++;
+    }
+  }
+
+  printf("%zu hits of %zu rays, %zu errors\n", num_hits, num_rays, num_errors);
+
+  return (num_errors == 0) ? 0 : 1;
+}